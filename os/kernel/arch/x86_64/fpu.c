@@ -0,0 +1,243 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Lazy FPU/SSE/AVX state
+//
+// The kernel itself is built without SSE, so the extended registers only
+// ever hold thread state. Each thread gets an XSAVE area sized from CPUID
+// leaf 0xD. On a switch the outgoing thread's registers are saved only if
+// it used them during its slice (CR0.TS still clear), and the incoming
+// thread's are not loaded at all: TS is set and its first FPU/SIMD
+// instruction traps (#NM) into fpu_trap, which restores them. Integer-only
+// threads never trap and never save. If a thread comes back to a CPU whose
+// registers still hold its state, TS stays clear and nothing is reloaded.
+//
+// Saves prefer XSAVES (compacted, modified-only), then XSAVEOPT, then
+// XSAVE; CPUs without XSAVE use FXSAVE. Contexts that are not threads
+// (the boot path, user mode entered from kmain) get clean registers and
+// nothing is kept for them.
+
+#define CR0_MP          (1u << 1)
+#define CR0_EM          (1u << 2)
+#define CR0_TS          (1u << 3)
+#define CR4_OSFXSR      (1u << 9)
+#define CR4_OSXMMEXCPT  (1u << 10)
+#define CR4_OSXSAVE     (1u << 18)
+
+#define MSR_XSS         0xDA0
+
+#define XFEATURE_X87    (1u << 0)
+#define XFEATURE_SSE    (1u << 1)
+#define XFEATURE_AVX    (1u << 2)
+#define XFEATURE_AVX512 (7u << 5)       // Opmask, ZMM_Hi256, Hi16_ZMM
+
+#define FXSAVE_SIZE     512
+#define XSAVE_HDR_SIZE  64
+#define XCOMP_BV_COMPACT (1ULL << 63)
+
+#define FPU_NO_CPU      0xFFFFFFFFu
+
+// #NM stub (timer.S)
+extern void nm_fault_handler(void);
+
+typedef enum {
+    FPU_FXSAVE = 0,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+    FPU_XSAVES
+} fpu_mode_t;
+
+static fpu_mode_t fpu_mode;
+static u64 xfeatures;                       // XCR0
+static u32 area_size;
+static fpu_t *fpu_owner[SMP_MAX_CPUS];      // Whose state the registers hold
+
+// Restored for contexts with no state of their own: header all zero (every
+// component in its init state), plus the legacy control words
+static u8 fpu_init_area[FXSAVE_SIZE + XSAVE_HDR_SIZE] __attribute__((aligned(64)));
+
+static inline u64 read_cr0(void) {
+    u64 cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(u64 cr0) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline void clts(void) {
+    __asm__ volatile("clts" : : : "memory");
+}
+
+static void xsetbv(u32 index, u64 value) {
+    __asm__ volatile("xsetbv" : : "c"(index), "a"((u32)value), "d"((u32)(value >> 32)));
+}
+
+static void fpu_save(void *area) {
+    u32 lo = (u32)xfeatures;
+    u32 hi = (u32)(xfeatures >> 32);
+    switch (fpu_mode) {
+        case FPU_XSAVES:
+            __asm__ volatile("xsaves64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVEOPT:
+            __asm__ volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVE:
+            __asm__ volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_FXSAVE:
+            __asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+            break;
+    }
+}
+
+static void fpu_restore(void *area) {
+    u32 lo = (u32)xfeatures;
+    u32 hi = (u32)(xfeatures >> 32);
+    switch (fpu_mode) {
+        case FPU_XSAVES:
+            __asm__ volatile("xrstors64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVEOPT:
+        case FPU_XSAVE:
+            __asm__ volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_FXSAVE:
+            __asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+            break;
+    }
+}
+
+// Fill an area with the init state: control words at their reset values
+// (FCW 0x37F, MXCSR 0x1F80, all exceptions masked), an all-zero XSAVE
+// header, and the compaction bit XRSTORS insists on
+static void fpu_area_init(u8 *area, u32 size) {
+    for (u32 i = 0; i < size; i++) area[i] = 0;
+    *(u16 *)(area + 0) = 0x37F;
+    *(u32 *)(area + 24) = 0x1F80;
+    if (fpu_mode == FPU_XSAVES) {
+        *(u64 *)(area + FXSAVE_SIZE + 8) = XCOMP_BV_COMPACT | xfeatures;
+    }
+}
+
+// Per-CPU setup: enable FXSAVE/SSE and, if present, XSAVE with every user
+// state component we manage. The boot CPU also picks the save instruction
+// and the area size.
+void fpu_init(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    bool has_xsave = (ecx & (1u << 26)) != 0;
+    
+    // FPU present and monitored (MP), not emulated; TS set until first use
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+    
+    u64 cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (has_xsave) cr4 |= CR4_OSXSAVE;
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+    
+    bool boot = smp_cpu_id() == 0 && !area_size;
+    if (boot) {
+        fpu_mode = FPU_FXSAVE;
+        xfeatures = XFEATURE_X87 | XFEATURE_SSE;
+        area_size = FXSAVE_SIZE;
+    }
+    
+    if (has_xsave) {
+        if (boot) {
+            // Supported user state components: keep x87, SSE, AVX and the
+            // AVX-512 group only when all of it is there
+            __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(0));
+            u64 supported = ((u64)edx << 32) | eax;
+            xfeatures = supported & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX);
+            if ((supported & XFEATURE_AVX512) == XFEATURE_AVX512) xfeatures |= XFEATURE_AVX512;
+            fpu_mode = FPU_XSAVE;
+        }
+        xsetbv(0, xfeatures);
+    
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(1));
+        if (eax & (1u << 3)) {
+            // No supervisor components: IA32_XSS stays empty
+            write_msr(MSR_XSS, 0);
+            if (boot) {
+                fpu_mode = FPU_XSAVES;
+                area_size = ebx;
+            }
+        } else if (boot) {
+            if (eax & (1u << 0)) fpu_mode = FPU_XSAVEOPT;
+            // Standard format: size for the components enabled in XCR0
+            __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(0));
+            area_size = ebx;
+        }
+    }
+    
+    if (boot) {
+        idt_set_gate(7, (u64)nm_fault_handler, 0x08, 0x8E);
+        fpu_area_init(fpu_init_area, sizeof(fpu_init_area));
+        switch (fpu_mode) {
+            case FPU_XSAVES: serial_puts("[FPU] Using XSAVES/XRSTORS\r\n"); break;
+            case FPU_XSAVEOPT: serial_puts("[FPU] Using XSAVEOPT/XRSTOR\r\n"); break;
+            case FPU_XSAVE: serial_puts("[FPU] Using XSAVE/XRSTOR\r\n"); break;
+            case FPU_FXSAVE: serial_puts("[FPU] No XSAVE, using FXSAVE/FXRSTOR\r\n"); break;
+        }
+    }
+}
+
+// Give a new thread its save area, holding the init state. The area has
+// to be 64-byte aligned; kmalloc does not promise that.
+bool fpu_alloc(fpu_t *f) {
+    f->alloc = kmalloc(area_size + 63);
+    if (!f->alloc) return false;
+    
+    f->area = (void *)(((u64)f->alloc + 63) & ~63ULL);
+    f->cpu = FPU_NO_CPU;
+    fpu_area_init(f->area, area_size);
+    return true;
+}
+
+void fpu_free(fpu_t *f) {
+    if (f->alloc) kfree(f->alloc);
+    f->alloc = NULL;
+    f->area = NULL;
+    f->cpu = FPU_NO_CPU;
+}
+
+// Called on every thread switch with interrupts off; prev and next are NULL
+// for the CPU's scheduler loop
+void fpu_switch(fpu_t *prev, fpu_t *next) {
+    u32 cpu = smp_cpu_id();
+    u64 cr0 = read_cr0();
+    
+    // TS clear: prev touched the registers this slice, keep what it did
+    if (!(cr0 & CR0_TS) && prev && prev->area && fpu_owner[cpu] == prev) {
+        fpu_save(prev->area);
+    }
+    
+    // Registers still hold next's latest state: no trap, no reload
+    if (next && fpu_owner[cpu] == next && next->cpu == cpu) {
+        if (cr0 & CR0_TS) clts();
+    } else if (!(cr0 & CR0_TS)) {
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+// #NM: the running context used the FPU with TS set. Load its state (the
+// previous owner's was saved when it was switched out).
+void fpu_trap(void) {
+    clts();
+    
+    u32 cpu = smp_cpu_id();
+    fpu_t *f = sched_current_fpu();
+    if (!f || !f->area) {
+        fpu_restore(fpu_init_area);
+        fpu_owner[cpu] = NULL;
+        return;
+    }
+    
+    fpu_restore(f->area);
+    f->cpu = cpu;
+    fpu_owner[cpu] = f;
+}
\ No newline at end of file
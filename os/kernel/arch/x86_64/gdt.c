@@ -64,108 +64,128 @@ struct gdt_ptr {
 // TSS type for system descriptor
 #define TSS_TYPE_AVAILABLE  0x09
 
-// Static GDT table (8 entries + TSS takes 2 entries = 10 total)
-static struct gdt_entry gdt[10];
-static struct gdt_ptr gdt_pointer;
-static struct tss_entry tss __attribute__((section(".tss")));
+// Static GDT table (8 entries + TSS takes 2 entries = 10 total), one per
+// CPU since each CPU's TSS descriptor is marked busy when it is loaded.
+// GDT, TSS and the ring-0 stacks live in .entry.data: the CPU touches them
+// on every user->kernel transition, so PTI maps them in user page tables.
+static struct gdt_entry gdt[SMP_MAX_CPUS][10] SECTION(".entry.data");
+static struct gdt_ptr gdt_pointer[SMP_MAX_CPUS];
+static struct tss_entry tss[SMP_MAX_CPUS] SECTION(".entry.data");
 
-// Kernel stacks for interrupts (8KB each)
-static u8 kernel_stack[8192] __attribute__((aligned(16)));
-static u8 interrupt_stack[8192] __attribute__((aligned(16)));
+// Kernel stacks for interrupts (8KB each, per CPU)
+static u8 kernel_stack[SMP_MAX_CPUS][8192] __attribute__((aligned(16))) SECTION(".entry.data");
+static u8 interrupt_stack[SMP_MAX_CPUS][8192] __attribute__((aligned(16))) SECTION(".entry.data");
+
+// IRETQ trampoline in syscall_entry.S (switches to the PTI user CR3)
+extern void user_iret(u64 rip, u64 rsp, u64 rflags) NORETURN;
 
 // External assembly function to load GDT and TSS
 extern void gdt_flush(u64 gdt_ptr);
 extern void tss_flush(u16 tss_selector);
 
 // Set a GDT entry
-static void gdt_set_entry(int index, u64 base, u64 limit, u8 access, u8 granularity) {
-    gdt[index].base_low = base & 0xFFFF;
-    gdt[index].base_mid = (base >> 16) & 0xFF;
-    gdt[index].base_high = (base >> 24) & 0xFF;
-    
-    gdt[index].limit_low = limit & 0xFFFF;
-    gdt[index].granularity = (limit >> 16) & 0x0F;
-    gdt[index].granularity |= granularity & 0xF0;
-    gdt[index].access = access;
+static void gdt_set_entry(struct gdt_entry *g, int index, u64 base, u64 limit, u8 access, u8 granularity) {
+    g[index].base_low = base & 0xFFFF;
+    g[index].base_mid = (base >> 16) & 0xFF;
+    g[index].base_high = (base >> 24) & 0xFF;
+    
+    g[index].limit_low = limit & 0xFFFF;
+    g[index].granularity = (limit >> 16) & 0x0F;
+    g[index].granularity |= granularity & 0xF0;
+    g[index].access = access;
 }
 
 // Set a TSS entry (takes 2 GDT entries in 64-bit mode)
-static void gdt_set_tss(int index, u64 base, u64 limit, u8 access) {
+static void gdt_set_tss(struct gdt_entry *g, int index, u64 base, u64 limit, u8 access) {
     // TSS descriptors are 16 bytes in 64-bit mode
-    gdt_set_entry(index, base, limit, access, 0);
+    gdt_set_entry(g, index, base, limit, access, 0);
     
     // Second part of TSS descriptor (high 32 bits of base)
-    gdt[index + 1].limit_low = (base >> 32) & 0xFFFF;
-    gdt[index + 1].base_low = (base >> 48) & 0xFFFF;
-    gdt[index + 1].base_mid = 0;
-    gdt[index + 1].access = 0;
-    gdt[index + 1].granularity = 0;
-    gdt[index + 1].base_high = 0;
+    g[index + 1].limit_low = (base >> 32) & 0xFFFF;
+    g[index + 1].base_low = (base >> 48) & 0xFFFF;
+    g[index + 1].base_mid = 0;
+    g[index + 1].access = 0;
+    g[index + 1].granularity = 0;
+    g[index + 1].base_high = 0;
 }
 
-// Initialize GDT with kernel and user segments
-void gdt_init(void) {
-    serial_puts("[GDT] Initializing Global Descriptor Table\r\n");
+// Fill in a CPU's GDT with kernel and user segments
+static void gdt_build(u32 cpu) {
+    struct gdt_entry *g = gdt[cpu];
     
     // Clear GDT
     for (int i = 0; i < 10; i++) {
-        gdt_set_entry(i, 0, 0, 0, 0);
+        gdt_set_entry(g, i, 0, 0, 0, 0);
     }
     
     // Entry 0: NULL descriptor (required)
-    gdt_set_entry(0, 0, 0, 0, 0);
+    gdt_set_entry(g, 0, 0, 0, 0, 0);
     
     // Entry 1: Kernel code segment (64-bit, DPL=0, R+X)
-    gdt_set_entry(1, 0, 0xFFFFF, 
+    gdt_set_entry(g, 1, 0, 0xFFFFF, 
                   GDT_PRESENT | GDT_DPL0 | GDT_CODE_DATA | GDT_EXECUTABLE | GDT_READABLE,
                   GDT_4K | GDT_64BIT);
     
     // Entry 2: Kernel data segment (DPL=0, R+W, D/B=0 for long mode)
-    gdt_set_entry(2, 0, 0xFFFFF,
+    gdt_set_entry(g, 2, 0, 0xFFFFF,
                   GDT_PRESENT | GDT_DPL0 | GDT_CODE_DATA | GDT_WRITABLE,
                   GDT_4K);
     
     // Entry 3: User code segment (64-bit, DPL=3, R+X)
-    gdt_set_entry(3, 0, 0xFFFFF,
+    gdt_set_entry(g, 3, 0, 0xFFFFF,
                   GDT_PRESENT | GDT_DPL3 | GDT_CODE_DATA | GDT_EXECUTABLE | GDT_READABLE,
                   GDT_4K | GDT_64BIT);
     
     // Entry 4: User data segment (DPL=3, R+W, D/B=0 for long mode)
-    gdt_set_entry(4, 0, 0xFFFFF,
+    gdt_set_entry(g, 4, 0, 0xFFFFF,
                   GDT_PRESENT | GDT_DPL3 | GDT_CODE_DATA | GDT_WRITABLE,
                   GDT_4K);
     
     // Setup GDT pointer
-    gdt_pointer.limit = sizeof(gdt) - 1;
-    gdt_pointer.base = (u64)&gdt;
-    
-    serial_puts("[GDT] Loading GDT...\r\n");
-    gdt_flush((u64)&gdt_pointer);
-    
-    serial_puts("[GDT] GDT loaded successfully\r\n");
+    gdt_pointer[cpu].limit = sizeof(gdt[cpu]) - 1;
+    gdt_pointer[cpu].base = (u64)g;
 }
 
-// Initialize TSS for privilege level transitions
-void tss_init(void) {
-    serial_puts("[TSS] Initializing Task State Segment\r\n");
+// Fill in a CPU's TSS and its descriptor
+static void tss_build(u32 cpu) {
+    struct tss_entry *t = &tss[cpu];
     
     // Clear TSS
-    for (u64 i = 0; i < sizeof(tss); i++) {
-        ((u8*)&tss)[i] = 0;
+    for (u64 i = 0; i < sizeof(*t); i++) {
+        ((u8*)t)[i] = 0;
     }
     
     // Set kernel stack pointer (ring 0 stack)
-    tss.rsp0 = (u64)(kernel_stack + sizeof(kernel_stack));
+    t->rsp0 = (u64)(kernel_stack[cpu] + sizeof(kernel_stack[cpu]));
     
     // Set interrupt stack (IST1) for double faults, etc.
-    tss.ist1 = (u64)(interrupt_stack + sizeof(interrupt_stack));
+    t->ist1 = (u64)(interrupt_stack[cpu] + sizeof(interrupt_stack[cpu]));
     
     // I/O map base (beyond TSS limit = no I/O map)
-    tss.iomap_base = sizeof(tss);
+    t->iomap_base = sizeof(*t);
     
     // Add TSS to GDT (entries 5-6, TSS takes 2 entries in 64-bit)
-    gdt_set_tss(5, (u64)&tss, sizeof(tss) - 1, 
+    gdt_set_tss(gdt[cpu], 5, (u64)t, sizeof(*t) - 1,
                 GDT_PRESENT | GDT_DPL0 | TSS_TYPE_AVAILABLE);
+}
+
+// Initialize GDT with kernel and user segments (boot CPU)
+void gdt_init(void) {
+    serial_puts("[GDT] Initializing Global Descriptor Table\r\n");
+    
+    gdt_build(0);
+    
+    serial_puts("[GDT] Loading GDT...\r\n");
+    gdt_flush((u64)&gdt_pointer[0]);
+    
+    serial_puts("[GDT] GDT loaded successfully\r\n");
+}
+
+// Initialize TSS for privilege level transitions (boot CPU)
+void tss_init(void) {
+    serial_puts("[TSS] Initializing Task State Segment\r\n");
+    
+    tss_build(0);
     
     serial_puts("[TSS] Loading TSS...\r\n");
     tss_flush(TSS_SEL);
@@ -173,14 +193,22 @@ void tss_init(void) {
     serial_puts("[TSS] TSS loaded successfully\r\n");
 }
 
+// Own GDT and TSS for an application processor
+void gdt_init_ap(u32 cpu) {
+    gdt_build(cpu);
+    tss_build(cpu);
+    gdt_flush((u64)&gdt_pointer[cpu]);
+    tss_flush(TSS_SEL);
+}
+
 // Get current kernel stack for syscall entry
 u64 get_kernel_stack(void) {
-    return tss.rsp0;
+    return tss[smp_cpu_id()].rsp0;
 }
 
 // Update kernel stack (for per-process kernel stacks later)
 void set_kernel_stack(u64 stack_top) {
-    tss.rsp0 = stack_top;
+    tss[smp_cpu_id()].rsp0 = stack_top;
 }
 
 // Enter user mode for the first time
@@ -228,17 +256,10 @@ void enter_user(u64 rip, u64 rsp, u64 rflags) {
     
     serial_puts("[GDT] Stack aligned, executing IRETQ...\r\n");
     
-    // Use IRETQ to enter user mode (can't use SYSRET from kernel cold start)
-    __asm__ volatile(
-        "mov %0, %%rax \n\t"        // rsp
-        "pushq %1       \n\t"       // SS (UDATA|3)
-        "pushq %%rax    \n\t"       // RSP
-        "pushq %2       \n\t"       // RFLAGS (with IF=1)
-        "pushq %3       \n\t"       // CS (UCODE|3)
-        "pushq %4       \n\t"       // RIP
-        "iretq"
-        : : "r"(aligned_rsp), "i"(UDATA_SEL|3), "r"(clean_rflags),
-            "i"(UCODE_SEL|3), "r"(rip) : "rax","memory");
+    // Use IRETQ to enter user mode (can't use SYSRET from kernel cold start).
+    // The trampoline builds the frame on the entry stack so it stays mapped
+    // after the PTI switch to the user page tables.
+    user_iret(rip, aligned_rsp, clean_rflags);
     
     // Should never reach here
     serial_puts("[GDT] ERROR: Return from user mode!\r\n");
@@ -20,8 +20,9 @@ struct idt_ptr {
     u64 base;
 } __attribute__((packed));
 
-// Minimal IDT with 32 entries
-static struct idt_entry idt[32];
+// Minimal IDT with 32 entries (entry data: read by the CPU on delivery, so
+// PTI keeps it mapped in the user page tables)
+static struct idt_entry idt[256] SECTION(".entry.data");
 static struct idt_ptr idt_pointer;
 
 // Fault handler declarations
@@ -38,7 +39,33 @@ extern void isr_13(void);
 extern void isr_14(void);
 
 // Specific fault handler stubs
+// The stubs live in .entry.text. With PTI enabled they switch to the kernel
+// page tables when the fault came from ring 3 (saved CS RPL != 0) and back
+// before IRETQ. pti_kernel_cr3/pti_user_cr3 are 0 when PTI is off.
 __asm__(
+    ".pushsection .entry.text, \"ax\"\n"
+    
+    // RAX must already be saved; cs_off = offset of the saved CS from RSP
+    ".macro PTI_SWITCH_KERNEL cs_off\n"
+    "    testb $3, \\cs_off(%rsp)\n"
+    "    jz 1f\n"
+    "    movq pti_kernel_cr3(%rip), %rax\n"
+    "    testq %rax, %rax\n"
+    "    jz 1f\n"
+    "    movq %rax, %cr3\n"
+    "1:\n"
+    ".endm\n"
+    
+    ".macro PTI_SWITCH_USER cs_off\n"
+    "    testb $3, \\cs_off(%rsp)\n"
+    "    jz 2f\n"
+    "    movq pti_user_cr3(%rip), %rax\n"
+    "    testq %rax, %rax\n"
+    "    jz 2f\n"
+    "    movq %rax, %cr3\n"
+    "2:\n"
+    ".endm\n"
+    
     ".global generic_fault_handler\n"
     ".global gp_fault_handler\n"
     ".global pf_fault_handler\n"
@@ -79,6 +106,11 @@ __asm__(
     "generic_fault_handler:\n"
     "    cli\n"
     "    pushq %rax\n"
+    "    movq pti_kernel_cr3(%rip), %rax\n"  // Halts - switch unconditionally
+    "    testq %rax, %rax\n"
+    "    jz 3f\n"
+    "    movq %rax, %cr3\n"
+    "3:\n"
     "    pushq $0\n"
     "    movq $99, %rax\n"      // Unknown vector
     "    call handle_fault_with_vector\n"
@@ -92,11 +124,13 @@ __asm__(
     "    cli\n"
     "    pushq $0\n"            // dummy error code
     "    pushq %rax\n"
+    "    PTI_SWITCH_KERNEL 24\n"
     "    pushq %rdi\n"
     "    movq $0, %rdi\n"       // vector 0
     "    movq $0, %rsi\n"       // error code 0
     "    call handle_fault_with_vector\n"
     "    popq %rdi\n"
+    "    PTI_SWITCH_USER 24\n"
     "    popq %rax\n"
     "    addq $8, %rsp\n"
     "    iretq\n"
@@ -106,11 +140,13 @@ __asm__(
     "    cli\n"
     "    pushq $0\n"
     "    pushq %rax\n"
+    "    PTI_SWITCH_KERNEL 24\n"
     "    pushq %rdi\n"
     "    movq $1, %rdi\n"       // vector 1 (#DB)
     "    movq $0, %rsi\n"
     "    call handle_fault_with_vector\n"
     "    popq %rdi\n"
+    "    PTI_SWITCH_USER 24\n"
     "    popq %rax\n"
     "    addq $8, %rsp\n"
     "    iretq\n"
@@ -120,11 +156,13 @@ __asm__(
     "    cli\n"
     "    pushq $0\n"
     "    pushq %rax\n"
+    "    PTI_SWITCH_KERNEL 24\n"
     "    pushq %rdi\n"
     "    movq $6, %rdi\n"       // vector 6 (#UD)
     "    movq $0, %rsi\n"
     "    call handle_fault_with_vector\n"
     "    popq %rdi\n"
+    "    PTI_SWITCH_USER 24\n"
     "    popq %rax\n"
     "    addq $8, %rsp\n"
     "    iretq\n"
@@ -133,24 +171,45 @@ __asm__(
     "isr_13:\n"
     "    cli\n"
     "    pushq %rax\n"
+    "    PTI_SWITCH_KERNEL 24\n"
     "    pushq %rdi\n"
     "    movq 16(%rsp), %rsi\n" // error code from CPU
     "    movq $13, %rdi\n"      // vector 13 (#GP)
     "    call handle_fault_with_vector\n"
     "    popq %rdi\n"
+    "    PTI_SWITCH_USER 24\n"
     "    popq %rax\n"
     "    addq $8, %rsp\n"       // remove CPU error code
     "    iretq\n"
     
+    // #PF saves every caller-saved register: resolved faults (demand paging)
+    // return to the interrupted code, which must not see clobbered state
     ".global isr_14\n"
     "isr_14:\n"
     "    cli\n"
     "    pushq %rax\n"
+    "    PTI_SWITCH_KERNEL 24\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
     "    pushq %rdi\n"
-    "    movq 16(%rsp), %rsi\n" // error code from CPU
-    "    movq $14, %rdi\n"      // vector 14 (#PF)
-    "    call handle_fault_with_vector\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    movq 72(%rsp), %rdi\n" // error code from CPU
+    "    subq $8, %rsp\n"      // 16-byte align for the C call
+    "    call handle_page_fault\n"
+    "    addq $8, %rsp\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
     "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    PTI_SWITCH_USER 24\n"
     "    popq %rax\n"
     "    addq $8, %rsp\n"
     "    iretq\n"
@@ -240,13 +299,25 @@ void handle_fault_with_vector(u64 vector, u64 error_code) {
     }
 }
 
+// Page fault: try to resolve it (remote/demand pages), otherwise report
+void handle_page_fault(u64 error_code) {
+    u64 cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    
+    if (vm_handle_page_fault(cr2, error_code)) {
+        return;
+    }
+    
+    handle_fault_with_vector(14, error_code);
+}
+
 // Legacy handler for compatibility
 void handle_fault(void) {
     handle_fault_with_vector(99, 0);
 }
 
 // Set an IDT entry
-static void idt_set_gate(u8 num, u64 base, u16 sel, u8 flags) {
+void idt_set_gate(u8 num, u64 base, u16 sel, u8 flags) {
     idt[num].offset_low = base & 0xFFFF;
     idt[num].offset_mid = (base >> 16) & 0xFFFF;
     idt[num].offset_high = (base >> 32) & 0xFFFFFFFF;
@@ -262,7 +333,7 @@ void idt_init(void) {
     serial_puts("[IDT] Initializing minimal IDT for fault handling\r\n");
     
     // Clear IDT
-    for (int i = 0; i < 32; i++) {
+    for (int i = 0; i < 256; i++) {
         idt_set_gate(i, 0, 0, 0);
     }
     
@@ -283,4 +354,9 @@ void idt_init(void) {
     __asm__ volatile("lidt %0" : : "m"(idt_pointer));
     
     serial_puts("[IDT] Minimal IDT loaded - faults will now be handled\r\n");
+}
+
+// Load the shared IDT on an application processor
+void idt_load(void) {
+    __asm__ volatile("lidt %0" : : "m"(idt_pointer));
 }
\ No newline at end of file
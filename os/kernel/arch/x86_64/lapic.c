@@ -25,8 +25,8 @@
 #define LAPIC_TIMER_CCR         0x390
 #define LAPIC_TIMER_DCR         0x3E0
 
-// Default LAPIC base address
-#define LAPIC_BASE_ADDR         0xFEE00000UL
+// Physical base field of IA32_APIC_BASE
+#define LAPIC_BASE_MASK         0x000FFFFFFFFFF000UL
 
 // MSR for LAPIC base
 #define MSR_APIC_BASE           0x1B
@@ -35,15 +35,37 @@
 #define LAPIC_ENABLE            (1 << 11)
 
 // Timer modes
+#define LAPIC_TIMER_ONESHOT     0x00000
 #define LAPIC_TIMER_PERIODIC    0x20000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
 #define LAPIC_TIMER_MASKED      0x10000
 
+// TSC-deadline timer: the interrupt fires when the TSC reaches the value
+#define MSR_TSC_DEADLINE        0x6E0
+
+// ICR: fixed delivery mode (0), level assert, no shorthand
+#define LAPIC_ICR_ASSERT        0x04000
+#define LAPIC_ICR_PENDING       0x01000
+
+// Longest one-shot programmed in one go; a later deadline just gets an
+// early interrupt that programs the rest
+#define CLOCKEVENT_MAX_MS       1000
+
+// LAPIC timer calibration window, timed with the (calibrated) TSC
+#define LAPIC_CALIBRATE_MS      10
+
 // Spurious interrupt vector
 #define SPURIOUS_VECTOR         0xFF
 
-static volatile u32 *lapic_base = (volatile u32*)LAPIC_BASE_ADDR;
+// Register page, mapped uncached in the MMIO window by lapic_init
+static volatile u32 *lapic_base = NULL;
 static u32 timer_ticks_per_ms = 0;
 
+// Clock event device: every CPU's LAPIC timer runs one-shot, in
+// TSC-deadline mode when the CPU has it. Deadlines are TSC values either
+// way; the plain one-shot fallback converts them to LAPIC counts.
+static bool tsc_deadline_mode = false;
+
 // MSR functions are declared in kapi.h and implemented in msr.c
 
 static u32 lapic_read(u32 reg) {
@@ -56,15 +78,18 @@ static void lapic_write(u32 reg, u32 value) {
 
 // Timer interrupt handler
 extern void timer_interrupt_handler(void);
+extern void spurious_interrupt_handler(void);
+extern void resched_interrupt_handler(void);
 
-void lapic_init(void) {
+// Enable the calling CPU's LAPIC; false if there is none
+bool lapic_init(void) {
     // Check if LAPIC is available via CPUID
     u32 eax, ebx, ecx, edx;
     __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
     
     if (!(edx & (1 << 9))) {
-        kprintf("[LAPIC] LAPIC not supported by CPU, skipping\n");
-        return;
+        serial_puts("[LAPIC] LAPIC not supported by CPU, skipping\r\n");
+        return false;
     }
     
     // Enable LAPIC via MSR
@@ -72,7 +97,16 @@ void lapic_init(void) {
     apic_base |= LAPIC_ENABLE;
     write_msr(MSR_APIC_BASE, apic_base);
     
-    // Map LAPIC to higher-half if needed (assuming identity mapped for now)
+    // The higher-half kernel has no identity mapping: map the registers.
+    // Every CPU sees its own LAPIC at the same physical address, so the
+    // boot CPU maps it once and the APs reuse that mapping.
+    if (!lapic_base) {
+        lapic_base = (volatile u32*)ioremap(apic_base & LAPIC_BASE_MASK, PAGE_SIZE, CACHE_UC);
+        if (!lapic_base) {
+            serial_puts("[LAPIC] Failed to map registers, skipping\r\n");
+            return false;
+        }
+    }
     
     // Enable LAPIC by setting spurious vector
     lapic_write(LAPIC_SPURIOUS_VECTOR, SPURIOUS_VECTOR | (1 << 8));
@@ -84,41 +118,111 @@ void lapic_init(void) {
     // Clear any pending interrupts
     lapic_write(LAPIC_EOI, 0);
     
-    kprintf("[LAPIC] Local APIC initialized, ID=%u\n", lapic_read(LAPIC_ID) >> 24);
+    serial_puts("[LAPIC] Local APIC initialized\r\n");
+    return true;
+}
+
+// APIC ID of the calling CPU (0 before lapic_init)
+u32 lapic_id(void) {
+    if (!lapic_base) return 0;
+    return lapic_read(LAPIC_ID) >> 24;
 }
 
+// LAPIC timer counts per millisecond: let it run down, masked, for
+// LAPIC_CALIBRATE_MS as measured by the TSC
+static u32 calibrate_timer(void) {
+    lapic_write(LAPIC_TIMER_LVT, 32 | LAPIC_TIMER_MASKED);
+    lapic_write(LAPIC_TIMER_ICR, 0xFFFFFFFF);
+    
+    u64 end = rdtsc() + tsc_khz() * LAPIC_CALIBRATE_MS;
+    while (rdtsc() < end) {
+        __asm__ volatile("pause");
+    }
+    u32 elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CCR);
+    lapic_write(LAPIC_TIMER_ICR, 0);
+    
+    u32 per_ms = elapsed / LAPIC_CALIBRATE_MS;
+    return per_ms ? per_ms : 1;
+}
+
+// Start the calling CPU's tick; lapic_init must have succeeded on it
 void timer_init(void) {
     // Check if LAPIC was initialized
-    u32 eax, ebx, ecx, edx;
-    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
-    
-    if (!(edx & (1 << 9))) {
-        kprintf("[TIMER] LAPIC not available, using alternative timer\n");
+    if (!lapic_base) {
+        serial_puts("[TIMER] LAPIC not available, using alternative timer\r\n");
         // TODO: Use PIT or other timer source
         return;
     }
     
     // First, we need to add the timer interrupt to IDT (vector 32)
     idt_set_gate(32, (u64)timer_interrupt_handler, 0x08, 0x8E);
+    idt_set_gate(SPURIOUS_VECTOR, (u64)spurious_interrupt_handler, 0x08, 0x8E);
+    idt_set_gate(IPI_RESCHED_VECTOR, (u64)resched_interrupt_handler, 0x08, 0x8E);
     
     // Set timer divide configuration (divide by 16)
     lapic_write(LAPIC_TIMER_DCR, 0x03);
     
-    // Calibrate timer frequency
-    // For now, use a rough estimate - in real implementation, 
-    // we'd calibrate against a known timer source
+    // Calibrate timer frequency once, on the first CPU to get here: every
+    // LAPIC timer runs off the same bus clock
+    if (!timer_ticks_per_ms) {
+        timer_ticks_per_ms = calibrate_timer();
+    }
     
-    // Set initial count for ~1ms (this is CPU frequency dependent)
-    // For QEMU with modern CPU, rough estimate
-    timer_ticks_per_ms = 1000000; // Adjust based on actual calibration
+    // One-shot timer interrupt (vector 32), TSC-deadline if available
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    tsc_deadline_mode = (ecx & (1u << 24)) != 0;
+    if (tsc_deadline_mode) {
+        lapic_write(LAPIC_TIMER_LVT, 32 | LAPIC_TIMER_TSC_DEADLINE);
+        serial_puts("[TIMER] APIC timer in TSC-deadline mode\r\n");
+    } else {
+        lapic_write(LAPIC_TIMER_LVT, 32 | LAPIC_TIMER_ONESHOT);
+        serial_puts("[TIMER] APIC timer in one-shot mode\r\n");
+    }
     
-    // Set up timer interrupt (vector 32, periodic mode)
-    lapic_write(LAPIC_TIMER_LVT, 32 | LAPIC_TIMER_PERIODIC);
+    // The tick code arms the first deadline
+    tick_start();
+}
+
+// Fire the timer interrupt once, when the TSC reaches deadline (replaces
+// any deadline already programmed on this CPU)
+void clockevent_program(u64 deadline) {
+    if (!lapic_base) return;
     
-    // Start timer with initial count
-    lapic_write(LAPIC_TIMER_ICR, timer_ticks_per_ms);
+    if (tsc_deadline_mode) {
+        // Order the LVT write before the MSR write (SDM 10.5.4.1)
+        __asm__ volatile("mfence" : : : "memory");
+        write_msr(MSR_TSC_DEADLINE, deadline ? deadline : 1);
+        return;
+    }
     
-    kprintf("[TIMER] APIC timer configured for 1ms ticks\n");
+    u64 now = rdtsc();
+    u64 delta = deadline > now ? deadline - now : 0;
+    if (delta > CLOCKEVENT_MAX_MS * tsc_khz()) delta = CLOCKEVENT_MAX_MS * tsc_khz();
+    u64 count = delta * timer_ticks_per_ms / tsc_khz();
+    lapic_write(LAPIC_TIMER_ICR, count ? (u32)count : 1);
+}
+
+// Cancel this CPU's pending deadline
+void clockevent_stop(void) {
+    if (!lapic_base) return;
+    
+    if (tsc_deadline_mode) {
+        write_msr(MSR_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TIMER_ICR, 0);
+    }
+}
+
+// Send a fixed interrupt to another CPU
+void lapic_send_ipi(u32 apic_id, u8 vector) {
+    if (!lapic_base) return;
+    
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, LAPIC_ICR_ASSERT | vector);
 }
 
 void lapic_eoi(void) {
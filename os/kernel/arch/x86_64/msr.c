@@ -48,16 +48,17 @@ static void setup_user_mode_cr_flags(void) {
     cr4 |= (1 << 7);  // PGE bit
     __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
     
+    // PGE only pays off if kernel entries are actually global. Under PTI the
+    // kernel must not survive in the TLB while in user mode, so skip it.
+    if (!pti_enabled()) {
+        kernel_mappings_set_global();
+    }
+    
     serial_puts("[MSR] User mode CR0/CR4 flags enabled\r\n");
 }
 
-// Configure SYSCALL/SYSRET MSRs
-void setup_syscall_msrs(void) {
-    serial_puts("[MSR] Setting up SYSCALL/SYSRET MSRs\r\n");
-    
-    // Setup control registers for user mode
-    setup_user_mode_cr_flags();
-    
+// EFER and SYSCALL MSRs; these are per CPU
+static void program_syscall_msrs(void) {
     // Enable System Call Extensions in EFER
     u64 efer = read_msr(MSR_EFER);
     efer |= EFER_SCE | EFER_NXE;  // Enable syscall and NX bit
@@ -78,6 +79,32 @@ void setup_syscall_msrs(void) {
     
     // Optionally set KERNEL_GS for per-CPU data (not implemented yet)
     // write_msr(MSR_KERNEL_GS, (u64)&percpu_data);
+}
+
+// Configure SYSCALL/SYSRET MSRs
+void setup_syscall_msrs(void) {
+    serial_puts("[MSR] Setting up SYSCALL/SYSRET MSRs\r\n");
+    
+    // Setup control registers for user mode
+    setup_user_mode_cr_flags();
+    
+    program_syscall_msrs();
     
     serial_puts("[MSR] SYSCALL/SYSRET MSRs configured\r\n");
+}
+
+// Same setup on an application processor. The kernel page tables are
+// shared, so the global bits set by the boot CPU already apply here.
+void setup_syscall_msrs_ap(void) {
+    u64 cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= (1 << 16); // WP bit
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0));
+    
+    u64 cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1 << 7);  // PGE bit
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+    
+    program_syscall_msrs();
 }
\ No newline at end of file
@@ -0,0 +1,70 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Page attribute table
+//
+// A PTE picks its memory type with three bits (PAT, PCD, PWT) that index
+// the eight entries of the IA32_PAT MSR. Entries 0-3 keep their power-on
+// values (WB, WT, UC-, UC), so every mapping that never sets the PAT bit
+// behaves exactly as before; entries 4-7 add write-combining and
+// write-protect. Only 4K PTEs are handed out with these bits (bit 7 is
+// the PAT bit there, not PS).
+
+#define MSR_PAT         0x277
+
+// Memory types
+#define PAT_UC          0x00
+#define PAT_WC          0x01
+#define PAT_WT          0x04
+#define PAT_WP          0x05
+#define PAT_WB          0x06
+#define PAT_UC_MINUS    0x07
+
+// PTE bits selecting a PAT entry (4K pages)
+#define PTE_PWT         (1ULL << 3)
+#define PTE_PCD         (1ULL << 4)
+#define PTE_PAT         (1ULL << 7)
+
+static bool pat_enabled = false;
+
+void pat_init(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    if (!(edx & (1u << 16))) {
+        serial_puts("[PAT] Not supported, write-combining maps as uncached\r\n");
+        return;
+    }
+    
+    u64 pat = ((u64)PAT_WB << 0) | ((u64)PAT_WT << 8) |
+              ((u64)PAT_UC_MINUS << 16) | ((u64)PAT_UC << 24) |
+              ((u64)PAT_WC << 32) | ((u64)PAT_WP << 40) |
+              ((u64)PAT_UC_MINUS << 48) | ((u64)PAT_UC << 56);
+    
+    // Caches and TLBs must not hold lines with the old types
+    __asm__ volatile("wbinvd" : : : "memory");
+    write_msr(MSR_PAT, pat);
+    __asm__ volatile("wbinvd" : : : "memory");
+    
+    u64 cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    
+    pat_enabled = true;
+    serial_puts("[PAT] Page attribute table programmed (WB WT UC- UC WC WP UC- UC)\r\n");
+}
+
+// PTE bits for a 4K mapping with the given cache mode
+u64 pat_pte_bits(u32 cachemode) {
+    switch (cachemode) {
+        case CACHE_WB:
+            return 0;
+        case CACHE_WT:
+            return PTE_PWT;
+        case CACHE_WC:
+            // Without PAT the closest safe type is UC-
+            return pat_enabled ? PTE_PAT : PTE_PCD;
+        case CACHE_UC:
+        default:
+            return PTE_PCD | PTE_PWT;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,262 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Page table isolation (PTI)
+//
+// When enabled with "pti=on" on the kernel command line, every user address
+// space gets a second "shadow" PML4 that is used while running in ring 3.
+// Its user half mirrors the real PML4, but its kernel half maps only the
+// entry trampolines (.entry.text) and the data they touch (.entry.data:
+// GDT, IDT, TSS, entry stacks). The syscall and exception entry stubs switch
+// CR3 on the way in and out. With PCID+INVPCID the two views are tagged with
+// different PCIDs so the switches do not flush the TLB.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+// CR3 / CR4 bits
+#define CR4_PCIDE       (1ULL << 17)
+#define CR3_NOFLUSH     (1ULL << 63)
+
+// PCIDs used for the two halves of a PTI address space
+#define PTI_PCID_KERNEL 1
+#define PTI_PCID_USER   2
+
+#define PTI_MAX_AS      64
+
+// Entry region bounds from linker.ld
+extern u8 __entry_text_start[], __entry_text_end[];
+extern u8 __entry_data_start[], __entry_data_end[];
+
+// CR3 values used by the entry stubs (live in .entry.data, see syscall_entry.S)
+extern u64 pti_kernel_cr3;
+extern u64 pti_user_cr3;
+
+// Kernel PML4 -> shadow PML4 pairs
+typedef struct {
+    u64 kernel_pml4;
+    u64 user_pml4;
+} pti_as_t;
+
+static bool pti_on = false;
+static bool pti_pcid = false;
+static u64 pti_shadow_template = 0;   // Shadow PML4 with only the entry region mapped
+static pti_as_t pti_as_table[PTI_MAX_AS];
+
+static inline u64 read_cr3(void) {
+    u64 val;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(val));
+    return val;
+}
+
+static inline void write_cr3(u64 val) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(val) : "memory");
+}
+
+// Flush all non-global entries tagged with one PCID
+static inline void invpcid_single(u64 pcid) {
+    struct { u64 pcid; u64 addr; } desc = { pcid, 0 };
+    __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(1ULL) : "memory");
+}
+
+static u64 alloc_zeroed_table(void) {
+    u64 pa = pmm_alloc_page();
+    if (!pa) return 0;
+    
+    u64 *table = (u64*)phys_to_virt(pa);
+    for (int i = 0; i < 512; i++) {
+        table[i] = 0;
+    }
+    return pa;
+}
+
+static u64 *next_level(u64 *table, u64 index) {
+    if (!(table[index] & PTE_PRESENT)) {
+        u64 pa = alloc_zeroed_table();
+        if (!pa) return NULL;
+        table[index] = pa | PTE_PRESENT | PTE_WRITABLE;
+    }
+    return (u64*)phys_to_virt(table[index] & PTE_ADDR_MASK);
+}
+
+// Map [start, end) of the kernel image into the shadow template at the same VA
+static bool map_entry_range(u64 *shadow, u64 start, u64 end, u64 flags) {
+    for (u64 va = start & ~0xFFFULL; va < end; va += PAGE_SIZE) {
+        u64 pa = kernel_virt_to_phys(va);
+        if (!pa) return false;
+    
+        u64 *pdpt = next_level(shadow, (va >> 39) & 0x1FF);
+        if (!pdpt) return false;
+        u64 *pd = next_level(pdpt, (va >> 30) & 0x1FF);
+        if (!pd) return false;
+        u64 *pt = next_level(pd, (va >> 21) & 0x1FF);
+        if (!pt) return false;
+    
+        pt[(va >> 12) & 0x1FF] = (pa & PTE_ADDR_MASK) | flags;
+    }
+    return true;
+}
+
+static bool cpu_has_pcid(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    if (!(ecx & (1u << 17))) return false;   // PCID
+    
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    return (ebx & (1u << 10)) != 0;          // INVPCID
+}
+
+void pti_init(void) {
+    if (!cmdline_has_option("pti=on")) {
+        serial_puts("[PTI] Page table isolation disabled (boot with pti=on to enable)\r\n");
+        return;
+    }
+    
+    serial_puts("[PTI] Building shadow kernel half with entry trampolines only\r\n");
+    
+    pti_shadow_template = alloc_zeroed_table();
+    if (!pti_shadow_template) {
+        serial_puts("[PTI] ERROR: Out of memory, staying disabled\r\n");
+        return;
+    }
+    
+    u64 *shadow = (u64*)phys_to_virt(pti_shadow_template);
+    if (!map_entry_range(shadow, (u64)__entry_text_start, (u64)__entry_text_end, PTE_PRESENT) ||
+        !map_entry_range(shadow, (u64)__entry_data_start, (u64)__entry_data_end,
+                         PTE_PRESENT | PTE_WRITABLE | PTE_NOEXECUTE)) {
+        serial_puts("[PTI] ERROR: Failed to map entry region, staying disabled\r\n");
+        return;
+    }
+    
+    for (int i = 0; i < PTI_MAX_AS; i++) {
+        pti_as_table[i].kernel_pml4 = 0;
+        pti_as_table[i].user_pml4 = 0;
+    }
+    
+    pti_pcid = cpu_has_pcid();
+    if (pti_pcid) {
+        // PCIDE can only be set while CR3[11:0] is zero
+        u64 cr3 = read_cr3();
+        if (cr3 & 0xFFF) write_cr3(cr3 & ~0xFFFULL);
+    
+        u64 cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_PCIDE;
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+        serial_puts("[PTI] PCID enabled - kernel/user switches keep the TLB\r\n");
+    } else {
+        serial_puts("[PTI] No PCID/INVPCID - every kernel/user switch flushes the TLB\r\n");
+    }
+    
+    pti_on = true;
+    serial_puts("[PTI] Page table isolation enabled\r\n");
+}
+
+bool pti_enabled(void) {
+    return pti_on;
+}
+
+static pti_as_t *pti_lookup(u64 pml4_phys) {
+    for (int i = 0; i < PTI_MAX_AS; i++) {
+        if (pti_as_table[i].kernel_pml4 == pml4_phys) return &pti_as_table[i];
+    }
+    return NULL;
+}
+
+// Create the shadow PML4 for a freshly created user address space
+bool pti_as_create(u64 pml4_phys) {
+    if (!pti_on) return true;
+    
+    pti_as_t *slot = pti_lookup(0);
+    if (!slot) {
+        serial_puts("[PTI] ERROR: Shadow PML4 table full\r\n");
+        return false;
+    }
+    
+    u64 user_pml4 = alloc_zeroed_table();
+    if (!user_pml4) return false;
+    
+    u64 *dst = (u64*)phys_to_virt(user_pml4);
+    u64 *src = (u64*)phys_to_virt(pml4_phys);
+    u64 *tmpl = (u64*)phys_to_virt(pti_shadow_template);
+    for (int i = 0; i < 256; i++) {
+        dst[i] = src[i];
+    }
+    for (int i = 256; i < 512; i++) {
+        dst[i] = tmpl[i];
+    }
+    
+    slot->kernel_pml4 = pml4_phys;
+    slot->user_pml4 = user_pml4;
+    return true;
+}
+
+// Drop the shadow PML4 of an address space being torn down
+void pti_as_destroy(u64 pml4_phys) {
+    if (!pti_on) return;
+    
+    pti_as_t *as = pti_lookup(pml4_phys);
+    if (!as) return;
+    
+    pmm_free_page(as->user_pml4);
+    as->kernel_pml4 = 0;
+    as->user_pml4 = 0;
+}
+
+// Mirror a user-half PML4 entry into the shadow after it was created/changed.
+// Lower levels are shared, so only top-level changes need propagating.
+void pti_sync_user_entry(u64 pml4_phys, u64 index) {
+    if (!pti_on || index >= 256) return;
+    
+    pti_as_t *as = pti_lookup(pml4_phys);
+    if (!as) return;
+    
+    ((u64*)phys_to_virt(as->user_pml4))[index] = ((u64*)phys_to_virt(pml4_phys))[index];
+}
+
+// Make pml4_phys the current address space and point the entry stubs at it
+void pti_switch_mm(u64 pml4_phys) {
+    if (!pti_on) {
+        write_cr3(pml4_phys);
+        return;
+    }
+    
+    pti_as_t *as = pti_lookup(pml4_phys);
+    if (!as) {
+        serial_puts("[PTI] ERROR: No shadow PML4 for address space\r\n");
+        hang();
+    }
+    
+    if (pti_pcid) {
+        // Full switch to the new kernel view flushes its PCID, and the user
+        // PCID is invalidated explicitly. After that the entry stubs switch
+        // with NOFLUSH.
+        write_cr3(pml4_phys | PTI_PCID_KERNEL);
+        invpcid_single(PTI_PCID_USER);
+        pti_kernel_cr3 = pml4_phys | PTI_PCID_KERNEL | CR3_NOFLUSH;
+        pti_user_cr3 = as->user_pml4 | PTI_PCID_USER | CR3_NOFLUSH;
+    } else {
+        write_cr3(pml4_phys);
+        pti_kernel_cr3 = pml4_phys;
+        pti_user_cr3 = as->user_pml4;
+    }
+}
+
+// Switch to a kernel-only PML4 (no shadow) when the current user address
+// space goes away. Nothing returns to ring 3 from here, so both entry CR3
+// values point at it.
+void pti_switch_kernel(u64 pml4_phys) {
+    if (pti_on && pti_pcid) {
+        write_cr3(pml4_phys | PTI_PCID_KERNEL);
+        invpcid_single(PTI_PCID_USER);
+        pti_kernel_cr3 = pml4_phys | PTI_PCID_KERNEL | CR3_NOFLUSH;
+    } else {
+        write_cr3(pml4_phys);
+        pti_kernel_cr3 = pml4_phys;
+    }
+    pti_user_cr3 = pti_kernel_cr3;
+}
\ No newline at end of file
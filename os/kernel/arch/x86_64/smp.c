@@ -0,0 +1,245 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Application processor bring-up
+//
+// Limine parks every AP in long mode on the boot page tables. Writing an
+// AP's goto_address releases it into ap_entry, which moves to a kernel
+// stack, gives the CPU its own GDT and TSS, loads the shared IDT, programs
+// the per-CPU MSRs (SYSCALL, PAT), enables its LAPIC and then runs the
+// threads the scheduler places on its run queue. APs are started one at a
+// time, so the per-CPU setup never runs concurrently. An AP that misses
+// its start timeout is cut off rather than left to come up late: ap_entry
+// claims its start with a compare-and-swap on the Limine info, and the boot
+// CPU gives up only by winning that race, after which the AP halts.
+//
+// CPUs are numbered 0..n-1 with the boot CPU as 0. The number is kept in
+// IA32_TSC_AUX so smp_cpu_id() is a single RDTSCP; CPUs without RDTSCP
+// look it up by LAPIC ID instead.
+//
+// Each CPU also records which last-level cache and which package it sits
+// in (from its APIC ID and CPUID), so the scheduler can prefer moving work
+// between CPUs that share a cache. Without ACPI tables the package stands
+// in for the NUMA node.
+
+extern struct limine_smp_request limine_smp_request;
+
+#define MSR_TSC_AUX         0xC0000103
+#define SMP_STACK_PAGES     4               // 16KB kernel stack per AP
+#define SMP_START_SPINS     100000000ULL    // Wait for an AP before giving up
+
+// Limine extra_argument while an AP is being started: its CPU number with
+// AP_START_PENDING until ap_entry claims it, AP_START_ABORTED once the boot
+// CPU gave up on it
+#define AP_START_PENDING    (1ULL << 63)
+#define AP_START_ABORTED    ~0ULL
+
+typedef struct {
+    u32 lapic_id;
+    u32 llc_id;             // CPUs with the same value share the LLC
+    u32 package_id;
+    u64 stack_top;
+    volatile bool online;
+} smp_cpu_t;
+
+static smp_cpu_t smp_cpus[SMP_MAX_CPUS];
+static u32 smp_slots;                   // CPU numbers handed out
+static volatile u32 smp_online;         // CPUs running, 0 before smp_init
+static bool smp_has_rdtscp;
+static u8 smp_lapic_to_cpu[256];
+
+// The per-CPU id is valid once a second slot is handed out: the boot CPU
+// set its own before that, and an AP sets it first thing in ap_main
+u32 smp_cpu_id(void) {
+    if (smp_slots <= 1) return 0;
+    
+    if (smp_has_rdtscp) {
+        u32 aux;
+        __asm__ volatile("rdtscp" : "=c"(aux) : : "rax", "rdx");
+        return aux;
+    }
+    return smp_lapic_to_cpu[lapic_id() & 0xFF];
+}
+
+// Number of CPU slots; an AP that failed to start gives its slot back
+u32 smp_cpu_count(void) {
+    return smp_slots ? smp_slots : 1;
+}
+
+bool smp_cpu_online(u32 cpu) {
+    if (cpu == 0) return true;
+    return cpu < smp_slots && smp_cpus[cpu].online;
+}
+
+static void set_cpu_id(u32 cpu) {
+    if (smp_has_rdtscp) {
+        write_msr(MSR_TSC_AUX, cpu);
+    }
+}
+
+// Bits of the APIC ID needed to number n logical CPUs
+static u32 id_shift(u32 n) {
+    u32 shift = 0;
+    while ((1u << shift) < n) {
+        shift++;
+    }
+    return shift;
+}
+
+// Record the calling CPU's cache and package from its initial APIC ID
+static void detect_topology(u32 cpu) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    u32 max_leaf = eax;
+    
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    u32 apic = ebx >> 24;
+    u32 per_package = (edx & (1u << 28)) ? (ebx >> 16) & 0xFF : 1;
+    
+    // Logical CPUs sharing the highest-level cache (CPUID leaf 4)
+    u32 per_llc = 1;
+    if (max_leaf >= 4) {
+        u32 best_level = 0;
+        for (u32 i = 0; i < 16; i++) {
+            __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(4), "c"(i));
+            u32 type = eax & 0x1F;
+            if (type == 0) break;
+            u32 level = (eax >> 5) & 0x7;
+            if (level < best_level) continue;
+            best_level = level;
+            per_llc = ((eax >> 14) & 0xFFF) + 1;
+        }
+    }
+    
+    smp_cpus[cpu].llc_id = apic >> id_shift(per_llc);
+    smp_cpus[cpu].package_id = apic >> id_shift(per_package);
+}
+
+// How far apart two CPUs are: SMP_DIST_SAME, _LLC (shared last-level
+// cache), _PACKAGE or _REMOTE
+u32 smp_cpu_distance(u32 a, u32 b) {
+    if (a == b) return SMP_DIST_SAME;
+    if (smp_cpus[a].package_id != smp_cpus[b].package_id) return SMP_DIST_REMOTE;
+    if (smp_cpus[a].llc_id != smp_cpus[b].llc_id) return SMP_DIST_PACKAGE;
+    return SMP_DIST_LLC;
+}
+
+// Kick another CPU out of idle to look at its run queue
+void smp_send_resched(u32 cpu) {
+    if (cpu == smp_cpu_id() || !smp_cpu_online(cpu)) return;
+    lapic_send_ipi(smp_cpus[cpu].lapic_id, IPI_RESCHED_VECTOR);
+}
+
+static void NORETURN ap_main(u32 cpu) {
+    set_cpu_id(cpu);
+    gdt_init_ap(cpu);
+    idt_load();
+    setup_syscall_msrs_ap();
+    pat_init();
+    fpu_init();
+    if (lapic_init()) timer_init();
+    detect_topology(cpu);
+    
+    __atomic_fetch_add(&smp_online, 1, __ATOMIC_SEQ_CST);
+    smp_cpus[cpu].online = true;
+    
+    sched_ap_main(cpu);
+    for (;;) {
+        __asm__ volatile("cli; hlt");
+    }
+}
+
+// Entered on the Limine stack, which lives in bootloader memory: switch
+// to our own before doing anything else
+static void ap_entry(struct limine_smp_info *info) {
+    u64 arg = __atomic_load_n(&info->extra_argument, __ATOMIC_SEQ_CST);
+    if (arg == AP_START_ABORTED || !(arg & AP_START_PENDING) ||
+        !__atomic_compare_exchange_n(&info->extra_argument, &arg, arg & ~AP_START_PENDING,
+                                     false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        // Too late: the boot CPU gave up and may have reused our slot
+        for (;;) {
+            __asm__ volatile("cli; hlt");
+        }
+    }
+    
+    u32 cpu = (u32)(arg & ~AP_START_PENDING);
+    __asm__ volatile(
+        "mov %0, %%rsp\n\t"
+        "xor %%ebp, %%ebp\n\t"
+        "call *%1"
+        : : "r"(smp_cpus[cpu].stack_top), "r"(ap_main), "D"(cpu) : "memory");
+}
+
+static bool start_ap(struct limine_smp_info *info, u32 cpu) {
+    u64 stack = pmm_alloc_pages(SMP_STACK_PAGES);
+    if (!stack) return false;
+    
+    smp_cpus[cpu].lapic_id = info->lapic_id;
+    smp_cpus[cpu].stack_top = phys_to_virt(stack) + SMP_STACK_PAGES * PAGE_SIZE;
+    smp_lapic_to_cpu[info->lapic_id & 0xFF] = (u8)cpu;
+    
+    info->extra_argument = cpu | AP_START_PENDING;
+    __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+    
+    for (u64 spins = 0; spins < SMP_START_SPINS; spins++) {
+        if (smp_cpus[cpu].online) return true;
+        __asm__ volatile("pause");
+    }
+    
+    // Cut it off, unless it claimed its start in the meantime: then it is
+    // on its way and is waited for
+    u64 expected = cpu | AP_START_PENDING;
+    if (__atomic_compare_exchange_n(&info->extra_argument, &expected, AP_START_ABORTED,
+                                    false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        pmm_free_pages(stack, SMP_STACK_PAGES);
+        return false;
+    }
+    while (!smp_cpus[cpu].online) {
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+void smp_init(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+    smp_has_rdtscp = (edx & (1u << 27)) != 0;
+    
+    // Boot CPU
+    bool lapic_ok = lapic_init();
+    smp_cpus[0].lapic_id = lapic_id();
+    smp_cpus[0].online = true;
+    smp_lapic_to_cpu[smp_cpus[0].lapic_id & 0xFF] = 0;
+    set_cpu_id(0);
+    detect_topology(0);
+    smp_slots = 1;
+    smp_online = 1;
+    
+    struct limine_smp_response *resp = limine_smp_request.response;
+    if (!resp || resp->cpu_count <= 1) {
+        serial_puts("[SMP] Single processor\r\n");
+        return;
+    }
+    if (!smp_has_rdtscp && !lapic_ok) {
+        serial_puts("[SMP] No way to tell CPUs apart (no RDTSCP or LAPIC), staying on one CPU\r\n");
+        return;
+    }
+    
+    for (u64 i = 0; i < resp->cpu_count; i++) {
+        struct limine_smp_info *info = resp->cpus[i];
+        if (info->lapic_id == resp->bsp_lapic_id) continue;
+        if (smp_slots == SMP_MAX_CPUS) {
+            serial_puts("[SMP] More CPUs than SMP_MAX_CPUS, ignoring the rest\r\n");
+            break;
+        }
+    
+        // The slot is given back if the AP never starts
+        u32 cpu = smp_slots++;
+        if (!start_ap(info, cpu)) {
+            smp_slots--;
+            serial_puts("[SMP] ERROR: Application processor did not come up\r\n");
+        }
+    }
+    
+    serial_puts("[SMP] Application processors started\r\n");
+}
\ No newline at end of file
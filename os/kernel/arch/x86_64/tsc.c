@@ -0,0 +1,113 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// TSC clocksource
+//
+// The TSC rate is measured once at boot against PIT channel 2, which ticks
+// at a fixed 1.193182 MHz on every PC (HPET would need the ACPI tables,
+// which are not parsed). ktime_get_ns() then converts TSC cycles to
+// nanoseconds with a multiply and a shift, no division on the read side.
+//
+// Only an invariant TSC (CPUID 0x80000007 EDX bit 8) runs at a constant
+// rate through P- and C-state changes; without one the clock is still
+// used, but it may drift and a warning is printed.
+
+#define PIT_HZ              1193182
+#define PIT_CH2_DATA        0x42
+#define PIT_COMMAND         0x43
+#define PIT_CH2_GATE        0x61        // Bit 0 gate, bit 1 speaker, bit 5 OUT2
+#define CALIBRATE_MS        10
+#define CALIBRATE_SPINS     1000000     // ~1s of port reads: no PIT
+
+#define KTIME_SHIFT         32
+
+static u64 tsc_rate_khz;                // TSC cycles per millisecond
+static u64 tsc_boot;                    // TSC at ktime 0
+static u64 ktime_mult;                  // ns = cycles * mult >> KTIME_SHIFT
+static bool invariant;
+
+// Count TSC cycles over CALIBRATE_MS of PIT time; 0 if the PIT never fires
+static u64 pit_calibrate(void) {
+    u32 latch = PIT_HZ * CALIBRATE_MS / 1000;
+    
+    // Gate on, speaker off; channel 2, lo/hi byte, mode 0 (one-shot)
+    outb(PIT_CH2_GATE, (inb(PIT_CH2_GATE) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CH2_DATA, latch & 0xFF);
+    outb(PIT_CH2_DATA, latch >> 8);
+    
+    // OUT2 goes high when the count reaches zero
+    u64 start = rdtsc();
+    for (u32 spins = 0; spins < CALIBRATE_SPINS; spins++) {
+        if (inb(PIT_CH2_GATE) & 0x20) return (rdtsc() - start) / CALIBRATE_MS;
+    }
+    return 0;
+}
+
+// Rate from CPUID: leaf 0x15 (crystal ratio) or 0x16 (base MHz). Both are
+// often missing under virtualization, then fall back to a guess.
+static u64 cpuid_tsc_rate(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
+    u32 max_leaf = eax;
+    
+    if (max_leaf >= 0x15) {
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x15), "c"(0));
+        if (eax && ebx && ecx) return (u64)ecx * ebx / eax / 1000;
+    }
+    if (max_leaf >= 0x16) {
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x16), "c"(0));
+        if (eax & 0xFFFF) return (u64)(eax & 0xFFFF) * 1000;
+    }
+    return 1000000; // Assume 1GHz
+}
+
+// Calibrate on the boot CPU, interrupts off
+void tsc_init(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+    if (eax >= 0x80000007) {
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000007));
+        invariant = (edx & (1u << 8)) != 0;
+    }
+    
+    tsc_rate_khz = pit_calibrate();
+    if (tsc_rate_khz) {
+        serial_puts("[TSC] Calibrated against the PIT\r\n");
+    } else {
+        tsc_rate_khz = cpuid_tsc_rate();
+        serial_puts("[TSC] PIT not responding, using the CPUID rate\r\n");
+    }
+    if (!invariant) {
+        serial_puts("[TSC] WARNING: TSC is not invariant, time may drift\r\n");
+    }
+    
+    // 1e6 ns per ms
+    ktime_mult = (1000000ULL << KTIME_SHIFT) / tsc_rate_khz;
+    tsc_boot = rdtsc();
+}
+
+// TSC cycles per millisecond
+u64 tsc_khz(void) {
+    return tsc_rate_khz;
+}
+
+bool tsc_invariant(void) {
+    return invariant;
+}
+
+// Convert a TSC cycle count to nanoseconds
+u64 tsc_to_ns(u64 cycles) {
+    return (u64)(((unsigned __int128)cycles * ktime_mult) >> KTIME_SHIFT);
+}
+
+// TSC value at a ktime, for programming deadlines
+u64 ktime_to_tsc(u64 ns) {
+    // Whole milliseconds and the rest apart: no 128-bit division
+    return tsc_boot + ns / 1000000 * tsc_rate_khz + ns % 1000000 * tsc_rate_khz / 1000000;
+}
+
+// Nanoseconds since tsc_init
+u64 ktime_get_ns(void) {
+    return tsc_to_ns(rdtsc() - tsc_boot);
+}
\ No newline at end of file
@@ -11,6 +11,14 @@ void kmain(void) NORETURN;
 void serial_init(void);
 void serial_putc(char c);
 void serial_puts(const char *str);
+void serial_port_init(u16 base);
+void serial_port_write(u16 base, u8 byte);
+u8 serial_port_read(u16 base);
+bool serial_port_ready(u16 base);
+
+// Kernel command line
+const char *cmdline_get(void);
+bool cmdline_has_option(const char *option);
 
 // Kernel logging
 void klog_init(void);
@@ -21,20 +29,74 @@ void panic(const char *fmt, ...) NORETURN;
 void gdt_init(void);
 void tss_init(void);
 void idt_init(void);
+void idt_load(void);
+void idt_set_gate(u8 num, u64 base, u16 sel, u8 flags);
+void gdt_init_ap(u32 cpu);
 void enter_user(u64 rip, u64 rsp, u64 rflags);
 u64 get_kernel_stack(void);
 void set_kernel_stack(u64 stack_top);
 void setup_initial_paging(void);
 void enable_paging(void);
-void lapic_init(void);
+bool lapic_init(void);
 void lapic_eoi(void);
+u32 lapic_id(void);
+void lapic_send_ipi(u32 apic_id, u8 vector);
 void timer_init(void);
 void timer_tick_handler(void);
 
+// Lazily switched FPU/SSE/AVX state of a thread
+typedef struct {
+    void *area;             // XSAVE area, 64-byte aligned
+    void *alloc;            // kmalloc block holding it
+    u32 cpu;                // CPU whose registers last loaded it
+} fpu_t;
+void fpu_init(void);
+bool fpu_alloc(fpu_t *f);
+void fpu_free(fpu_t *f);
+void fpu_switch(fpu_t *prev, fpu_t *next);
+void fpu_trap(void);
+
+// Interrupt vectors
+#define IPI_RESCHED_VECTOR  0xF0    // Wake a CPU to look at its run queue
+
+// Clock event device (per-CPU one-shot timer, deadlines in TSC cycles)
+void clockevent_program(u64 deadline);
+void clockevent_stop(void);
+
+// TSC clocksource (calibrated at boot)
+void tsc_init(void);
+u64 tsc_khz(void);
+bool tsc_invariant(void);
+u64 tsc_to_ns(u64 cycles);
+u64 ktime_to_tsc(u64 ns);
+u64 ktime_get_ns(void);
+
 // Timer functions
+void tick_start(void);
+void tick_stop(void);
 u64 get_system_ticks(void);
 u64 get_system_time_ms(void);
 
+// Kernel timers, on the per-CPU timer wheel of the CPU that armed them.
+// Callbacks run at the first interrupt exit outside a critical section
+// after expiry, with interrupts off; they may take locks.
+typedef struct ktimer {
+    struct ktimer *next;        // Wheel slot links
+    struct ktimer *prev;
+    struct ktimer **slot;
+    u64 expires;                // Milliseconds since boot
+    void (*fn)(void *arg);
+    void *arg;
+    u32 cpu;                    // Wheel it is queued on
+    volatile bool pending;
+} ktimer_t;
+#define KTIMER_NONE ~0ULL
+void ktimer_init(ktimer_t *t, void (*fn)(void *arg), void *arg);
+void ktimer_add(ktimer_t *t, u64 delay_ms);
+bool ktimer_cancel(ktimer_t *t);
+void ktimer_run_expired(void);
+u64 ktimer_next_expiry(void);
+
 // Memory management functions
 void pmm_init(void);
 u64 pmm_alloc_page(void);
@@ -42,6 +104,21 @@ void pmm_free_page(u64 phys_addr);
 u64 pmm_alloc_pages(u64 count);
 void pmm_free_pages(u64 phys_addr, u64 count);
 void pmm_get_stats(u64 *total, u64 *free, u64 *used);
+void pmm_get_range(u64 *start, u64 *end);
+u64 pmm_alloc_pages_aligned(u64 count, u64 align_pages);
+bool pmm_frame_get(u64 phys_addr);
+bool pmm_frame_put(u64 phys_addr);
+u32 pmm_frame_refcount(u64 phys_addr);
+void pmm_frame_put_batch(const u64 *frames, u32 count);
+u32 pmm_alloc_batch(u64 *out, u32 count);
+
+// Page colouring (pagecolor=on)
+#define PMM_COLOR_ANY   0xFFFFFFFFu
+u64 pmm_alloc_page_color(u32 color);
+u32 pmm_alloc_batch_color(u64 *out, u32 count, u32 color);
+u32 pmm_color_hint(u64 pml4_phys, u64 va);
+bool pmm_color_partition(u64 pml4_phys, u32 first, u32 count);
+u32 pmm_color_count(void);
 
 void vmm_init(void);
 bool vmm_map_page(u64 vaddr, u64 paddr, u64 flags);
@@ -52,12 +129,34 @@ void vmm_unmap_pages(u64 vaddr_start, u64 count);
 void *kmalloc(u64 size);
 void kfree(void *ptr);
 
+// Device memory (PAT cache modes)
+#define CACHE_WB        0
+#define CACHE_WT        1
+#define CACHE_UC        2
+#define CACHE_WC        3
+void pat_init(void);
+u64 pat_pte_bits(u32 cachemode);
+void *ioremap(u64 phys, u64 len, u32 cachemode);
+void iounmap(void *addr);
+
 // Paging and memory management
 u64 setup_kernel_page_tables(void);
 void activate_kernel_page_tables(u64 pml4_phys);
 void debug_page_mapping(u64 virt_addr);
 u64 phys_to_virt(u64 phys_addr);
 void invlpg(u64 addr);
+u64 kernel_virt_to_phys(u64 va);
+void kernel_mappings_set_global(void);
+bool kernel_global_mappings(void);
+
+// Page table isolation (boot with pti=on)
+void pti_init(void);
+bool pti_enabled(void);
+bool pti_as_create(u64 pml4_phys);
+void pti_as_destroy(u64 pml4_phys);
+void pti_sync_user_entry(u64 pml4_phys, u64 index);
+void pti_switch_mm(u64 pml4_phys);
+void pti_switch_kernel(u64 pml4_phys);
 
 // User address space management
 bool setup_user_address_space(void **user_code_va, void **user_stack_top, u64 code_size);
@@ -67,11 +166,153 @@ bool map_user_4k(u64 user_va, u64 phys_addr, u64 flags);
 
 // Isolated user address space (separate PML4)
 void init_kernel_pml4_template(void);
+void user_as_pool_refill(void);
 u64 user_as_create(void);
+bool user_as_destroy(u64 pml4_phys, bool deferred);
+bool user_as_reap(void);
+u32 user_as_list(u64 *out, u32 max);
 bool user_map_4k_in_pml4(u64 pml4_phys, u64 va, u64 pa, bool writable, bool executable);
 u64 create_user_process(void);
+typedef bool (*user_pte_fn)(u64 *pte, u64 va, u64 size, void *ctx);  // false = stop
+u64 user_as_walk(u64 pml4_phys, u64 start, u64 end, user_pte_fn fn, void *ctx);
+u64 user_as_walk_all(u64 pml4_phys, u64 start, u64 end, user_pte_fn fn, void *ctx);
+void user_as_flush_tlb(u64 pml4_phys);
+u64 *user_as_get_pde(u64 pml4_phys, u64 va, bool create);
+u64 *user_as_get_pte(u64 pml4_phys, u64 va, bool create);
+u64 user_as_translate(u64 pml4_phys, u64 va);
+
+typedef struct {
+    u64 va;
+    u64 len;
+    u32 prot;               // VMA_READ / VMA_WRITE / VMA_EXEC
+} user_segment_t;
+
+bool user_as_populate(u64 pml4_phys, const user_segment_t *segs, u32 count);
+
+// Virtual memory areas (per user address space)
+#define VMA_READ        (1u << 0)
+#define VMA_WRITE       (1u << 1)
+#define VMA_EXEC        (1u << 2)
+#define VMA_ANON        (1u << 3)   // Demand-zero anonymous memory
+#define VMA_HUGEPAGE    (1u << 4)   // 2MB pages requested
+#define VMA_NOHUGEPAGE  (1u << 5)   // 2MB pages forbidden
+#define VMA_SHARED      (1u << 6)   // Shared memory object mapping
+#define VMA_SEQUENTIAL  (1u << 7)   // Expect sequential access: fault around
+#define VMA_RANDOM      (1u << 8)   // Expect random access: no read-ahead
+#define VMA_MAX_PER_AS  32
+
+typedef struct {
+    u64 start;
+    u64 end;
+    u32 flags;
+} vma_t;
+
+bool vma_add(u64 pml4_phys, u64 start, u64 end, u32 flags);
+vma_t *vma_find(u64 pml4_phys, u64 va);
+vma_t *vma_next(u64 pml4_phys, u64 va);
+bool vma_remove(u64 pml4_phys, u64 start, u64 end);
+bool vma_update(u64 pml4_phys, u64 start, u64 end, u32 set, u32 clear);
+u64 vma_find_gap(u64 pml4_phys, u64 len, u64 align, u64 lo, u64 hi);
+bool vma_carve(u64 pml4_phys, u64 start, u64 end);
+bool vma_huge_allowed(u64 pml4_phys, u64 va);
+void vma_destroy_all(u64 pml4_phys);
+
+// Transparent huge pages (boot with thp=always|madvise|never)
+void thp_init(void);
+bool thp_enabled_for(u32 vma_flags);
+bool thp_fault_huge(u64 pml4_phys, u64 va, const vma_t *vma);
+bool thp_collapse(u64 pml4_phys, u64 va);
+bool thp_split(u64 pml4_phys, u64 va);
+void thp_tick(void);
+
+// Shared memory objects
+u32 shm_create(u64 size);
+u64 shm_map(u64 pml4_phys, u32 id, u64 va, u32 prot);
+bool shm_unmap(u64 pml4_phys, u64 va);
+bool shm_destroy(u32 id);
+void shm_unmap_all(u64 pml4_phys);
+
+// Compressed in-memory swap
+u64 zswap_reclaim(u64 target);
+bool zswap_load(u64 pml4_phys, u64 va, u64 *pte);
+void zswap_invalidate(u64 pte);
+void zswap_get_stats(u64 *stored_pages, u64 *pool_pages);
+
+// Reverse mapping (frame -> user PTEs)
+typedef bool (*rmap_fn)(u64 pml4_phys, u64 va, u64 *pte, void *ctx);  // false = stop
+bool rmap_add(u64 frame, u64 pml4_phys, u64 va);
+void rmap_remove(u64 frame, u64 pml4_phys, u64 va);
+u32 rmap_walk(u64 frame, rmap_fn fn, void *ctx);
+u32 rmap_mapcount(u64 frame);
+u32 rmap_unmap_all(u64 frame);
+bool rmap_migrate_frame(u64 old_frame, u64 new_frame);
+void rmap_as_destroy(u64 pml4_phys);
+
+// Same-page merging (boot with ksm=on)
+void ksm_init(void);
+void ksm_set_enabled(bool enabled);
+void ksm_set_scan_rate(u32 pages_per_step, u32 interval_ticks);
+u64 ksm_merged_pages(void);
+void ksm_tick(void);
+void ksm_forget_as(u64 pml4_phys);
+
+// Page fault resolution (demand paging, remote pages, ...)
+bool vm_handle_page_fault(u64 addr, u64 error_code);
+u64 vm_prefault(u64 pml4_phys, u64 start, u64 end);
+
+// Memory access hints (values match the user-space MADV_* constants)
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_FREE       8
+#define MADV_HUGEPAGE   14
+#define MADV_NOHUGEPAGE 15
+bool vm_madvise(u64 pml4_phys, u64 start, u64 len, u32 advice);
+bool vm_zap_range(u64 pml4_phys, u64 start, u64 end);
+
+// Anonymous memory mappings (values match the user-space PROT_/MAP_ constants)
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_POPULATE    0x8000
+u64 vm_mmap(u64 pml4_phys, u64 addr, u64 len, u32 prot, u32 flags);
+bool vm_munmap(u64 pml4_phys, u64 addr, u64 len);
+
+// Post-copy migration: byte-stream transport between source and target
+typedef struct {
+    const char *name;
+    void (*send)(const void *buf, u64 len);
+    void (*recv)(void *buf, u64 len);       // Blocks until len bytes arrived
+    bool (*poll)(void);                     // Data ready to receive?
+} postcopy_transport_t;
+
+extern const postcopy_transport_t postcopy_serial_transport;
+
+bool postcopy_source_begin(u64 pml4_phys, const postcopy_transport_t *transport);
+bool postcopy_source_service(u32 push_budget);
+bool postcopy_restore(u64 pml4_phys, const postcopy_transport_t *transport);
+bool postcopy_handle_fault(u64 pml4_phys, u64 va, u64 *pte);
+void postcopy_poll(void);
+void postcopy_forget_as(u64 pml4_phys);
 void switch_to_user_process(u64 user_pml4_phys);
 
+// Dirty page logging (pre-copy migration)
+#define DIRTY_LOG_ALL ~0ULL
+bool dirty_log_start(u64 pml4_phys);
+void dirty_log_mark(u64 pml4_phys, u64 va, u64 size);
+u64 dirty_log_collect(u64 pml4_phys, u64 *out_va, u64 max);
+void dirty_log_stop(u64 pml4_phys);
+
+// Working-set estimation (accessed-bit scanning)
+#define WSS_BUCKETS 8
+void wss_tick(void);
+void wss_scan_now(u64 pml4_phys);
+u64 wss_estimate(u64 pml4_phys);
+bool wss_histogram(u64 pml4_phys, u64 out[WSS_BUCKETS]);
+i32 wss_page_age(u64 pml4_phys, u64 va);
+
 // User payload (from assembly)
 extern u8 user_payload_start[];
 extern u8 user_payload_end[];
@@ -81,13 +322,24 @@ struct thread;
 typedef struct thread thread_t;
 
 // Threading and scheduling
+#define THREAD_PRIORITY_IDLE    0
+#define THREAD_PRIORITY_LOW     1
+#define THREAD_PRIORITY_NORMAL  2
+#define THREAD_PRIORITY_HIGH    3
+#define THREAD_PRIORITY_REAL    4
 void sched_init(void);
 void sched_start(void);
 u32 thread_create(void (*entry_point)(void *), void *arg, const char *name);
+bool sched_set_priority(u32 tid, u8 priority);
+void sched_ap_main(u32 cpu) NORETURN;
 void sched_yield(void);
 void sched_tick(void);
+void sched_preempt(void);
+void sched_sleep_ms(u64 ms);
+void sched_wake(thread_t *t);
 void sched_print_stats(void);
 thread_t *sched_current_thread(void);
+fpu_t *sched_current_fpu(void);
 
 // System calls
 void syscall_init(void);
@@ -98,6 +350,91 @@ void syscall_print_stats(void);
 u64 read_msr(u32 msr);
 void write_msr(u32 msr, u64 value);
 void setup_syscall_msrs(void);
+void setup_syscall_msrs_ap(void);
+
+// Symmetric multiprocessing
+#define SMP_MAX_CPUS    8
+void smp_init(void);
+u32 smp_cpu_id(void);
+u32 smp_cpu_count(void);
+bool smp_cpu_online(u32 cpu);
+#define SMP_DIST_SAME       0
+#define SMP_DIST_LLC        1
+#define SMP_DIST_PACKAGE    2
+#define SMP_DIST_REMOTE     3
+u32 smp_cpu_distance(u32 a, u32 b);
+void smp_send_resched(u32 cpu);
+
+// Preemption control, per CPU: the timer only switches threads while the
+// count is 0. Holding a spinlock keeps preemption off.
+void preempt_disable(void);
+void preempt_enable(void);
+
+// Spinlocks
+typedef struct {
+    volatile u32 locked;
+} spinlock_t;
+
+static inline void spin_lock(spinlock_t *lock) {
+    preempt_disable();
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static inline bool spin_trylock(spinlock_t *lock) {
+    preempt_disable();
+    if (!lock->locked && !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) return true;
+    preempt_enable();
+    return false;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+// Block the calling thread; lock is released once it is marked blocked
+void sched_block(spinlock_t *lock);
+
+// Wait queues: FIFO lists of sleepers, each waiting on the caller's stack
+struct wait_queue;
+typedef struct waiter {
+    struct waiter *next;
+    struct waiter *prev;
+    struct wait_queue *volatile wq; // Queue it sleeps on, NULL once woken
+    thread_t *thread;               // NULL outside threads: polls wq
+    u64 key;                        // Futex key: word address
+    u64 key_as;                     // Futex key: address space, 0 if shared
+    bool woken;                     // False after a timeout
+} waiter_t;
+
+typedef struct wait_queue {
+    spinlock_t lock;
+    waiter_t *head;
+    waiter_t *tail;
+} wait_queue_t;
+
+void wait_queue_init(wait_queue_t *wq);
+bool wait_queue_sleep(wait_queue_t *wq, waiter_t *w, u64 timeout_ms);
+void wait_queue_wake_waiter(wait_queue_t *wq, waiter_t *w);
+void wait_queue_move(wait_queue_t *from, wait_queue_t *to, waiter_t *w);
+u32 wait_queue_wake(wait_queue_t *wq, u32 count);
+
+// Futexes: user-space words slept on by (address space, address)
+void futex_init(void);
+u64 futex_wait(u64 pml4_phys, u64 uaddr, u32 val, u64 timeout_ms);
+u64 futex_wake(u64 pml4_phys, u64 uaddr, u32 count);
+u64 futex_requeue(u64 pml4_phys, u64 uaddr, u32 count, u64 uaddr2, u32 requeue);
+
+// Time stamp counter
+static inline u64 rdtsc(void) {
+    u32 lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
 
 // Port I/O
 static inline void outb(u16 port, u8 val) {
@@ -0,0 +1,27 @@
+#ifndef MYRIA_PAGING_H
+#define MYRIA_PAGING_H
+
+#include <myria/types.h>
+
+// Software PTE bits
+//
+// The MMU ignores bits 9-11 of every entry and bits 52-58 of present
+// entries, and the memory manager keeps its own state there. Bits 9 and 10
+// mean different things depending on the present bit, so test PTE_PRESENT
+// before any of them. Every user of these bits takes them from here.
+
+// Present entries
+#define PTE_COW         (1ULL << 9)   // Merged copy-on-write frame (ksm.c)
+#define PTE_SHARED      (1ULL << 10)  // Refcounted shared memory frame (shm.c)
+#define PTE_LAZYFREE    (1ULL << 11)  // MADV_FREE, discard if still clean
+
+// Idle age kept by the working-set scanner (wss.c), present entries only
+#define PTE_AGE_SHIFT   52
+#define PTE_AGE_MASK    (0x7FULL << PTE_AGE_SHIFT)
+#define PTE_AGE_MAX     0x7F
+
+// Non-present entries
+#define PTE_REMOTE      (1ULL << 9)   // Page still on the migration source (postcopy.c)
+#define PTE_SWAP        (1ULL << 10)  // Compressed swap entry, handle in the address bits (zswap.c)
+
+#endif // MYRIA_PAGING_H
\ No newline at end of file
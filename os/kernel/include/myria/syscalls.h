@@ -16,6 +16,43 @@
 #define SYS_YIELD       9
 #define SYS_MALLOC      10
 #define SYS_FREE        11
+#define SYS_SHM_CREATE  12
+#define SYS_SHM_MAP     13
+#define SYS_SHM_UNMAP   14
+#define SYS_SHM_DESTROY 15
+#define SYS_MADVISE     16
+#define SYS_MMAP        17
+#define SYS_MUNMAP      18
+#define SYS_FUTEX       19
+
+// Shared memory protection bits
+#define SHM_PROT_READ   (1 << 0)
+#define SHM_PROT_WRITE  (1 << 1)
+#define SHM_PROT_EXEC   (1 << 2)
+
+// madvise hints
+#define MADV_NORMAL     0   // No special treatment
+#define MADV_RANDOM     1   // Random access: no read-ahead
+#define MADV_SEQUENTIAL 2   // Sequential access: aggressive read-ahead
+#define MADV_WILLNEED   3   // Populate the range now
+#define MADV_DONTNEED   4   // Drop the pages; next touch reads zeros
+#define MADV_FREE       8   // Pages may be discarded unless written again
+#define MADV_HUGEPAGE   14  // Prefer 2MB pages
+#define MADV_NOHUGEPAGE 15  // Never use 2MB pages
+
+// mmap protection and flags
+#define PROT_READ       (1 << 0)
+#define PROT_WRITE      (1 << 1)
+#define PROT_EXEC       (1 << 2)
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10    // addr is not a hint: fail instead of moving
+#define MAP_ANONYMOUS   0x20
+#define MAP_POPULATE    0x8000  // Install all pages now instead of on first touch
+
+// futex operations
+#define FUTEX_WAIT      0
+#define FUTEX_WAKE      1
+#define FUTEX_REQUEUE   3
 
 // System call wrapper functions for user programs
 static inline void sys_exit(u64 exit_code) {
@@ -50,6 +87,50 @@ static inline void sys_free(void *ptr) {
     syscall_dispatch(SYS_FREE, (u64)ptr, 0, 0, 0, 0, 0);
 }
 
+static inline u64 sys_shm_create(u64 size) {
+    return syscall_dispatch(SYS_SHM_CREATE, size, 0, 0, 0, 0, 0);
+}
+
+// va = 0 maps at the object's default address (same in every process)
+static inline void* sys_shm_map(u64 id, void *va, u64 prot) {
+    return (void*)syscall_dispatch(SYS_SHM_MAP, id, (u64)va, prot, 0, 0, 0);
+}
+
+static inline u64 sys_shm_unmap(void *va) {
+    return syscall_dispatch(SYS_SHM_UNMAP, (u64)va, 0, 0, 0, 0, 0);
+}
+
+static inline u64 sys_shm_destroy(u64 id) {
+    return syscall_dispatch(SYS_SHM_DESTROY, id, 0, 0, 0, 0, 0);
+}
+
+static inline u64 sys_madvise(void *addr, u64 len, u64 advice) {
+    return syscall_dispatch(SYS_MADVISE, (u64)addr, len, advice, 0, 0, 0);
+}
+
+// Anonymous private memory only; returns (void*)-1 on failure
+static inline void* sys_mmap(void *addr, u64 len, u64 prot, u64 flags) {
+    return (void*)syscall_dispatch(SYS_MMAP, (u64)addr, len, prot, flags, 0, 0);
+}
+
+static inline u64 sys_munmap(void *addr, u64 len) {
+    return syscall_dispatch(SYS_MUNMAP, (u64)addr, len, 0, 0, 0, 0);
+}
+
+// Sleep while *uaddr == val; 0 when woken, -1 otherwise (timeout_ms 0: none)
+static inline u64 sys_futex_wait(volatile u32 *uaddr, u32 val, u64 timeout_ms) {
+    return syscall_dispatch(SYS_FUTEX, (u64)uaddr, FUTEX_WAIT, val, timeout_ms, 0, 0);
+}
+
+static inline u64 sys_futex_wake(volatile u32 *uaddr, u32 count) {
+    return syscall_dispatch(SYS_FUTEX, (u64)uaddr, FUTEX_WAKE, count, 0, 0, 0);
+}
+
+// Wake count waiters on uaddr, move up to requeue more to uaddr2
+static inline u64 sys_futex_requeue(volatile u32 *uaddr, u32 count, volatile u32 *uaddr2, u32 requeue) {
+    return syscall_dispatch(SYS_FUTEX, (u64)uaddr, FUTEX_REQUEUE, count, 0, (u64)uaddr2, requeue);
+}
+
 // System call dispatcher (implemented in syscalls.c)
 extern u64 syscall_dispatch(u64 syscall_num, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
 
@@ -114,4 +114,41 @@ struct limine_hhdm_request {
     struct limine_hhdm_response *response;
 };
 
+struct limine_kernel_file_response {
+    uint64_t revision;
+    struct limine_file *kernel_file;
+};
+
+struct limine_kernel_file_request {
+    uint64_t id[4];
+    uint64_t revision;
+    struct limine_kernel_file_response *response;
+};
+
+struct limine_smp_info;
+typedef void (*limine_goto_address)(struct limine_smp_info *);
+
+struct limine_smp_info {
+    uint32_t processor_id;
+    uint32_t lapic_id;
+    uint64_t reserved;
+    limine_goto_address goto_address;   // Written by the BSP to start the AP
+    uint64_t extra_argument;
+};
+
+struct limine_smp_response {
+    uint64_t revision;
+    uint32_t flags;
+    uint32_t bsp_lapic_id;
+    uint64_t cpu_count;
+    struct limine_smp_info **cpus;
+};
+
+struct limine_smp_request {
+    uint64_t id[4];
+    uint64_t revision;
+    struct limine_smp_response *response;
+    uint64_t flags;
+};
+
 #endif // MYRIA_TYPES_H
\ No newline at end of file
@@ -51,9 +51,27 @@ void x86_early_init(void) {
     init_kernel_pml4_template();
     serial_puts("Kernel PML4 template initialized\r\n");
     
+    // Optional page table isolation (pti=on on the kernel command line)
+    serial_puts("About to init PTI\r\n");
+    pti_init();
+    serial_puts("PTI init completed\r\n");
+    
+    // Cache modes for device memory (ioremap)
+    pat_init();
+    
+    // Lazy FPU/SIMD state switching (XSAVE)
+    fpu_init();
+    
+    // Transparent huge page policy (thp= on the kernel command line)
+    thp_init();
+    
+    // Same-page merging (ksm=on on the kernel command line)
+    ksm_init();
+    
     // Initialize basic threading system
     serial_puts("About to init scheduler\r\n");
     sched_init();
+    futex_init();
     serial_puts("Scheduler init completed\r\n");
     
     // Initialize system calls
@@ -66,6 +84,22 @@ void x86_early_init(void) {
     setup_syscall_msrs();
     serial_puts("Syscall MSRs setup completed\r\n");
     
+    // Clocksource: calibrate the TSC before any timer is programmed
+    serial_puts("About to calibrate the TSC\r\n");
+    tsc_init();
+    serial_puts("TSC calibration completed\r\n");
+    
+    // Start the other CPUs; they pick up threads from their run queues
+    serial_puts("About to start application processors\r\n");
+    smp_init();
+    serial_puts("SMP init completed\r\n");
+    
+    // Timer tick on the boot CPU; threads become preemptible from here on
+    serial_puts("About to start the scheduler tick\r\n");
+    timer_init();
+    sched_start();
+    serial_puts("Scheduler tick started\r\n");
+    
     serial_puts("x86_early_init complete!\r\n");
 }
 
@@ -0,0 +1,218 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Dirty page logging for pre-copy live migration
+//
+// dirty_log_start() clears the hardware dirty bit on every user mapping of
+// an address space. Each dirty_log_collect() round harvests the D bits the
+// CPU has set since the last round, clears them again, and hands the
+// caller the virtual addresses of the dirty pages. The migration loop
+// repeats rounds, sending only those pages, until the set is small enough
+// to stop the process and copy the remainder.
+//
+// The log is keyed by virtual address, not frame: reclaim, same-page
+// merging, huge page collapse and copy on write move pages between frames
+// behind the process's back. The paths that replace a dirty PTE with one
+// whose D bit is clear (zswap eviction, merging) report the page through
+// dirty_log_mark() first. Dirty bits are kept per 2MB of address space in
+// chunks, which live in pages allocated one at a time as the set grows. If
+// that allocation fails the next collect reports DIRTY_LOG_ALL.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_DIRTY       (1ULL << 6)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+#define DIRTY_LOG_MAX   8
+#define DIRTY_LOG_CHUNK_PAGES   64      // Chunk pages per log (7GB of 2MB regions)
+
+// USER_AS_END from user_as.c
+#define DIRTY_LOG_END   0x0000800000000000ULL
+
+// Dirty bits of the 512 pages of one 2MB region
+typedef struct {
+    u64 va;             // Region base
+    u64 bits[LARGE_PAGE_SIZE / PAGE_SIZE / 64];
+} dirty_chunk_t;
+
+#define CHUNKS_PER_PAGE (PAGE_SIZE / sizeof(dirty_chunk_t))
+
+typedef struct {
+    u64 pml4_phys;      // Address space being logged (0 = free slot)
+    u64 chunk_pages[DIRTY_LOG_CHUNK_PAGES];
+    u32 chunk_count;    // Chunks in use, each region at most once
+    u32 last_chunk;     // Lookup hint: harvests go in address order
+    u64 dirty_pages;    // Bits set since the last collect
+    bool overflow;      // A dirty page could not be recorded
+    u32 rounds;
+} dirty_log_t;
+
+static dirty_log_t dirty_logs[DIRTY_LOG_MAX];
+
+static dirty_log_t *dirty_log_find(u64 pml4_phys) {
+    for (int i = 0; i < DIRTY_LOG_MAX; i++) {
+        if (dirty_logs[i].pml4_phys == pml4_phys) return &dirty_logs[i];
+    }
+    return NULL;
+}
+
+static dirty_chunk_t *chunk_at(dirty_log_t *log, u32 index) {
+    dirty_chunk_t *page = (dirty_chunk_t*)phys_to_virt(log->chunk_pages[index / CHUNKS_PER_PAGE]);
+    return &page[index % CHUNKS_PER_PAGE];
+}
+
+// Chunk of the region holding va, added if it has none yet. NULL when
+// the log is out of chunk space.
+static dirty_chunk_t *chunk_get(dirty_log_t *log, u64 va) {
+    u64 region = ALIGN_DOWN(va, LARGE_PAGE_SIZE);
+    if (log->last_chunk < log->chunk_count && chunk_at(log, log->last_chunk)->va == region) {
+        return chunk_at(log, log->last_chunk);
+    }
+    for (u32 i = 0; i < log->chunk_count; i++) {
+        if (chunk_at(log, i)->va == region) {
+            log->last_chunk = i;
+            return chunk_at(log, i);
+        }
+    }
+    
+    u32 index = log->chunk_count;
+    if (index % CHUNKS_PER_PAGE == 0) {
+        u32 page = index / CHUNKS_PER_PAGE;
+        if (page == DIRTY_LOG_CHUNK_PAGES) return NULL;
+        u64 pa = pmm_alloc_page();
+        if (!pa) return NULL;
+        log->chunk_pages[page] = pa;
+    }
+    
+    dirty_chunk_t *c = chunk_at(log, index);
+    c->va = region;
+    for (u32 w = 0; w < LARGE_PAGE_SIZE / PAGE_SIZE / 64; w++) {
+        c->bits[w] = 0;
+    }
+    log->chunk_count++;
+    log->last_chunk = index;
+    return c;
+}
+
+// Record [va, va + size) as dirty
+static void log_range(dirty_log_t *log, u64 va, u64 size) {
+    for (u64 page = ALIGN_DOWN(va, PAGE_SIZE); page < va + size; page += PAGE_SIZE) {
+        dirty_chunk_t *c = chunk_get(log, page);
+        if (!c) {
+            log->overflow = true;
+            return;
+        }
+    
+        u64 bit = (page - c->va) / PAGE_SIZE;
+        if (!(c->bits[bit / 64] & (1ULL << (bit % 64)))) {
+            c->bits[bit / 64] |= 1ULL << (bit % 64);
+            log->dirty_pages++;
+        }
+    }
+}
+
+static bool clear_dirty_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    (void)va;
+    (void)size;
+    (void)ctx;
+    
+    // Atomic: the CPU may set D on this entry concurrently
+    if (*pte & PTE_DIRTY) {
+        __atomic_fetch_and(pte, ~PTE_DIRTY, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+static bool harvest_dirty_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    dirty_log_t *log = (dirty_log_t*)ctx;
+    
+    if (!(*pte & PTE_DIRTY)) return true;
+    u64 old = __atomic_fetch_and(pte, ~PTE_DIRTY, __ATOMIC_RELAXED);
+    if (!(old & PTE_DIRTY)) return true;
+    
+    // A 2MB leaf only has one D bit, so every 4K page in it counts as dirty
+    log_range(log, va, size);
+    return true;
+}
+
+// Enable dirty logging for an address space. All pages start clean.
+bool dirty_log_start(u64 pml4_phys) {
+    if (!pml4_phys) return false;
+    if (dirty_log_find(pml4_phys)) return true;
+    
+    dirty_log_t *log = dirty_log_find(0);
+    if (!log) {
+        serial_puts("[DIRTY] ERROR: No free dirty log slot\r\n");
+        return false;
+    }
+    
+    log->pml4_phys = pml4_phys;
+    log->chunk_count = 0;
+    log->last_chunk = 0;
+    log->dirty_pages = 0;
+    log->overflow = false;
+    log->rounds = 0;
+    
+    // Bulk clear, then one flush so cached D=1 translations cannot hide writes
+    user_as_walk(pml4_phys, 0, DIRTY_LOG_END, clear_dirty_fn, NULL);
+    user_as_flush_tlb(pml4_phys);
+    
+    serial_puts("[DIRTY] Dirty logging enabled for address space\r\n");
+    return true;
+}
+
+// A PTE with D set is about to be replaced by one without (the page moves
+// to another frame or out of memory): keep its page in the log
+void dirty_log_mark(u64 pml4_phys, u64 va, u64 size) {
+    dirty_log_t *log = pml4_phys ? dirty_log_find(pml4_phys) : NULL;
+    if (log) log_range(log, va, size);
+}
+
+// Run one logging round: harvest and clear D bits, copy out the addresses
+// of up to max dirty pages (out_va may be NULL to just count) and reset
+// the log for the next round. Returns the number of dirty pages, or
+// DIRTY_LOG_ALL if some could not be recorded and every page must be
+// treated as dirty.
+u64 dirty_log_collect(u64 pml4_phys, u64 *out_va, u64 max) {
+    dirty_log_t *log = pml4_phys ? dirty_log_find(pml4_phys) : NULL;
+    if (!log) return 0;
+    
+    user_as_walk(pml4_phys, 0, DIRTY_LOG_END, harvest_dirty_fn, log);
+    user_as_flush_tlb(pml4_phys);
+    
+    u64 out = 0;
+    for (u32 i = 0; i < log->chunk_count; i++) {
+        dirty_chunk_t *c = chunk_at(log, i);
+        for (u32 w = 0; w < LARGE_PAGE_SIZE / PAGE_SIZE / 64; w++) {
+            u64 bits = c->bits[w];
+            c->bits[w] = 0;
+            while (bits && out_va) {
+                u32 b = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (out < max) out_va[out++] = c->va + (w * 64 + b) * PAGE_SIZE;
+            }
+        }
+    }
+    
+    u64 dirty = log->overflow ? DIRTY_LOG_ALL : log->dirty_pages;
+    log->dirty_pages = 0;
+    log->overflow = false;
+    log->rounds++;
+    return dirty;
+}
+
+// Disable logging and release the chunk pages
+void dirty_log_stop(u64 pml4_phys) {
+    dirty_log_t *log = pml4_phys ? dirty_log_find(pml4_phys) : NULL;
+    if (!log) return;
+    
+    u32 pages = (log->chunk_count + CHUNKS_PER_PAGE - 1) / CHUNKS_PER_PAGE;
+    for (u32 i = 0; i < pages; i++) {
+        pmm_free_page(log->chunk_pages[i]);
+    }
+    log->pml4_phys = 0;
+    log->chunk_count = 0;
+    log->dirty_pages = 0;
+    
+    serial_puts("[DIRTY] Dirty logging disabled for address space\r\n");
+}
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Page fault resolution
+//
+// Called from the #PF stub with CR2 and the error code. Returns true when
+// the fault was resolved and the faulting instruction can be restarted;
+// false sends it on to the fatal fault reporter.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+// #PF error code bits
+#define PF_PRESENT      (1ULL << 0)
+#define PF_WRITE        (1ULL << 1)
+#define PF_USER         (1ULL << 2)
+
+#define USER_SPACE_END  0x0000800000000000ULL
+
+#define FAULT_AROUND_PAGES  15      // Extra pages per fault in VMA_SEQUENTIAL
+
+static inline u64 read_cr3(void) {
+    u64 val;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(val));
+    return val;
+}
+
+// First touch of an anonymous page: 2MB if the VMA allows it, else 4K
+static bool demand_zero_fault(u64 pml4_phys, u64 va, const vma_t *vma) {
+    if (thp_fault_huge(pml4_phys, va, vma)) return true;
+    
+    u64 *pte = user_as_get_pte(pml4_phys, va, true);
+    if (!pte) return false;
+    
+    u64 frame = pmm_alloc_page_color(pmm_color_hint(pml4_phys, va));
+    if (!frame) return false;
+    
+    u64 *page = (u64*)phys_to_virt(frame);
+    for (int i = 0; i < 512; i++) {
+        page[i] = 0;
+    }
+    
+    u64 flags = PTE_PRESENT | PTE_USER;
+    if (vma->flags & VMA_WRITE) flags |= PTE_WRITABLE;
+    if (!(vma->flags & VMA_EXEC)) flags |= PTE_NOEXECUTE;
+    *pte = frame | flags;
+    rmap_add(frame, pml4_phys, va);
+    return true;
+}
+
+// Write to a merged page: take a private copy, or reuse the frame if
+// nobody else maps it any more
+static bool cow_break(u64 pml4_phys, u64 va, u64 *pte) {
+    vma_t *vma = vma_find(pml4_phys, va);
+    if (!vma || !(vma->flags & VMA_WRITE)) return false;
+    
+    u64 old = *pte & PTE_ADDR_MASK;
+    u64 keep = *pte & (PTE_USER | PTE_NOEXECUTE);
+    
+    if (pmm_frame_refcount(old) > 1) {
+        u64 frame = pmm_alloc_page_color(pmm_color_hint(pml4_phys, va));
+        if (!frame) return false;
+        
+        u64 *dst = (u64*)phys_to_virt(frame);
+        u64 *src = (u64*)phys_to_virt(old);
+        for (int i = 0; i < 512; i++) {
+            dst[i] = src[i];
+        }
+        
+        *pte = frame | PTE_PRESENT | PTE_WRITABLE | keep;
+        __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
+        rmap_remove(old, pml4_phys, va);
+        rmap_add(frame, pml4_phys, va);
+        pmm_frame_put(old);
+    } else {
+        *pte = old | PTE_PRESENT | PTE_WRITABLE | keep;
+        __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
+    }
+    return true;
+}
+
+// Bring in one missing page: remote, compressed or never touched
+static bool fault_in(u64 pml4_phys, u64 va, bool write) {
+    u64 *pte = user_as_get_pte(pml4_phys, va, false);
+    
+    // Page still on the migration source
+    if (pte && (*pte & PTE_REMOTE)) {
+        return postcopy_handle_fault(pml4_phys, va, pte);
+    }
+    
+    // Page compressed by reclaim
+    if (pte && (*pte & PTE_SWAP)) {
+        return zswap_load(pml4_phys, va, pte);
+    }
+    
+    // Never-touched page of an anonymous VMA
+    if (!pte || *pte == 0) {
+        vma_t *vma = vma_find(pml4_phys, va);
+        if (!vma || !(vma->flags & VMA_ANON)) return false;
+        if (write && !(vma->flags & VMA_WRITE)) return false;
+        return demand_zero_fault(pml4_phys, va, vma);
+    }
+    
+    return false;
+}
+
+// Sequential VMAs: also bring in the next few missing pages, so a linear
+// scan takes one fault per FAULT_AROUND_PAGES instead of one per page
+static void fault_around(u64 pml4_phys, u64 va) {
+    vma_t *vma = vma_find(pml4_phys, va);
+    if (!vma || !(vma->flags & VMA_SEQUENTIAL)) return;
+    
+    u64 end = va + (FAULT_AROUND_PAGES + 1) * PAGE_SIZE;
+    if (end > vma->end) end = vma->end;
+    
+    for (u64 next = va + PAGE_SIZE; next < end; next += PAGE_SIZE) {
+        u64 *pte = user_as_get_pte(pml4_phys, next, false);
+        if (pte && (*pte & (PTE_PRESENT | PTE_REMOTE))) continue;
+        if (!pte && user_as_translate(pml4_phys, next)) continue;   // Under a 2MB leaf
+        if (!fault_in(pml4_phys, next, false)) break;
+    }
+}
+
+// Populate [start, end) ahead of use (MADV_WILLNEED). Returns the number of
+// pages that had to be brought in.
+u64 vm_prefault(u64 pml4_phys, u64 start, u64 end) {
+    u64 count = 0;
+    for (u64 va = ALIGN_DOWN(start, PAGE_SIZE); va < end; va += PAGE_SIZE) {
+        if (va >= USER_SPACE_END) break;
+        if (user_as_translate(pml4_phys, va)) continue;
+        if (!fault_in(pml4_phys, va, false)) continue;
+        count++;
+    }
+    return count;
+}
+
+bool vm_handle_page_fault(u64 addr, u64 error_code) {
+    // Only user-half addresses are demand-managed
+    if (addr >= USER_SPACE_END) return false;
+    
+    u64 pml4_phys = read_cr3() & PTE_ADDR_MASK;
+    u64 va = addr & ~(PAGE_SIZE - 1);
+    
+    if (!(error_code & PF_PRESENT)) {
+        if (!fault_in(pml4_phys, va, (error_code & PF_WRITE) != 0)) return false;
+        fault_around(pml4_phys, va);
+        return true;
+    } else if (error_code & PF_WRITE) {
+        u64 *pte = user_as_get_pte(pml4_phys, va, false);
+        
+        // Write to a page shared by same-page merging
+        if (pte && (*pte & PTE_PRESENT) && (*pte & PTE_COW)) {
+            return cow_break(pml4_phys, va, pte);
+        }
+    }
+    
+    return false;
+}
\ No newline at end of file
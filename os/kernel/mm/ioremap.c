@@ -0,0 +1,122 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Device memory mappings
+//
+// ioremap maps a physical range (device registers, frame buffers) into the
+// kernel MMIO window [KERNEL_MMIO_BASE, KERNEL_PERCPU_BASE) with an explicit
+// cache mode: UC for registers, WC for buffers that are streamed to, WT
+// where reads should still hit the cache. The HHDM maps RAM write-back and
+// does not cover device ranges, so device access must go through here.
+// Mapping the same range with the same mode again returns the existing
+// mapping and takes a reference.
+
+// Page table entry flags
+#define PAGE_WRITE      (1UL << 1)
+#define PAGE_NX         (1UL << 63)
+
+#define IOREMAP_MAX     64
+#define IOREMAP_END     KERNEL_PERCPU_BASE
+
+typedef struct {
+    u64 va;                 // 0 = free slot
+    u64 phys;
+    u64 pages;
+    u32 cachemode;
+    u32 refs;
+} ioremap_t;
+
+static ioremap_t ioremaps[IOREMAP_MAX];
+static spinlock_t ioremap_lock;         // The table and the window
+
+// Lowest free run of pages in the window
+static u64 find_window_gap(u64 pages) {
+    u64 va = KERNEL_MMIO_BASE;
+    bool moved = true;
+    
+    while (moved) {
+        moved = false;
+        for (int i = 0; i < IOREMAP_MAX; i++) {
+            ioremap_t *m = &ioremaps[i];
+            if (!m->va) continue;
+    
+            u64 m_end = m->va + m->pages * PAGE_SIZE;
+            if (va < m_end && m->va < va + pages * PAGE_SIZE) {
+                va = m_end;
+                moved = true;
+            }
+        }
+    }
+    
+    if (va + pages * PAGE_SIZE > IOREMAP_END) return 0;
+    return va;
+}
+
+// Map [phys, phys + len) with a CACHE_* mode. Returns the virtual address
+// of phys (not rounded), or NULL on failure.
+void *ioremap(u64 phys, u64 len, u32 cachemode) {
+    if (len == 0) return NULL;
+    
+    u64 base = ALIGN_DOWN(phys, PAGE_SIZE);
+    u64 pages = (PAGE_ALIGN(phys + len) - base) / PAGE_SIZE;
+    
+    spin_lock(&ioremap_lock);
+    ioremap_t *slot = NULL;
+    for (int i = 0; i < IOREMAP_MAX; i++) {
+        ioremap_t *m = &ioremaps[i];
+        if (!m->va) {
+            if (!slot) slot = m;
+            continue;
+        }
+        if (m->phys == base && m->pages >= pages && m->cachemode == cachemode) {
+            m->refs++;
+            spin_unlock(&ioremap_lock);
+            return (void*)(m->va + (phys - base));
+        }
+    }
+    if (!slot) {
+        spin_unlock(&ioremap_lock);
+        serial_puts("[IOREMAP] ERROR: Too many mappings\r\n");
+        return NULL;
+    }
+    
+    u64 va = find_window_gap(pages);
+    if (!va) {
+        spin_unlock(&ioremap_lock);
+        serial_puts("[IOREMAP] ERROR: MMIO window exhausted\r\n");
+        return NULL;
+    }
+    
+    u64 flags = PAGE_WRITE | PAGE_NX | pat_pte_bits(cachemode);
+    if (!vmm_map_pages(va, base, pages, flags)) {
+        spin_unlock(&ioremap_lock);
+        serial_puts("[IOREMAP] ERROR: Failed to map device memory\r\n");
+        return NULL;
+    }
+    
+    slot->va = va;
+    slot->phys = base;
+    slot->pages = pages;
+    slot->cachemode = cachemode;
+    slot->refs = 1;
+    spin_unlock(&ioremap_lock);
+    return (void*)(va + (phys - base));
+}
+
+// Drop a mapping returned by ioremap; unmapped with the last reference
+void iounmap(void *addr) {
+    u64 va = (u64)addr;
+    
+    spin_lock(&ioremap_lock);
+    for (int i = 0; i < IOREMAP_MAX; i++) {
+        ioremap_t *m = &ioremaps[i];
+        if (!m->va || va < m->va || va >= m->va + m->pages * PAGE_SIZE) continue;
+    
+        if (--m->refs == 0) {
+            vmm_unmap_pages(m->va, m->pages);
+            m->va = 0;
+        }
+        break;
+    }
+    spin_unlock(&ioremap_lock);
+}
\ No newline at end of file
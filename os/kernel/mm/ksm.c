@@ -0,0 +1,304 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Same-page merging
+//
+// A budgeted scanner (ksm_tick, driven by the scheduler tick) walks the
+// private user pages of every live address space, hashes each one and looks
+// for an identical page:
+//  - in the stable table: frames already shared read-only between
+//    processes. A match is mapped to that frame and its own frame freed.
+//  - in the unstable table: frames seen earlier in this pass. A match turns
+//    the earlier frame into a new stable frame shared by both. Only the
+//    frame is remembered: the reverse map finds the PTE that maps it now,
+//    at the cost of its mappings rather than a page-table walk.
+// Hash matches are always confirmed with a full compare. Merged PTEs are
+// read-only with PTE_COW set; the first write takes a private copy again
+// (see vm_handle_page_fault). The stable table holds its own reference on
+// each frame, so a stable frame is never freed behind its back; entries
+// whose only remaining reference is the table's are dropped.
+//
+// Off by default: boot with ksm=on or call ksm_set_enabled(). The scan rate
+// is set with ksm_set_scan_rate(pages per step, ticks between steps).
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_DIRTY       (1ULL << 6)
+#define PTE_HUGEPAGE    (1ULL << 7)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+#define KSM_MAX_STABLE      1024
+#define KSM_MAX_UNSTABLE    2048
+#define KSM_MAX_PENDING     64          // Frames freed per TLB flush
+#define KSM_MAX_AS          64
+
+#define KSM_DEFAULT_PAGES       100
+#define KSM_DEFAULT_INTERVAL    20
+
+#define KSM_USER_END        0x0000800000000000ULL
+
+typedef struct {
+    u64 frame;              // 0 = free slot
+    u64 hash;
+} ksm_stable_t;
+
+typedef struct {
+    u64 hash;
+    u64 frame;
+} ksm_unstable_t;
+
+// The one mapping of an unstable frame, from the reverse map
+typedef struct {
+    u64 pml4_phys;
+    u64 va;
+    u64 *pte;
+} ksm_owner_t;
+
+static ksm_stable_t ksm_stable[KSM_MAX_STABLE];
+static ksm_unstable_t ksm_unstable[KSM_MAX_UNSTABLE];
+static u32 ksm_unstable_count;
+
+static bool ksm_enabled = false;
+static u32 ksm_pages_per_step = KSM_DEFAULT_PAGES;
+static u32 ksm_interval = KSM_DEFAULT_INTERVAL;
+
+// Scan cursor
+static u32 ksm_rr;
+static u64 ksm_cursor;
+static u64 ksm_ticks;
+
+static u64 ksm_pages_merged;
+
+typedef struct {
+    u64 pml4_phys;
+    u32 budget;
+    u64 pending[KSM_MAX_PENDING];
+    u32 pending_count;
+} ksm_scan_ctx_t;
+
+void ksm_init(void) {
+    if (cmdline_has_option("ksm=on")) {
+        ksm_enabled = true;
+        serial_puts("[KSM] Same-page merging enabled\r\n");
+    }
+}
+
+void ksm_set_enabled(bool enabled) {
+    ksm_enabled = enabled;
+}
+
+void ksm_set_scan_rate(u32 pages_per_step, u32 interval_ticks) {
+    ksm_pages_per_step = pages_per_step ? pages_per_step : 1;
+    ksm_interval = interval_ticks ? interval_ticks : 1;
+}
+
+u64 ksm_merged_pages(void) {
+    return ksm_pages_merged;
+}
+
+static u64 page_hash(u64 frame) {
+    const u64 *w = (const u64*)phys_to_virt(frame);
+    u64 h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 512; i++) {
+        h ^= w[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool pages_equal(u64 a, u64 b) {
+    const u64 *pa = (const u64*)phys_to_virt(a);
+    const u64 *pb = (const u64*)phys_to_virt(b);
+    for (int i = 0; i < 512; i++) {
+        if (pa[i] != pb[i]) return false;
+    }
+    return true;
+}
+
+// Point pte at the shared frame, read-only + COW. Its D bit goes, so a
+// write since the last dirty-log round is recorded now.
+static void map_cow(u64 pml4_phys, u64 va, u64 *pte, u64 frame) {
+    if (*pte & PTE_DIRTY) dirty_log_mark(pml4_phys, va, PAGE_SIZE);
+    *pte = frame | PTE_PRESENT | PTE_COW | (*pte & (PTE_USER | PTE_NOEXECUTE));
+}
+
+static ksm_stable_t *stable_lookup(u64 hash, u64 frame) {
+    for (int i = 0; i < KSM_MAX_STABLE; i++) {
+        ksm_stable_t *s = &ksm_stable[i];
+        if (!s->frame) continue;
+    
+        // Only the table still references it: retire the entry
+        if (pmm_frame_refcount(s->frame) <= 1) {
+            pmm_frame_put(s->frame);
+            s->frame = 0;
+            continue;
+        }
+    
+        if (s->hash == hash && pages_equal(s->frame, frame)) return s;
+    }
+    return NULL;
+}
+
+static ksm_stable_t *stable_insert(u64 hash, u64 frame) {
+    for (int i = 0; i < KSM_MAX_STABLE; i++) {
+        if (!ksm_stable[i].frame) {
+            if (!pmm_frame_get(frame)) return NULL;   // Table's reference
+            ksm_stable[i].frame = frame;
+            ksm_stable[i].hash = hash;
+            return &ksm_stable[i];
+        }
+    }
+    return NULL;
+}
+
+static bool owner_fn(u64 pml4_phys, u64 va, u64 *pte, void *ctx) {
+    ksm_owner_t *o = (ksm_owner_t*)ctx;
+    o->pml4_phys = pml4_phys;
+    o->va = va;
+    o->pte = pte;
+    return false;
+}
+
+// Is the unstable frame still one private 4K page, mapped exactly once?
+// Its single reference is that mapping, which the reverse map names
+// wherever it is now.
+static u64 *unstable_still_valid(ksm_unstable_t *u, ksm_owner_t *o) {
+    if (pmm_frame_refcount(u->frame) != 1) return NULL;
+    
+    o->pte = NULL;
+    rmap_walk(u->frame, owner_fn, o);
+    if (!o->pte) return NULL;
+    
+    u64 entry = *o->pte;
+    if (!(entry & PTE_PRESENT) || (entry & (PTE_HUGEPAGE | PTE_COW | PTE_SHARED))) return NULL;
+    
+    vma_t *vma = vma_find(o->pml4_phys, o->va);
+    if (!vma || (vma->flags & VMA_SHARED)) return NULL;
+    return o->pte;
+}
+
+static void flush_pending(ksm_scan_ctx_t *sc) {
+    if (!sc->pending_count) return;
+    
+    // No CPU may still use the old translations once the frames are reused
+    user_as_flush_tlb(sc->pml4_phys);
+    for (u32 i = 0; i < sc->pending_count; i++) {
+        pmm_frame_put(sc->pending[i]);
+    }
+    sc->pending_count = 0;
+}
+
+static bool ksm_scan_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    ksm_scan_ctx_t *sc = (ksm_scan_ctx_t*)ctx;
+    u64 entry = *pte;
+    
+    if (size != PAGE_SIZE) return true;
+    if (!(entry & PTE_USER) || (entry & (PTE_COW | PTE_SHARED))) return true;
+    
+    vma_t *vma = vma_find(sc->pml4_phys, va);
+    if (!vma || (vma->flags & VMA_SHARED)) return true;
+    
+    u64 frame = entry & PTE_ADDR_MASK;
+    if (pmm_frame_refcount(frame) != 1) return true;
+    
+    u64 hash = page_hash(frame);
+    
+    ksm_stable_t *s = stable_lookup(hash, frame);
+    if (s) {
+        if (pmm_frame_get(s->frame)) {
+            map_cow(sc->pml4_phys, va, pte, s->frame);
+            rmap_remove(frame, sc->pml4_phys, va);
+            rmap_add(s->frame, sc->pml4_phys, va);
+            sc->pending[sc->pending_count++] = frame;
+            ksm_pages_merged++;
+        }
+    } else {
+        // Look for an identical page seen earlier in this pass
+        ksm_unstable_t *match = NULL;
+        for (u32 i = 0; i < ksm_unstable_count; i++) {
+            ksm_unstable_t *u = &ksm_unstable[i];
+            if (!u->frame || u->hash != hash || u->frame == frame) continue;
+            if (!pages_equal(u->frame, frame)) continue;
+            match = u;
+            break;
+        }
+    
+        ksm_owner_t owner;
+        u64 *other = match ? unstable_still_valid(match, &owner) : NULL;
+        if (other && stable_insert(hash, match->frame)) {
+            // The earlier page's frame becomes the shared copy; its PTE
+            // keeps the reference it already had
+            u64 shared = match->frame;
+            map_cow(owner.pml4_phys, owner.va, other, shared);
+            if (owner.pml4_phys != sc->pml4_phys) {
+                user_as_flush_tlb(owner.pml4_phys);
+            }
+    
+            if (pmm_frame_get(shared)) {
+                map_cow(sc->pml4_phys, va, pte, shared);
+                rmap_remove(frame, sc->pml4_phys, va);
+                rmap_add(shared, sc->pml4_phys, va);
+                sc->pending[sc->pending_count++] = frame;
+                ksm_pages_merged++;
+            }
+            match->hash = 0;
+            match->frame = 0;
+        } else if (ksm_unstable_count < KSM_MAX_UNSTABLE) {
+            ksm_unstable_t *u = &ksm_unstable[ksm_unstable_count++];
+            u->hash = hash;
+            u->frame = frame;
+        }
+    }
+    
+    if (sc->pending_count == KSM_MAX_PENDING) return false;
+    return --sc->budget > 0;
+}
+
+// Forget pages of an address space being torn down
+void ksm_forget_as(u64 pml4_phys) {
+    for (u32 i = 0; i < ksm_unstable_count; i++) {
+        if (!ksm_unstable[i].frame) continue;
+    
+        ksm_owner_t o;
+        o.pte = NULL;
+        rmap_walk(ksm_unstable[i].frame, owner_fn, &o);
+        if (o.pte && o.pml4_phys == pml4_phys) {
+            ksm_unstable[i].hash = 0;
+            ksm_unstable[i].frame = 0;
+        }
+    }
+}
+
+// Budgeted scan step (scheduler tick)
+void ksm_tick(void) {
+    if (!ksm_enabled) return;
+    if (++ksm_ticks % ksm_interval) return;
+    
+    u64 live[KSM_MAX_AS];
+    u32 count = user_as_list(live, KSM_MAX_AS);
+    if (count == 0) return;
+    
+    if (ksm_rr >= count) {
+        // Full pass done: the unstable table only lives for one pass
+        ksm_rr = 0;
+        ksm_cursor = 0;
+        ksm_unstable_count = 0;
+    }
+    
+    ksm_scan_ctx_t sc;
+    sc.pml4_phys = live[ksm_rr];
+    sc.budget = ksm_pages_per_step;
+    sc.pending_count = 0;
+    
+    ksm_cursor = user_as_walk(sc.pml4_phys, ksm_cursor, KSM_USER_END, ksm_scan_fn, &sc);
+    flush_pending(&sc);
+    
+    if (ksm_cursor >= KSM_USER_END) {
+        ksm_rr++;
+        ksm_cursor = 0;
+    }
+}
\ No newline at end of file
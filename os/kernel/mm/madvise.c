@@ -0,0 +1,191 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// madvise: access-pattern hints from user space
+//
+// Policy hints are stored as VMA flags (splitting VMAs at the range edges)
+// and read by the fault path:
+//  - SEQUENTIAL: faults bring in the following pages too (fault-around,
+//    wider post-copy prefetch); RANDOM: no read-ahead at all
+//  - HUGEPAGE / NOHUGEPAGE: 2MB page policy for THP faults and collapse
+// Range operations act on the page tables right away:
+//  - WILLNEED: populate the range now
+//  - DONTNEED: drop the pages; the next touch sees zeros
+//  - FREE: the pages may be reclaimed without saving as long as they are
+//    not written again (PTE_LAZYFREE, honoured by zswap reclaim)
+// DONTNEED and FREE only apply to private anonymous memory.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_DIRTY       (1ULL << 6)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+#define MADV_USER_END   0x0000800000000000ULL
+#define MADV_FREE_BATCH 32              // Frames freed per TLB flush
+
+typedef struct {
+    u64 pml4_phys;
+    u64 start;
+    u64 end;
+    u32 advice;
+    u64 batch[MADV_FREE_BATCH];
+    u32 batch_count;
+    u64 split_va;           // Huge leaf that must be split first, or 0
+} madvise_ctx_t;
+
+// Every page of [start, end) must belong to some VMA; with anon_only they
+// must also be private anonymous memory
+static bool range_ok(u64 pml4_phys, u64 start, u64 end, bool anon_only) {
+    u64 va = start;
+    while (va < end) {
+        vma_t *v = vma_find(pml4_phys, va);
+        if (!v) return false;
+        if (anon_only && (!(v->flags & VMA_ANON) || (v->flags & VMA_SHARED))) return false;
+        va = v->end;
+    }
+    return true;
+}
+
+static void madvise_flush_batch(madvise_ctx_t *mc) {
+    if (!mc->batch_count) return;
+    
+    user_as_flush_tlb(mc->pml4_phys);
+    for (u32 i = 0; i < mc->batch_count; i++) {
+        pmm_frame_put(mc->batch[i]);
+    }
+    mc->batch_count = 0;
+}
+
+// Find a 2MB leaf that the range covers only partially (or, for FREE, at
+// all): those are split into 4K pages before the real pass
+static bool find_split_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    madvise_ctx_t *mc = (madvise_ctx_t*)ctx;
+    (void)pte;
+    if (size != LARGE_PAGE_SIZE) return true;
+    
+    bool whole = va >= mc->start && va + LARGE_PAGE_SIZE <= mc->end;
+    if (whole && mc->advice == MADV_DONTNEED) return true;
+    
+    mc->split_va = va;
+    return false;
+}
+
+static bool dontneed_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    madvise_ctx_t *mc = (madvise_ctx_t*)ctx;
+    u64 entry = *pte;
+    
+    if (!(entry & PTE_PRESENT)) {
+        // Swap or remote entry: forget the stored copy
+        zswap_invalidate(entry);
+        *pte = 0;
+        return true;
+    }
+    
+    u64 frame = entry & PTE_ADDR_MASK;
+    *pte = 0;
+    rmap_remove(frame, mc->pml4_phys, va);
+    
+    if (size == LARGE_PAGE_SIZE) {
+        user_as_flush_tlb(mc->pml4_phys);
+        pmm_free_pages(frame, LARGE_PAGE_SIZE / PAGE_SIZE);
+        return true;
+    }
+    
+    mc->batch[mc->batch_count++] = frame;
+    if (mc->batch_count == MADV_FREE_BATCH) {
+        madvise_flush_batch(mc);
+    }
+    return true;
+}
+
+static bool lazyfree_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    (void)va;
+    (void)ctx;
+    
+    // Merged and shared frames have other users; leave them alone
+    if (size != PAGE_SIZE || (*pte & (PTE_COW | PTE_SHARED))) return true;
+    
+    // Clear D so a later write is visible: that cancels the hint
+    __atomic_fetch_and(pte, ~PTE_DIRTY, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(pte, PTE_LAZYFREE, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+// Split every 2MB leaf that the operation cannot handle whole
+static bool split_huge_leaves(madvise_ctx_t *mc) {
+    u64 va = mc->start;
+    while (va < mc->end) {
+        mc->split_va = 0;
+        va = user_as_walk(mc->pml4_phys, va, mc->end, find_split_fn, mc);
+        if (!mc->split_va) break;
+        if (!thp_split(mc->pml4_phys, mc->split_va)) return false;
+        va = mc->split_va;
+    }
+    return true;
+}
+
+// Unmap and free every page in [start, end) of private anonymous memory;
+// the next touch sees zeros (MADV_DONTNEED, munmap)
+bool vm_zap_range(u64 pml4_phys, u64 start, u64 end) {
+    madvise_ctx_t mc;
+    mc.pml4_phys = pml4_phys;
+    mc.start = start;
+    mc.end = end;
+    mc.advice = MADV_DONTNEED;
+    mc.batch_count = 0;
+    if (!split_huge_leaves(&mc)) return false;
+    
+    user_as_walk_all(pml4_phys, start, end, dontneed_fn, &mc);
+    madvise_flush_batch(&mc);
+    return true;
+}
+
+// Apply advice to [start, start + len) of an address space. Returns false
+// on a bad range or advice.
+bool vm_madvise(u64 pml4_phys, u64 start, u64 len, u32 advice) {
+    if ((start & (PAGE_SIZE - 1)) || len == 0) return false;
+    u64 end = PAGE_ALIGN(start + len);
+    if (end <= start || end > MADV_USER_END) return false;
+    
+    switch (advice) {
+        case MADV_NORMAL:
+            return vma_update(pml4_phys, start, end, 0, VMA_SEQUENTIAL | VMA_RANDOM);
+        case MADV_RANDOM:
+            return vma_update(pml4_phys, start, end, VMA_RANDOM, VMA_SEQUENTIAL);
+        case MADV_SEQUENTIAL:
+            return vma_update(pml4_phys, start, end, VMA_SEQUENTIAL, VMA_RANDOM);
+        case MADV_HUGEPAGE:
+            return vma_update(pml4_phys, start, end, VMA_HUGEPAGE, VMA_NOHUGEPAGE);
+        case MADV_NOHUGEPAGE:
+            return vma_update(pml4_phys, start, end, VMA_NOHUGEPAGE, VMA_HUGEPAGE);
+    
+        case MADV_WILLNEED:
+            if (!range_ok(pml4_phys, start, end, false)) return false;
+            vm_prefault(pml4_phys, start, end);
+            return true;
+    
+        case MADV_DONTNEED:
+            if (!range_ok(pml4_phys, start, end, true)) return false;
+            return vm_zap_range(pml4_phys, start, end);
+    
+        case MADV_FREE: {
+            if (!range_ok(pml4_phys, start, end, true)) return false;
+    
+            madvise_ctx_t mc;
+            mc.pml4_phys = pml4_phys;
+            mc.start = start;
+            mc.end = end;
+            mc.advice = advice;
+            mc.batch_count = 0;
+            if (!split_huge_leaves(&mc)) return false;
+    
+            user_as_walk(pml4_phys, start, end, lazyfree_fn, &mc);
+            user_as_flush_tlb(pml4_phys);
+            return true;
+        }
+    
+        default:
+            return false;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Anonymous memory mappings
+//
+// mmap creates a private anonymous VMA; its pages are demand-zero faulted
+// on first touch. With MAP_POPULATE the whole range is installed up front
+// by user_as_populate (bulk frame allocation, one page-table pass), which
+// trades a longer mmap for no faults later. munmap frees the pages and
+// removes the range from the VMAs, splitting them as needed.
+
+#define MMAP_BASE       0x0000100000000000ULL   // Placement when addr is 0
+#define MMAP_END        0x0000600000000000ULL   // Shared memory slots above
+
+#define PROT_MASK       (VMA_READ | VMA_WRITE | VMA_EXEC)
+
+// Map len bytes of zeroed memory. addr is a hint unless MAP_FIXED is set.
+// Returns the mapped address, 0 on failure.
+u64 vm_mmap(u64 pml4_phys, u64 addr, u64 len, u32 prot, u32 flags) {
+    if (len == 0 || (addr & (PAGE_SIZE - 1))) return 0;
+    if (!(flags & MAP_ANONYMOUS) || !(flags & MAP_PRIVATE)) return 0;
+    
+    len = PAGE_ALIGN(len);
+    if (addr + len < addr || addr + len > MMAP_END) return 0;
+    
+    // Large mappings start 2MB-aligned so they can use huge pages
+    u64 align = len >= LARGE_PAGE_SIZE ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    u32 vma_flags = (prot & PROT_MASK) | VMA_ANON;
+    
+    u64 va = 0;
+    if (addr && vma_add(pml4_phys, addr, addr + len, vma_flags)) {
+        va = addr;
+    } else if (flags & MAP_FIXED) {
+        return 0;
+    } else {
+        va = vma_find_gap(pml4_phys, len, align, addr ? addr : MMAP_BASE, MMAP_END);
+        if (!va && addr) va = vma_find_gap(pml4_phys, len, align, MMAP_BASE, MMAP_END);
+        if (!va || !vma_add(pml4_phys, va, va + len, vma_flags)) return 0;
+    }
+    
+    if (flags & MAP_POPULATE) {
+        user_segment_t seg = { va, len, prot & PROT_MASK };
+        if (!user_as_populate(pml4_phys, &seg, 1)) {
+            vm_zap_range(pml4_phys, va, va + len);
+            vma_carve(pml4_phys, va, va + len);
+            return 0;
+        }
+    }
+    return va;
+}
+
+// Unmap [addr, addr + len). Only private anonymous memory can be unmapped
+// this way; shared memory objects go through shm_unmap.
+bool vm_munmap(u64 pml4_phys, u64 addr, u64 len) {
+    if (len == 0 || (addr & (PAGE_SIZE - 1))) return false;
+    u64 end = PAGE_ALIGN(addr + len);
+    if (end <= addr || end > MMAP_END) return false;
+    
+    // Holes are allowed, but nothing else may be in the range
+    for (vma_t *v = vma_next(pml4_phys, addr); v && v->start < end; v = vma_next(pml4_phys, v->end)) {
+        if (!(v->flags & VMA_ANON) || (v->flags & VMA_SHARED)) return false;
+    }
+    
+    if (!vm_zap_range(pml4_phys, addr, end)) return false;
+    return vma_carve(pml4_phys, addr, end);
+}
\ No newline at end of file
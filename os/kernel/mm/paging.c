@@ -201,6 +201,78 @@ static bool make_page_writable_minimal(u64 va) {
     }
 }
 
+// Translate a kernel virtual address through the live page tables
+u64 kernel_virt_to_phys(u64 va) {
+    walk_t w;
+    if (!walk_va_to_leaf(va, &w)) return 0;
+    
+    switch (w.leaf) {
+        case LEAF_4K:
+            return (*w.pte & PTE_ADDR_MASK) | (va & 0xFFFULL);
+        case LEAF_2M:
+            return (*w.pde & PTE_ADDR_MASK & ~((1ULL << 21) - 1)) | (va & ((1ULL << 21) - 1));
+        case LEAF_1G:
+            return (*w.pdpte & PTE_ADDR_MASK & ~((1ULL << 30) - 1)) | (va & ((1ULL << 30) - 1));
+        default:
+            return 0;
+    }
+}
+
+// Whether kernel leaf entries carry PTE_GLOBAL (off when PTI is active)
+static bool kernel_global_enabled = false;
+
+bool kernel_global_mappings(void) {
+    return kernel_global_enabled;
+}
+
+// Mark every kernel-half leaf (text, data, HHDM direct map) global so the
+// TLB keeps them across CR3 switches once CR4.PGE is set
+void kernel_mappings_set_global(void) {
+    serial_puts("[PAGING] Marking kernel mappings global\r\n");
+    
+    u64 *pml4 = (u64*)phys_to_virt(read_cr3() & PTE_ADDR_MASK);
+    u64 leaves = 0;
+    
+    for (u64 i4 = 256; i4 < 512; i4++) {
+        if (!(pml4[i4] & PTE_PRESENT)) continue;
+        u64 *pdpt = (u64*)phys_to_virt(pml4[i4] & PTE_ADDR_MASK);
+        
+        for (u64 i3 = 0; i3 < 512; i3++) {
+            if (!(pdpt[i3] & PTE_PRESENT)) continue;
+            if (pdpt[i3] & PTE_HUGEPAGE) {
+                pdpt[i3] |= PTE_GLOBAL;  // 1GB leaf
+                leaves++;
+                continue;
+            }
+            u64 *pd = (u64*)phys_to_virt(pdpt[i3] & PTE_ADDR_MASK);
+            
+            for (u64 i2 = 0; i2 < 512; i2++) {
+                if (!(pd[i2] & PTE_PRESENT)) continue;
+                if (pd[i2] & PTE_HUGEPAGE) {
+                    pd[i2] |= PTE_GLOBAL;  // 2MB leaf
+                    leaves++;
+                    continue;
+                }
+                u64 *pt = (u64*)phys_to_virt(pd[i2] & PTE_ADDR_MASK);
+                
+                for (u64 i1 = 0; i1 < 512; i1++) {
+                    if (pt[i1] & PTE_PRESENT) {
+                        pt[i1] |= PTE_GLOBAL;
+                        leaves++;
+                    }
+                }
+            }
+        }
+    }
+    
+    // Cached translations were loaded without G - drop them so they refill
+    // as global entries
+    write_cr3(read_cr3());
+    kernel_global_enabled = (leaves != 0);
+    
+    serial_puts("[PAGING] Kernel text/data/direct-map entries are now global\r\n");
+}
+
 // Complete approach - enable write permissions for ALL kernel writable sections
 void enable_bss_write_permissions(void) {
     serial_puts("[PAGING] Enabling write permissions for ALL kernel writable sections\r\n");
@@ -4,27 +4,241 @@
 // Forward declare serial functions
 extern void serial_puts(const char *str);
 
+// Limine memory map request - declared in start.S
+extern struct limine_memmap_request limine_memmap_request;
+
 // Enhanced PMM with free page tracking
-#define MAX_FREE_PAGES 1024
+//
+// Freed frames go on free lists linked through the frames themselves (via
+// the HHDM), so nothing is ever dropped. With page colouring on (boot with
+// pagecolor=on) there is one list per cache colour: frames whose addresses
+// fall into the same last-level cache sets share a colour, and callers that
+// pass a colour hint get frames spread evenly over the cache instead of
+// whatever the bump pointer or the last free happened to give. A process
+// can also be confined to a range of colours so that it cannot evict the
+// cache lines of its neighbours.
+//
+// Frames come from the usable RAM in the bootloader's memory map: the bump
+// pointer walks the usable ranges in address order and skips the holes.
+//
+// All PMM state is behind pmm_lock: frames are allocated from every CPU and
+// from preemptible threads. Reclaim runs with the lock dropped, since it
+// frees frames through the PMM itself.
 #define PMM_START_ADDR 0x200000  // Start at 2MB
-#define PMM_END_ADDR   0x40000000 // End at 1GB for now
+#define PMM_FALLBACK_END 0x40000000 // 1GB assumed without a memory map
+#define PMM_MAX_RANGES 32
+#define PMM_RECLAIM_BATCH 32      // Frames reclaimed per out-of-memory event
+
+#define PMM_MAX_COLORS      64
+#define PMM_DEFAULT_COLORS  16    // When CPUID cannot describe the LLC
+#define PMM_MAX_PARTITIONS  16
 
 // PMM state - BSS will be properly cleared by paging.c before we access these
-static u64 free_pages[MAX_FREE_PAGES];  // BSS array, cleared by proper page table setup
-static u32 free_page_count;             // BSS variable, cleared by proper page table setup
+static spinlock_t pmm_lock;
+static u64 free_head[PMM_MAX_COLORS];   // Free list per colour, 0 = empty
+static u64 free_count[PMM_MAX_COLORS];
+static u64 free_page_count;             // BSS variable, cleared by proper page table setup
+
+// Usable RAM, sorted by address; the bump pointer is in pmm_ranges[bump_range]
+typedef struct {
+    u64 start;
+    u64 end;
+} pmm_range_t;
+
+static pmm_range_t pmm_ranges[PMM_MAX_RANGES];
+static u32 pmm_range_count;
+static u32 bump_range;
+static u64 pmm_end;                     // End of the highest usable range
 static u64 next_page_addr;              // BSS variable, cleared by proper page table setup
 static u64 total_pages;                 // BSS variable, cleared by proper page table setup
 static u64 allocated_pages;             // BSS variable, cleared by proper page table setup
 static u64 freed_pages;                 // BSS variable, cleared by proper page table setup
 
+// Page colouring: color_count is a power of two, 1 when colouring is off
+static u32 color_count;
+static u32 color_cursor;                // Next list to try for uncoloured requests
+
+// Colour ranges reserved for particular address spaces
+typedef struct {
+    u64 pml4_phys;                      // 0 = free slot
+    u32 first;
+    u32 count;
+} color_partition_t;
+
+static color_partition_t color_partitions[PMM_MAX_PARTITIONS];
+
+// Per-frame reference counts for frames mapped by more than one owner
+// (shared memory, merged pages). 0 and 1 both mean a single owner, so
+// plain pmm_alloc_page/pmm_free_page users never need to touch them.
+// The array is carved out of the pool on first use.
+static u16 *frame_refs;
+
+static void free_list_push(u64 pa);
+
+// Pages the bump pointer has not reached yet
+static u64 bump_remaining(void) {
+    u64 pages = 0;
+    for (u32 i = bump_range; i < pmm_range_count; i++) {
+        u64 start = pmm_ranges[i].start > next_page_addr ? pmm_ranges[i].start : next_page_addr;
+        if (start < pmm_ranges[i].end) pages += (pmm_ranges[i].end - start) / PAGE_SIZE;
+    }
+    return pages;
+}
+
+// Take count contiguous frames aligned to align_pages from the bump
+// pointer, in the first usable range where they fit. Frames passed over on
+// the way (for alignment, or the tail of a range too short for the run) go
+// on the free lists. 0, with nothing moved, when no range fits.
+static u64 bump_alloc(u64 count, u64 align_pages) {
+    u64 align = align_pages * PAGE_SIZE;
+    u32 r = bump_range;
+    u64 addr = 0;
+    for (; r < pmm_range_count; r++) {
+        u64 from = pmm_ranges[r].start > next_page_addr ? pmm_ranges[r].start : next_page_addr;
+        addr = ALIGN_UP(from, align);
+        if (addr + count * PAGE_SIZE <= pmm_ranges[r].end) break;
+    }
+    if (r == pmm_range_count) return 0;
+    
+    for (; bump_range <= r; bump_range++) {
+        pmm_range_t *range = &pmm_ranges[bump_range];
+        u64 stop = bump_range == r ? addr : range->end;
+        if (next_page_addr < range->start) next_page_addr = range->start;
+        while (next_page_addr < stop) {
+            free_list_push(next_page_addr);
+            next_page_addr += PAGE_SIZE;
+        }
+    }
+    bump_range = r;
+    next_page_addr = addr + count * PAGE_SIZE;
+    return addr;
+}
+
+static bool frame_refs_init(void) {
+    if (frame_refs) return true;
+    
+    // Indexed by frame across the whole span, holes included
+    u64 span = (pmm_end - PMM_START_ADDR) / PAGE_SIZE;
+    u64 bytes = span * sizeof(u16);
+    u64 pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    u64 pa = bump_alloc(pages, 1);
+    if (!pa) return false;
+    allocated_pages += pages;
+    
+    frame_refs = (u16*)phys_to_virt(pa);
+    for (u64 i = 0; i < span; i++) {
+        frame_refs[i] = 0;
+    }
+    return true;
+}
+
+static inline u32 page_color(u64 pa) {
+    return (u32)(pa >> PAGE_SHIFT) & (color_count - 1);
+}
+
+static void free_list_push(u64 pa) {
+    u32 c = page_color(pa);
+    *(u64*)phys_to_virt(pa) = free_head[c];
+    free_head[c] = pa;
+    free_count[c]++;
+    free_page_count++;
+}
+
+static u64 free_list_pop(u32 c) {
+    u64 pa = free_head[c];
+    if (!pa) return 0;
+    
+    free_head[c] = *(u64*)phys_to_virt(pa);
+    free_count[c]--;
+    free_page_count--;
+    return pa;
+}
+
+// Number of page-sized slices in one way of the last-level cache: pages
+// that far apart compete for the same sets. CPUID leaf 4, highest level.
+static u32 llc_colors(void) {
+    u32 eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 4) return PMM_DEFAULT_COLORS;
+    
+    u64 way_size = 0;
+    u32 best_level = 0;
+    for (u32 i = 0; i < 16; i++) {
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(4), "c"(i));
+        u32 type = eax & 0x1F;
+        if (type == 0) break;
+        if (type == 2) continue;        // Instruction cache
+    
+        u32 level = (eax >> 5) & 0x7;
+        if (level < best_level) continue;
+        best_level = level;
+    
+        u64 line = (ebx & 0xFFF) + 1;
+        u64 partitions = ((ebx >> 12) & 0x3FF) + 1;
+        u64 sets = (u64)ecx + 1;
+        way_size = line * partitions * sets;
+    }
+    if (way_size < PAGE_SIZE) return PMM_DEFAULT_COLORS;
+    
+    u64 colors = way_size / PAGE_SIZE;
+    u32 pow2 = 1;
+    while (pow2 * 2 <= colors && pow2 < PMM_MAX_COLORS) {
+        pow2 *= 2;
+    }
+    return pow2;
+}
+
 // Initialize available memory pool
 static void init_memory_pool(void) {
     serial_puts("[PMM] Initializing memory pool\r\n");
     
+    // Usable RAM from the memory map, in address order. Frames below
+    // PMM_START_ADDR stay with the kernel image and early boot data.
+    pmm_range_count = 0;
+    struct limine_memmap_response *map = limine_memmap_request.response;
+    if (map) {
+        for (u64 i = 0; i < map->entry_count && pmm_range_count < PMM_MAX_RANGES; i++) {
+            struct limine_memmap_entry *e = map->entries[i];
+            if (e->type != LIMINE_MEMMAP_USABLE) continue;
+    
+            u64 start = PAGE_ALIGN(e->base);
+            u64 end = ALIGN_DOWN(e->base + e->length, PAGE_SIZE);
+            if (start < PMM_START_ADDR) start = PMM_START_ADDR;
+            if (start >= end) continue;
+    
+            u32 j = pmm_range_count++;
+            while (j > 0 && pmm_ranges[j - 1].start > start) {
+                pmm_ranges[j] = pmm_ranges[j - 1];
+                j--;
+            }
+            pmm_ranges[j].start = start;
+            pmm_ranges[j].end = end;
+        }
+    }
+    if (pmm_range_count == 0) {
+        serial_puts("[PMM] No memory map, assuming 1GB\r\n");
+        pmm_ranges[0].start = PMM_START_ADDR;
+        pmm_ranges[0].end = PMM_FALLBACK_END;
+        pmm_range_count = 1;
+    } else {
+        serial_puts("[PMM] Sized from the bootloader memory map\r\n");
+    }
+    
     // Set up the memory pool calculations (BSS is now cleared)
-    total_pages = (PMM_END_ADDR - PMM_START_ADDR) / PAGE_SIZE;
+    pmm_end = pmm_ranges[pmm_range_count - 1].end;
+    total_pages = 0;
+    for (u32 i = 0; i < pmm_range_count; i++) {
+        total_pages += (pmm_ranges[i].end - pmm_ranges[i].start) / PAGE_SIZE;
+    }
     free_page_count = 0;
-    next_page_addr = PMM_START_ADDR;
+    bump_range = 0;
+    next_page_addr = pmm_ranges[0].start;
+    
+    color_count = 1;
+    if (cmdline_has_option("pagecolor=on")) {
+        color_count = llc_colors();
+        serial_puts("[PMM] Page colouring enabled\r\n");
+    }
     
     serial_puts("[PMM] Memory pool initialized\r\n");
 }
@@ -48,57 +262,206 @@ void pmm_init(void) {
     serial_puts("[PMM] Enhanced PMM ready\r\n");
 }
 
-u64 pmm_alloc_page(void) {
-    // First try to get a page from the free stack
+// Take a frame of the given colour without reclaiming: its free list
+// first, then the bump pointer (frames skipped on the way go on their own
+// lists, at most color_count - 1 of them)
+static u64 take_color(u32 color) {
+    u64 pa = free_list_pop(color);
+    if (pa) return pa;
+    
+    while ((pa = bump_alloc(1, 1))) {
+        if (page_color(pa) == color) return pa;
+        free_list_push(pa);
+    }
+    return 0;
+}
+
+// Any frame without reclaiming, preferring the colour lists round-robin
+static u64 take_any(void) {
     if (free_page_count > 0) {
-        free_page_count--;
-        allocated_pages++;
-        return free_pages[free_page_count];
+        for (u32 i = 0; i < color_count; i++) {
+            u32 c = (color_cursor + i) & (color_count - 1);
+            u64 pa = free_list_pop(c);
+            if (pa) {
+                color_cursor = c + 1;
+                return pa;
+            }
+        }
+    }
+    
+    return bump_alloc(1, 1);
+}
+
+// One frame of a preferred colour, else any; pmm_lock held
+static u64 take_page(u32 color) {
+    u64 pa = 0;
+    if (color != PMM_COLOR_ANY && color_count > 1) {
+        pa = take_color(color & (color_count - 1));
     }
+    if (!pa) pa = take_any();
+    if (pa) allocated_pages++;
+    return pa;
+}
+
+// Allocate a frame of a preferred colour (PMM_COLOR_ANY for none). Falls
+// back to any colour rather than failing, so a hint never causes an OOM.
+u64 pmm_alloc_page_color(u32 color) {
+    spin_lock(&pmm_lock);
+    u64 pa = take_page(color);
+    spin_unlock(&pmm_lock);
     
-    // If no free pages, allocate a new one
-    if (next_page_addr < PMM_END_ADDR) {
-        u64 addr = next_page_addr;
-        next_page_addr += PAGE_SIZE;
-        allocated_pages++;
-        return addr;
+    // Try to make room by compressing cold user pages
+    if (!pa && zswap_reclaim(PMM_RECLAIM_BATCH)) {
+        spin_lock(&pmm_lock);
+        pa = take_page(PMM_COLOR_ANY);
+        spin_unlock(&pmm_lock);
     }
     
-    // Out of memory
-    serial_puts("[PMM] ERROR: Out of memory!\r\n");
-    return 0;
+    if (!pa) {
+        // Out of memory
+        serial_puts("[PMM] ERROR: Out of memory!\r\n");
+        return 0;
+    }
+    return pa;
 }
 
-void pmm_free_page(u64 phys_addr) {
+u64 pmm_alloc_page(void) {
+    return pmm_alloc_page_color(PMM_COLOR_ANY);
+}
+
+// pmm_lock held
+static void free_page_locked(u64 phys_addr) {
     // Validate address
-    if (phys_addr < PMM_START_ADDR || phys_addr >= PMM_END_ADDR) {
+    if (phys_addr < PMM_START_ADDR || phys_addr >= pmm_end) {
         return; // Invalid address
     }
     
-    // Check if we have space in the free stack
-    if (free_page_count < MAX_FREE_PAGES) {
-        free_pages[free_page_count] = phys_addr;
-        free_page_count++;
-        freed_pages++;
-        
-        if (allocated_pages > 0) {
-            allocated_pages--;
+    if (frame_refs) {
+        frame_refs[(phys_addr - PMM_START_ADDR) / PAGE_SIZE] = 0;
+    }
+    
+    free_list_push(phys_addr);
+    freed_pages++;
+    
+    if (allocated_pages > 0) {
+        allocated_pages--;
+    }
+}
+
+void pmm_free_page(u64 phys_addr) {
+    spin_lock(&pmm_lock);
+    free_page_locked(phys_addr);
+    spin_unlock(&pmm_lock);
+}
+
+// Allocate count independent pages into out, without going through
+// pmm_alloc_page per page; falls back to it (and reclaim) only when the
+// free lists and the bump pointer run dry. With a colour hint the pages get
+// consecutive colours starting at color, matching consecutive virtual
+// pages. Returns how many pages were allocated.
+u32 pmm_alloc_batch_color(u64 *out, u32 count, u32 color) {
+    u32 n = 0;
+    bool colored = color != PMM_COLOR_ANY && color_count > 1;
+    
+    spin_lock(&pmm_lock);
+    while (n < count) {
+        u64 pa = colored ? take_color((color + n) & (color_count - 1)) : 0;
+        if (!pa) pa = take_any();
+        if (!pa) break;
+        out[n++] = pa;
+    }
+    allocated_pages += n;
+    spin_unlock(&pmm_lock);
+    
+    while (n < count) {
+        u64 pa = pmm_alloc_page();
+        if (!pa) break;
+        out[n++] = pa;
+    }
+    return n;
+}
+
+u32 pmm_alloc_batch(u64 *out, u32 count) {
+    return pmm_alloc_batch_color(out, count, PMM_COLOR_ANY);
+}
+
+// Colour for the frame backing va in an address space, or PMM_COLOR_ANY
+// when colouring is off. Consecutive pages get consecutive colours; the
+// address space offsets the sequence so that two processes using the same
+// layout do not start on the same sets. A process with a partition only
+// gets colours from its own range.
+u32 pmm_color_hint(u64 pml4_phys, u64 va) {
+    if (color_count <= 1) return PMM_COLOR_ANY;
+    
+    u64 page = va >> PAGE_SHIFT;
+    u32 color = (u32)(page + (pml4_phys >> PAGE_SHIFT)) & (color_count - 1);
+    spin_lock(&pmm_lock);
+    for (int i = 0; i < PMM_MAX_PARTITIONS; i++) {
+        color_partition_t *p = &color_partitions[i];
+        if (p->pml4_phys == pml4_phys) {
+            color = (p->first + (u32)(page % p->count)) & (color_count - 1);
+            break;
+        }
+    }
+    spin_unlock(&pmm_lock);
+    return color;
+}
+
+// Confine an address space to colours [first, first + count). count 0
+// removes its partition. Colours are a preference, not a hard limit: when
+// the range is exhausted allocations still succeed from other colours.
+bool pmm_color_partition(u64 pml4_phys, u32 first, u32 count) {
+    spin_lock(&pmm_lock);
+    color_partition_t *slot = NULL;
+    for (int i = 0; i < PMM_MAX_PARTITIONS; i++) {
+        color_partition_t *p = &color_partitions[i];
+        if (p->pml4_phys == pml4_phys) {
+            slot = p;
+            break;
         }
+        if (!slot && !p->pml4_phys) slot = p;
+    }
+    
+    bool ok = true;
+    if (count == 0) {
+        if (slot && slot->pml4_phys == pml4_phys) slot->pml4_phys = 0;
+    } else if (!slot || color_count <= 1 || first + count > color_count) {
+        ok = false;
+    } else {
+        slot->pml4_phys = pml4_phys;
+        slot->first = first;
+        slot->count = count;
     }
+    spin_unlock(&pmm_lock);
+    return ok;
+}
+
+u32 pmm_color_count(void) {
+    return color_count;
 }
 
 u64 pmm_alloc_pages(u64 count) {
     if (count == 0) return 0;
     
     // For multiple pages, we need contiguous allocation
-    if (next_page_addr + (count * PAGE_SIZE) <= PMM_END_ADDR) {
-        u64 addr = next_page_addr;
-        next_page_addr += count * PAGE_SIZE;
-        allocated_pages += count;
-        return addr;
-    }
+    spin_lock(&pmm_lock);
+    u64 addr = bump_alloc(count, 1);
+    if (addr) allocated_pages += count;
+    spin_unlock(&pmm_lock);
     
-    return 0; // Can't allocate contiguous pages
+    return addr; // 0: can't allocate contiguous pages
+}
+
+// Contiguous run aligned to align_pages pages (e.g. 512 for a 2MB frame).
+// Pages skipped to reach the alignment go on the free lists.
+u64 pmm_alloc_pages_aligned(u64 count, u64 align_pages) {
+    if (count == 0 || align_pages == 0) return 0;
+    
+    spin_lock(&pmm_lock);
+    u64 addr = bump_alloc(count, align_pages);
+    if (addr) allocated_pages += count;
+    spin_unlock(&pmm_lock);
+    return addr;
 }
 
 void pmm_free_pages(u64 phys_addr, u64 count) {
@@ -109,7 +472,77 @@ void pmm_free_pages(u64 phys_addr, u64 count) {
 }
 
 void pmm_get_stats(u64 *total, u64 *free, u64 *used) {
+    spin_lock(&pmm_lock);
     if (total) *total = total_pages;
-    if (free) *free = free_page_count + ((PMM_END_ADDR - next_page_addr) / PAGE_SIZE);
+    if (free) *free = free_page_count + bump_remaining();
     if (used) *used = allocated_pages;
+    spin_unlock(&pmm_lock);
+}
+
+// Physical range managed by the PMM, e.g. for sizing per-PFN bitmaps
+void pmm_get_range(u64 *start, u64 *end) {
+    if (start) *start = PMM_START_ADDR;
+    if (end) *end = pmm_end;
+}
+
+// Take an extra reference on a frame
+bool pmm_frame_get(u64 phys_addr) {
+    if (phys_addr < PMM_START_ADDR || phys_addr >= pmm_end) return false;
+    
+    bool ok = false;
+    spin_lock(&pmm_lock);
+    if (frame_refs_init()) {
+        u16 *ref = &frame_refs[(phys_addr - PMM_START_ADDR) / PAGE_SIZE];
+        if (*ref != 0xFFFF) {
+            *ref = (*ref == 0) ? 2 : *ref + 1;
+            ok = true;
+        }
+    }
+    spin_unlock(&pmm_lock);
+    return ok;
+}
+
+// Drop a reference; frees the frame and returns true when it was the last
+bool pmm_frame_put(u64 phys_addr) {
+    if (phys_addr < PMM_START_ADDR || phys_addr >= pmm_end) return false;
+    
+    bool last = true;
+    spin_lock(&pmm_lock);
+    if (frame_refs) {
+        u16 *ref = &frame_refs[(phys_addr - PMM_START_ADDR) / PAGE_SIZE];
+        if (*ref > 1) {
+            (*ref)--;
+            last = false;
+        }
+    }
+    if (last) free_page_locked(phys_addr);
+    spin_unlock(&pmm_lock);
+    return last;
+}
+
+u32 pmm_frame_refcount(u64 phys_addr) {
+    if (phys_addr < PMM_START_ADDR || phys_addr >= pmm_end) return 0;
+    if (!frame_refs) return 1;
+    
+    u16 ref = frame_refs[(phys_addr - PMM_START_ADDR) / PAGE_SIZE];
+    return ref ? ref : 1;
+}
+
+// Drop one reference on each of count frames (bulk teardown)
+void pmm_frame_put_batch(const u64 *frames, u32 count) {
+    spin_lock(&pmm_lock);
+    for (u32 i = 0; i < count; i++) {
+        u64 pa = frames[i];
+        if (pa < PMM_START_ADDR || pa >= pmm_end) continue;
+    
+        if (frame_refs) {
+            u16 *ref = &frame_refs[(pa - PMM_START_ADDR) / PAGE_SIZE];
+            if (*ref > 1) {
+                (*ref)--;
+                continue;
+            }
+        }
+        free_page_locked(pa);
+    }
+    spin_unlock(&pmm_lock);
 }
\ No newline at end of file
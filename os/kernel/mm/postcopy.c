@@ -0,0 +1,393 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Post-copy migration with remote demand paging
+//
+// The source stops the process, sends a manifest of its mapped ranges and
+// then serves page requests while pushing the remaining pages in the
+// background. The target builds the address space from the manifest with
+// every page non-present and tagged PTE_REMOTE, and resumes the process
+// right away. A fault on a remote page requests it (plus a few following
+// remote pages as prefetch) and installs whatever pages arrive - requested,
+// prefetched or pushed - until the faulting one is present.
+//
+// Pages move over any byte-stream transport; postcopy_serial_transport uses
+// COM2, which QEMU can connect between two instances with a socket chardev
+// (see the qemu-migrate-* targets in the top-level Makefile).
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+// Wire protocol
+#define PC_MAGIC            0x3143504DU  // "MPC1"
+#define PC_MSG_RANGE        1   // Manifest entry: va, count, flags
+#define PC_MSG_RANGE_END    2   // End of manifest
+#define PC_MSG_REQUEST      3   // Target -> source: send count pages from va
+#define PC_MSG_PAGE         4   // Page at va, followed by PAGE_SIZE bytes
+#define PC_MSG_DONE         5   // Source has pushed every page
+
+#define PC_FLAG_WRITABLE    (1ULL << 0)
+#define PC_FLAG_EXEC        (1ULL << 1)
+
+typedef struct PACKED {
+    u32 magic;
+    u32 type;
+    u64 va;
+    u64 count;
+    u64 flags;
+} pc_msg_t;
+
+// Pages requested after the faulting one (only those still remote)
+#define PC_PREFETCH         7
+#define PC_PREFETCH_SEQUENTIAL 31
+
+#define PC_MAX_RANGES       64
+
+typedef struct {
+    u64 va;
+    u64 count;
+    u64 flags;
+} pc_range_t;
+
+// Source side
+static const postcopy_transport_t *src_transport;
+static u64 src_pml4;
+static pc_range_t src_ranges[PC_MAX_RANGES];
+static u32 src_range_count;
+static u32 src_push_range;      // Background push cursor
+static u64 src_push_page;
+
+// Target side
+static const postcopy_transport_t *dst_transport;
+static u64 dst_pml4;
+static bool dst_push_done;
+
+// COM2 transport
+#define PC_SERIAL_PORT      0x2F8
+
+static bool serial_link_ready = false;
+
+static void serial_link_init(void) {
+    if (!serial_link_ready) {
+        serial_port_init(PC_SERIAL_PORT);
+        serial_link_ready = true;
+    }
+}
+
+static void serial_link_send(const void *buf, u64 len) {
+    serial_link_init();
+    const u8 *p = (const u8*)buf;
+    for (u64 i = 0; i < len; i++) {
+        serial_port_write(PC_SERIAL_PORT, p[i]);
+    }
+}
+
+static void serial_link_recv(void *buf, u64 len) {
+    serial_link_init();
+    u8 *p = (u8*)buf;
+    for (u64 i = 0; i < len; i++) {
+        p[i] = serial_port_read(PC_SERIAL_PORT);
+    }
+}
+
+static bool serial_link_poll(void) {
+    serial_link_init();
+    return serial_port_ready(PC_SERIAL_PORT);
+}
+
+const postcopy_transport_t postcopy_serial_transport = {
+    .name = "com2",
+    .send = serial_link_send,
+    .recv = serial_link_recv,
+    .poll = serial_link_poll,
+};
+
+static void send_msg(const postcopy_transport_t *t, u32 type, u64 va, u64 count, u64 flags) {
+    pc_msg_t msg = { PC_MAGIC, type, va, count, flags };
+    t->send(&msg, sizeof(msg));
+}
+
+static bool recv_msg(const postcopy_transport_t *t, pc_msg_t *msg) {
+    t->recv(msg, sizeof(*msg));
+    if (msg->magic != PC_MAGIC) {
+        serial_puts("[POSTCOPY] ERROR: Bad message magic - stream out of sync\r\n");
+        return false;
+    }
+    return true;
+}
+
+// Source
+
+// Writability comes from the VMA where there is one: merged (PTE_COW)
+// pages are mapped read-only but the process may still write them
+static u64 leaf_flags(u64 pte, u64 va) {
+    u64 flags = 0;
+    vma_t *vma = vma_find(src_pml4, va);
+    if (vma ? (vma->flags & VMA_WRITE) : (pte & (PTE_WRITABLE | PTE_COW))) {
+        flags |= PC_FLAG_WRITABLE;
+    }
+    if (!(pte & PTE_NOEXECUTE)) flags |= PC_FLAG_EXEC;
+    return flags;
+}
+
+// Coalesce resident and compressed leaves into manifest ranges. Swap
+// entries keep the permission bits of the page they stand for.
+static bool manifest_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    bool *overflow = (bool*)ctx;
+    if (!(*pte & PTE_PRESENT) && !(*pte & PTE_SWAP)) return true;
+    
+    u64 pages = size / PAGE_SIZE;
+    u64 flags = leaf_flags(*pte, va);
+    
+    if (src_range_count > 0) {
+        pc_range_t *last = &src_ranges[src_range_count - 1];
+        if (last->va + last->count * PAGE_SIZE == va && last->flags == flags) {
+            last->count += pages;
+            return true;
+        }
+    }
+    
+    if (src_range_count == PC_MAX_RANGES) {
+        *overflow = true;
+        return false;
+    }
+    
+    src_ranges[src_range_count].va = va;
+    src_ranges[src_range_count].count = pages;
+    src_ranges[src_range_count].flags = flags;
+    src_range_count++;
+    return true;
+}
+
+static void send_page(u64 va) {
+    // Compressed by reclaim: decompress it before it goes out
+    u64 *pte = user_as_get_pte(src_pml4, va, false);
+    if (pte && !(*pte & PTE_PRESENT) && (*pte & PTE_SWAP)) {
+        if (!zswap_load(src_pml4, va, pte)) {
+            serial_puts("[POSTCOPY] ERROR: Could not load swapped page\r\n");
+            return;
+        }
+    }
+    
+    u64 pa = user_as_translate(src_pml4, va);
+    if (!pa) return;
+    
+    send_msg(src_transport, PC_MSG_PAGE, va, 1, 0);
+    src_transport->send((const void*)phys_to_virt(pa & PTE_ADDR_MASK), PAGE_SIZE);
+}
+
+// Send the manifest of a stopped process. Afterwards the caller drives
+// postcopy_source_service() until it returns false.
+bool postcopy_source_begin(u64 pml4_phys, const postcopy_transport_t *transport) {
+    serial_puts("[POSTCOPY] Source: sending address space manifest\r\n");
+    
+    src_transport = transport;
+    src_pml4 = pml4_phys;
+    src_range_count = 0;
+    src_push_range = 0;
+    src_push_page = 0;
+    
+    bool overflow = false;
+    user_as_walk_all(pml4_phys, 0, ~0ULL, manifest_fn, &overflow);
+    if (overflow) {
+        serial_puts("[POSTCOPY] ERROR: Address space too fragmented for manifest\r\n");
+        return false;
+    }
+    
+    for (u32 i = 0; i < src_range_count; i++) {
+        send_msg(transport, PC_MSG_RANGE, src_ranges[i].va, src_ranges[i].count, src_ranges[i].flags);
+    }
+    send_msg(transport, PC_MSG_RANGE_END, 0, 0, 0);
+    
+    serial_puts("[POSTCOPY] Source: manifest sent, serving pages\r\n");
+    return true;
+}
+
+// Serve pending demand requests first, then push up to push_budget pages
+// in address order. Returns false once every page has been pushed.
+bool postcopy_source_service(u32 push_budget) {
+    if (!src_transport) return false;
+    
+    while (src_transport->poll()) {
+        pc_msg_t msg;
+        if (!recv_msg(src_transport, &msg)) return false;
+        if (msg.type != PC_MSG_REQUEST) continue;
+    
+        for (u64 i = 0; i < msg.count; i++) {
+            send_page(msg.va + i * PAGE_SIZE);
+        }
+    }
+    
+    while (push_budget > 0 && src_push_range < src_range_count) {
+        pc_range_t *r = &src_ranges[src_push_range];
+        send_page(r->va + src_push_page * PAGE_SIZE);
+        push_budget--;
+    
+        if (++src_push_page == r->count) {
+            src_push_range++;
+            src_push_page = 0;
+        }
+    }
+    
+    if (src_push_range == src_range_count) {
+        send_msg(src_transport, PC_MSG_DONE, 0, 0, 0);
+        src_transport = NULL;
+        serial_puts("[POSTCOPY] Source: all pages pushed\r\n");
+        return false;
+    }
+    return true;
+}
+
+// Target
+
+// Mark one page as living on the source
+static bool mark_remote(u64 va, u64 flags) {
+    u64 *pte = user_as_get_pte(dst_pml4, va, true);
+    if (!pte) return false;
+    
+    u64 entry = PTE_REMOTE | PTE_USER;
+    if (flags & PC_FLAG_WRITABLE) entry |= PTE_WRITABLE;
+    if (!(flags & PC_FLAG_EXEC)) entry |= PTE_NOEXECUTE;
+    *pte = entry;
+    return true;
+}
+
+// Receive one page body and map it if its PTE is still remote
+static bool receive_page(u64 va) {
+    u64 frame = pmm_alloc_page_color(pmm_color_hint(dst_pml4, va));
+    if (!frame) {
+        serial_puts("[POSTCOPY] ERROR: Out of memory receiving page\r\n");
+        return false;
+    }
+    
+    dst_transport->recv((void*)phys_to_virt(frame), PAGE_SIZE);
+    
+    u64 *pte = user_as_get_pte(dst_pml4, va, false);
+    if (!pte || (*pte & PTE_PRESENT) || !(*pte & PTE_REMOTE)) {
+        // Duplicate (pushed after it was already fetched) or unmapped
+        pmm_free_page(frame);
+        return true;
+    }
+    
+    // Non-present entries are never cached, so no invalidation is needed
+    *pte = frame | PTE_PRESENT | (*pte & (PTE_USER | PTE_WRITABLE | PTE_NOEXECUTE));
+    rmap_add(frame, dst_pml4, va);
+    return true;
+}
+
+// Handle one incoming message from the source
+static bool target_process_msg(void) {
+    pc_msg_t msg;
+    if (!recv_msg(dst_transport, &msg)) return false;
+    
+    switch (msg.type) {
+        case PC_MSG_PAGE:
+            return receive_page(msg.va);
+        case PC_MSG_DONE:
+            dst_push_done = true;
+            serial_puts("[POSTCOPY] Target: source finished pushing\r\n");
+            return true;
+        default:
+            serial_puts("[POSTCOPY] ERROR: Unexpected message on target\r\n");
+            return false;
+    }
+}
+
+// Receive the manifest and build a fully remote address space in pml4_phys.
+// The process can be resumed as soon as this returns.
+bool postcopy_restore(u64 pml4_phys, const postcopy_transport_t *transport) {
+    serial_puts("[POSTCOPY] Target: receiving address space manifest\r\n");
+    
+    dst_transport = transport;
+    dst_pml4 = pml4_phys;
+    dst_push_done = false;
+    
+    for (;;) {
+        pc_msg_t msg;
+        if (!recv_msg(transport, &msg)) goto fail;
+        if (msg.type == PC_MSG_RANGE_END) break;
+        if (msg.type != PC_MSG_RANGE) goto fail;
+    
+        for (u64 i = 0; i < msg.count; i++) {
+            if (!mark_remote(msg.va + i * PAGE_SIZE, msg.flags)) {
+                serial_puts("[POSTCOPY] ERROR: Out of memory for page tables\r\n");
+                goto fail;
+            }
+        }
+    }
+    
+    serial_puts("[POSTCOPY] Target: address space restored, pages remote\r\n");
+    return true;
+    
+fail:
+    dst_transport = NULL;
+    return false;
+}
+
+// Page fault on a PTE_REMOTE entry of the restore target
+bool postcopy_handle_fault(u64 pml4_phys, u64 va, u64 *pte) {
+    if (!dst_transport || pml4_phys != dst_pml4) return false;
+    
+    // Already on its way if the source finished pushing - just drain
+    if (!dst_push_done) {
+        // Prefetch the following pages in the same page table that are
+        // still remote; they usually get touched next. The VMA's access
+        // hint (madvise) widens or disables the window.
+        u64 window = PC_PREFETCH;
+        vma_t *vma = vma_find(pml4_phys, va);
+        if (vma && (vma->flags & VMA_RANDOM)) window = 0;
+        if (vma && (vma->flags & VMA_SEQUENTIAL)) window = PC_PREFETCH_SEQUENTIAL;
+    
+        u64 count = 1;
+        while (count <= window && ((va >> 12) & 0x1FF) + count < 512 &&
+               (pte[count] & (PTE_PRESENT | PTE_REMOTE)) == PTE_REMOTE) {
+            count++;
+        }
+        send_msg(dst_transport, PC_MSG_REQUEST, va, count, 0);
+    }
+    
+    while (!(*pte & PTE_PRESENT)) {
+        if (dst_push_done && !dst_transport->poll()) {
+            serial_puts("[POSTCOPY] ERROR: Source finished but page never arrived\r\n");
+            return false;
+        }
+        if (!target_process_msg()) return false;
+    }
+    
+    return true;
+}
+
+// Install background-pushed pages without blocking (called from idle paths)
+void postcopy_poll(void) {
+    if (!dst_transport) return;
+    
+    while (dst_transport->poll()) {
+        if (!target_process_msg()) {
+            dst_transport = NULL;
+            return;
+        }
+    }
+    
+    if (dst_push_done) {
+        serial_puts("[POSTCOPY] Target: migration complete, all pages local\r\n");
+        dst_transport = NULL;
+    }
+}
+
+// Cancel any session on an address space that is being destroyed, so that
+// neither side touches its page tables afterwards
+void postcopy_forget_as(u64 pml4_phys) {
+    if (src_transport && src_pml4 == pml4_phys) {
+        src_transport = NULL;
+        serial_puts("[POSTCOPY] Source: address space destroyed, session cancelled\r\n");
+    }
+    if (dst_transport && dst_pml4 == pml4_phys) {
+        dst_transport = NULL;
+        serial_puts("[POSTCOPY] Target: address space destroyed, session cancelled\r\n");
+    }
+}
\ No newline at end of file
@@ -0,0 +1,398 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Reverse mapping: physical frame -> the user PTEs that map it
+//
+// Every mapping is named by (group, va). A group is the anonymous-memory
+// owner of one address space, much like an anon_vma: all its mappings share
+// one small group index instead of repeating the PML4 address, so a mapping
+// fits in a single u64 (page-aligned VA | group index in the low 12 bits).
+//
+// Each frame has one u64 slot:
+//  - 0: not mapped in any user address space
+//  - low 12 bits != 0: exactly one mapping, stored inline (the common
+//    private anonymous case costs no allocation at all)
+//  - low 12 bits == 0: slot >> 12 is the head of a chain of mapping items
+//    (shared memory, merged pages)
+//
+// Lookup, unmap-all and migration therefore cost O(mappings of the frame),
+// independent of how many address spaces exist. 2MB leaves are keyed by
+// their first frame.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_HUGEPAGE    (1ULL << 7)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+#define RMAP_MAX_GROUPS     64
+#define RMAP_GROUP_MASK     0xFFFULL
+#define RMAP_MAX_CHUNKS     256
+#define RMAP_ITEMS_PER_CHUNK (PAGE_SIZE / sizeof(rmap_item_t))
+#define RMAP_MAX_AFFECTED   64          // Address spaces flushed per operation
+
+typedef struct {
+    u64 key;                // va | group index
+    u32 next;               // Item index + 1, 0 = end of chain
+    u32 reserved;
+} rmap_item_t;
+
+typedef struct {
+    u64 pml4_phys;          // 0 = free slot
+    u64 mappings;
+} rmap_group_t;
+
+static rmap_group_t rmap_groups[RMAP_MAX_GROUPS];
+
+// Per-frame slots, carved out of the pool on first use
+static u64 *rmap_slots;
+static u64 rmap_base;
+static u64 rmap_frames;
+
+// Chain items, allocated a page at a time
+static rmap_item_t *rmap_chunks[RMAP_MAX_CHUNKS];
+static u32 rmap_chunk_count;
+static u32 rmap_free_items;     // Free list (item index + 1)
+
+static bool rmap_init(void) {
+    if (rmap_slots) return true;
+    
+    u64 end;
+    pmm_get_range(&rmap_base, &end);
+    rmap_frames = (end - rmap_base) / PAGE_SIZE;
+    
+    u64 pages = (rmap_frames * sizeof(u64) + PAGE_SIZE - 1) / PAGE_SIZE;
+    u64 pa = pmm_alloc_pages(pages);
+    if (!pa) {
+        serial_puts("[RMAP] ERROR: No memory for reverse map\r\n");
+        return false;
+    }
+    
+    rmap_slots = (u64*)phys_to_virt(pa);
+    for (u64 i = 0; i < rmap_frames; i++) {
+        rmap_slots[i] = 0;
+    }
+    return true;
+}
+
+static u64 *rmap_slot(u64 frame) {
+    if (!rmap_init()) return NULL;
+    if (frame < rmap_base || frame >= rmap_base + rmap_frames * PAGE_SIZE) return NULL;
+    return &rmap_slots[(frame - rmap_base) / PAGE_SIZE];
+}
+
+static rmap_item_t *rmap_item(u32 index) {
+    u32 i = index - 1;
+    return &rmap_chunks[i / RMAP_ITEMS_PER_CHUNK][i % RMAP_ITEMS_PER_CHUNK];
+}
+
+static u32 rmap_item_alloc(void) {
+    if (!rmap_free_items) {
+        if (rmap_chunk_count == RMAP_MAX_CHUNKS) return 0;
+        u64 pa = pmm_alloc_page();
+        if (!pa) return 0;
+    
+        rmap_chunks[rmap_chunk_count] = (rmap_item_t*)phys_to_virt(pa);
+        u32 first = rmap_chunk_count * RMAP_ITEMS_PER_CHUNK + 1;
+        rmap_chunk_count++;
+        for (u32 i = 0; i < RMAP_ITEMS_PER_CHUNK; i++) {
+            rmap_item(first + i)->next = rmap_free_items;
+            rmap_free_items = first + i;
+        }
+    }
+    
+    u32 index = rmap_free_items;
+    rmap_free_items = rmap_item(index)->next;
+    return index;
+}
+
+static void rmap_item_free(u32 index) {
+    rmap_item(index)->next = rmap_free_items;
+    rmap_free_items = index;
+}
+
+// Group index (1-based) of an address space
+static u64 rmap_group(u64 pml4_phys, bool create) {
+    u64 free_slot = 0;
+    for (u64 i = 0; i < RMAP_MAX_GROUPS; i++) {
+        if (rmap_groups[i].pml4_phys == pml4_phys) return i + 1;
+        if (!rmap_groups[i].pml4_phys && !free_slot) free_slot = i + 1;
+    }
+    if (!create || !free_slot) return 0;
+    
+    rmap_groups[free_slot - 1].pml4_phys = pml4_phys;
+    rmap_groups[free_slot - 1].mappings = 0;
+    return free_slot;
+}
+
+// The leaf (4K PTE or 2M PDE) that maps va in an address space
+static u64 *rmap_leaf(u64 pml4_phys, u64 va, u64 *size) {
+    u64 *pde = user_as_get_pde(pml4_phys, va, false);
+    if (!pde || !(*pde & PTE_PRESENT)) return NULL;
+    if (*pde & PTE_HUGEPAGE) {
+        *size = LARGE_PAGE_SIZE;
+        return pde;
+    }
+    *size = PAGE_SIZE;
+    return user_as_get_pte(pml4_phys, va, false);
+}
+
+// Record that frame is mapped at va in pml4_phys
+bool rmap_add(u64 frame, u64 pml4_phys, u64 va) {
+    u64 *slot = rmap_slot(frame);
+    u64 group = rmap_group(pml4_phys, true);
+    if (!slot || !group) return false;
+    
+    u64 key = (va & PTE_ADDR_MASK) | group;
+    if (*slot == 0) {
+        *slot = key;
+    } else {
+        if (*slot & RMAP_GROUP_MASK) {
+            // Second mapping: move the inline one into a chain
+            u32 first = rmap_item_alloc();
+            if (!first) return false;
+            rmap_item(first)->key = *slot;
+            rmap_item(first)->next = 0;
+            *slot = (u64)first << 12;
+        }
+    
+        u32 index = rmap_item_alloc();
+        if (!index) {
+            serial_puts("[RMAP] ERROR: Out of reverse map items\r\n");
+            return false;
+        }
+        rmap_item(index)->key = key;
+        rmap_item(index)->next = (u32)(*slot >> 12);
+        *slot = (u64)index << 12;
+    }
+    
+    rmap_groups[group - 1].mappings++;
+    return true;
+}
+
+// Forget the mapping of frame at va in pml4_phys
+void rmap_remove(u64 frame, u64 pml4_phys, u64 va) {
+    u64 *slot = rmap_slot(frame);
+    u64 group = rmap_group(pml4_phys, false);
+    if (!slot || !group || *slot == 0) return;
+    
+    u64 key = (va & PTE_ADDR_MASK) | group;
+    if (*slot & RMAP_GROUP_MASK) {
+        if (*slot != key) return;
+        *slot = 0;
+    } else {
+        u32 prev = 0;
+        u32 index = (u32)(*slot >> 12);
+        while (index && rmap_item(index)->key != key) {
+            prev = index;
+            index = rmap_item(index)->next;
+        }
+        if (!index) return;
+    
+        u32 next = rmap_item(index)->next;
+        if (prev) {
+            rmap_item(prev)->next = next;
+        } else {
+            *slot = (u64)next << 12;
+        }
+        rmap_item_free(index);
+    
+        // Back to a single mapping: store it inline again
+        if (*slot && !rmap_item((u32)(*slot >> 12))->next) {
+            u32 last = (u32)(*slot >> 12);
+            *slot = rmap_item(last)->key;
+            rmap_item_free(last);
+        }
+    }
+    
+    rmap_groups[group - 1].mappings--;
+}
+
+// Call fn for every PTE that maps frame. Returns the number visited.
+// fn must not add or remove mappings of the same frame.
+u32 rmap_walk(u64 frame, rmap_fn fn, void *ctx) {
+    u64 *slot = rmap_slot(frame);
+    if (!slot || *slot == 0) return 0;
+    
+    u64 single = *slot;
+    u32 index = 0;
+    if (!(single & RMAP_GROUP_MASK)) {
+        index = (u32)(single >> 12);
+        single = 0;
+    }
+    
+    u32 visited = 0;
+    while (single || index) {
+        u64 key = single ? single : rmap_item(index)->key;
+        u32 next = single ? 0 : rmap_item(index)->next;
+        single = 0;
+        index = next;
+    
+        u64 pml4_phys = rmap_groups[(key & RMAP_GROUP_MASK) - 1].pml4_phys;
+        u64 va = key & PTE_ADDR_MASK;
+        if (!pml4_phys) continue;
+        u64 size;
+        u64 *pte = rmap_leaf(pml4_phys, va, &size);
+        if (!pte || (*pte & PTE_ADDR_MASK) != frame) continue;   // Stale
+    
+        visited++;
+        if (!fn(pml4_phys, va, pte, ctx)) break;
+    }
+    return visited;
+}
+
+typedef struct {
+    u32 count;
+    bool huge;
+} rmap_count_ctx_t;
+
+static bool count_fn(u64 pml4_phys, u64 va, u64 *pte, void *ctx) {
+    rmap_count_ctx_t *cc = (rmap_count_ctx_t*)ctx;
+    (void)pml4_phys;
+    (void)va;
+    if (*pte & PTE_HUGEPAGE) cc->huge = true;
+    cc->count++;
+    return true;
+}
+
+// Number of user PTEs currently mapping frame
+u32 rmap_mapcount(u64 frame) {
+    rmap_count_ctx_t cc = { 0, false };
+    rmap_walk(frame, count_fn, &cc);
+    return cc.count;
+}
+
+typedef struct {
+    u64 frame;
+    u64 new_frame;          // 0 = unmap
+    u64 affected[RMAP_MAX_AFFECTED];
+    u32 affected_count;
+    u32 mappings;
+    bool huge;
+} rmap_update_ctx_t;
+
+static void note_affected(rmap_update_ctx_t *uc, u64 pml4_phys) {
+    for (u32 i = 0; i < uc->affected_count; i++) {
+        if (uc->affected[i] == pml4_phys) return;
+    }
+    if (uc->affected_count < RMAP_MAX_AFFECTED) {
+        uc->affected[uc->affected_count++] = pml4_phys;
+    } else {
+        // Too many to track: flush right away
+        user_as_flush_tlb(pml4_phys);
+    }
+}
+
+static bool update_fn(u64 pml4_phys, u64 va, u64 *pte, void *ctx) {
+    rmap_update_ctx_t *uc = (rmap_update_ctx_t*)ctx;
+    (void)va;
+    
+    if (*pte & PTE_HUGEPAGE) uc->huge = true;
+    if (uc->new_frame) {
+        *pte = (*pte & ~PTE_ADDR_MASK) | uc->new_frame;
+    } else {
+        *pte = 0;
+    }
+    note_affected(uc, pml4_phys);
+    uc->mappings++;
+    return true;
+}
+
+static void flush_affected(rmap_update_ctx_t *uc) {
+    for (u32 i = 0; i < uc->affected_count; i++) {
+        user_as_flush_tlb(uc->affected[i]);
+    }
+}
+
+// Drop every chain entry of frame
+static void rmap_clear(u64 frame) {
+    u64 *slot = rmap_slot(frame);
+    if (!slot || *slot == 0) return;
+    
+    if (*slot & RMAP_GROUP_MASK) {
+        rmap_groups[(*slot & RMAP_GROUP_MASK) - 1].mappings--;
+    } else {
+        u32 index = (u32)(*slot >> 12);
+        while (index) {
+            u32 next = rmap_item(index)->next;
+            rmap_groups[(rmap_item(index)->key & RMAP_GROUP_MASK) - 1].mappings--;
+            rmap_item_free(index);
+            index = next;
+        }
+    }
+    *slot = 0;
+}
+
+// Unmap frame from every address space, flushing each one once, and drop
+// the references those mappings held. Returns the number of PTEs cleared.
+u32 rmap_unmap_all(u64 frame) {
+    rmap_update_ctx_t uc;
+    uc.frame = frame;
+    uc.new_frame = 0;
+    uc.affected_count = 0;
+    uc.mappings = 0;
+    uc.huge = false;
+    
+    rmap_walk(frame, update_fn, &uc);
+    flush_affected(&uc);
+    rmap_clear(frame);
+    
+    if (uc.huge) {
+        pmm_free_pages(frame, LARGE_PAGE_SIZE / PAGE_SIZE);
+    } else {
+        for (u32 i = 0; i < uc.mappings; i++) {
+            pmm_frame_put(frame);
+        }
+    }
+    return uc.mappings;
+}
+
+// Move the contents and every mapping of a 4K frame to new_frame (a fresh,
+// unmapped frame) and free the old one. Callers outside the rmap (shared
+// memory objects, the merge table) must not hold references to old_frame.
+bool rmap_migrate_frame(u64 old_frame, u64 new_frame) {
+    u64 *old_slot = rmap_slot(old_frame);
+    u64 *new_slot = rmap_slot(new_frame);
+    if (!old_slot || !new_slot || *new_slot) return false;
+    
+    rmap_count_ctx_t cc = { 0, false };
+    rmap_walk(old_frame, count_fn, &cc);
+    u32 refs = pmm_frame_refcount(old_frame);
+    if (cc.huge || cc.count == 0) return false;
+    if (refs != cc.count) return false;     // Owners outside the rmap
+    
+    u64 *dst = (u64*)phys_to_virt(new_frame);
+    u64 *src = (u64*)phys_to_virt(old_frame);
+    for (int i = 0; i < 512; i++) {
+        dst[i] = src[i];
+    }
+    
+    rmap_update_ctx_t uc;
+    uc.frame = old_frame;
+    uc.new_frame = new_frame;
+    uc.affected_count = 0;
+    uc.mappings = 0;
+    uc.huge = false;
+    
+    rmap_walk(old_frame, update_fn, &uc);
+    flush_affected(&uc);
+    
+    // The chain moves over unchanged: it is keyed by (group, va), not frame
+    *new_slot = *old_slot;
+    *old_slot = 0;
+    for (u32 i = 1; i < refs; i++) {
+        pmm_frame_get(new_frame);
+    }
+    pmm_free_page(old_frame);
+    return true;
+}
+
+// Release the group of an address space being torn down
+void rmap_as_destroy(u64 pml4_phys) {
+    u64 group = rmap_group(pml4_phys, false);
+    if (!group) return;
+    
+    if (rmap_groups[group - 1].mappings) {
+        serial_puts("[RMAP] WARNING: Address space destroyed with live mappings\r\n");
+    }
+    rmap_groups[group - 1].pml4_phys = 0;
+}
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Shared memory objects
+//
+// An object is a fixed set of zeroed frames. The object holds one reference
+// on each frame and every mapping holds another, so the frames stay alive
+// until the object is destroyed and the last mapping is gone, regardless of
+// order. Mapping an object into a process just points its PTEs at the same
+// frames - no data is ever copied. Each mapping has its own protection.
+//
+// Mapped PTEs carry PTE_SHARED and the VMA carries VMA_SHARED, so huge page
+// collapse and other per-page rewriting leave them alone.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+#define SHM_MAX_OBJECTS     32
+#define SHM_MAX_MAPPINGS    64
+#define SHM_MAX_PAGES       512         // Frame list is one page: 2MB per object
+
+// Default placement: object N at SHM_MAP_BASE + N * 2MB, the same VA in
+// every process, so pointers into shared data stay valid across processes
+#define SHM_MAP_BASE        0x0000600000000000ULL
+
+typedef struct {
+    bool used;
+    bool destroyed;         // No new mappings; freed with the last mapping
+    u64 pages;
+    u64 frames_phys;        // Page holding the u64 frame addresses
+    u32 map_count;
+} shm_object_t;
+
+typedef struct {
+    u64 pml4_phys;          // 0 = free slot
+    u64 va;
+    u32 id;
+    u32 prot;
+} shm_mapping_t;
+
+static shm_object_t shm_objects[SHM_MAX_OBJECTS];
+static shm_mapping_t shm_mappings[SHM_MAX_MAPPINGS];
+
+static shm_object_t *shm_get(u32 id) {
+    if (id == 0 || id > SHM_MAX_OBJECTS) return NULL;
+    shm_object_t *obj = &shm_objects[id - 1];
+    return obj->used ? obj : NULL;
+}
+
+static u64 *shm_frames(shm_object_t *obj) {
+    return (u64*)phys_to_virt(obj->frames_phys);
+}
+
+// Release the object's own references and its frame list
+static void shm_release(shm_object_t *obj) {
+    u64 *frames = shm_frames(obj);
+    for (u64 i = 0; i < obj->pages; i++) {
+        pmm_frame_put(frames[i]);
+    }
+    pmm_free_page(obj->frames_phys);
+    obj->used = false;
+}
+
+// Create an object of size bytes (rounded up to pages). Returns its id, 0 on failure.
+u32 shm_create(u64 size) {
+    u64 pages = PAGE_ALIGN(size) / PAGE_SIZE;
+    if (pages == 0 || pages > SHM_MAX_PAGES) {
+        serial_puts("[SHM] ERROR: Invalid shared memory size\r\n");
+        return 0;
+    }
+    
+    u32 id = 0;
+    for (u32 i = 0; i < SHM_MAX_OBJECTS; i++) {
+        if (!shm_objects[i].used) {
+            id = i + 1;
+            break;
+        }
+    }
+    if (!id) {
+        serial_puts("[SHM] ERROR: Too many shared memory objects\r\n");
+        return 0;
+    }
+    
+    shm_object_t *obj = &shm_objects[id - 1];
+    obj->frames_phys = pmm_alloc_page();
+    if (!obj->frames_phys) return 0;
+    
+    u64 *frames = (u64*)phys_to_virt(obj->frames_phys);
+    for (u64 i = 0; i < pages; i++) {
+        u64 frame = pmm_alloc_page();
+        if (!frame) {
+            serial_puts("[SHM] ERROR: Out of memory for shared frames\r\n");
+            for (u64 j = 0; j < i; j++) {
+                pmm_free_page(frames[j]);
+            }
+            pmm_free_page(obj->frames_phys);
+            return 0;
+        }
+    
+        u64 *p = (u64*)phys_to_virt(frame);
+        for (int w = 0; w < 512; w++) {
+            p[w] = 0;
+        }
+        frames[i] = frame;
+    }
+    
+    obj->used = true;
+    obj->destroyed = false;
+    obj->pages = pages;
+    obj->map_count = 0;
+    
+    serial_puts("[SHM] Shared memory object created\r\n");
+    return id;
+}
+
+// Map object id into an address space at va (0 = default slot) with prot
+// (VMA_READ/VMA_WRITE/VMA_EXEC). Returns the mapped VA, 0 on failure.
+u64 shm_map(u64 pml4_phys, u32 id, u64 va, u32 prot) {
+    shm_object_t *obj = shm_get(id);
+    if (!obj || obj->destroyed) return 0;
+    
+    if (va == 0) va = SHM_MAP_BASE + (u64)(id - 1) * (SHM_MAX_PAGES * PAGE_SIZE);
+    if (va & (PAGE_SIZE - 1)) return 0;
+    
+    shm_mapping_t *m = NULL;
+    for (int i = 0; i < SHM_MAX_MAPPINGS; i++) {
+        if (!shm_mappings[i].pml4_phys) {
+            m = &shm_mappings[i];
+            break;
+        }
+    }
+    if (!m) {
+        serial_puts("[SHM] ERROR: Too many shared memory mappings\r\n");
+        return 0;
+    }
+    
+    u64 size = obj->pages * PAGE_SIZE;
+    if (!vma_add(pml4_phys, va, va + size, (prot & (VMA_READ | VMA_WRITE | VMA_EXEC)) | VMA_SHARED)) {
+        return 0;
+    }
+    
+    u64 flags = PTE_PRESENT | PTE_USER | PTE_SHARED;
+    if (prot & VMA_WRITE) flags |= PTE_WRITABLE;
+    if (!(prot & VMA_EXEC)) flags |= PTE_NOEXECUTE;
+    
+    u64 *frames = shm_frames(obj);
+    for (u64 i = 0; i < obj->pages; i++) {
+        u64 *pte = user_as_get_pte(pml4_phys, va + i * PAGE_SIZE, true);
+        if (!pte || (*pte & PTE_PRESENT) || !pmm_frame_get(frames[i])) {
+            serial_puts("[SHM] ERROR: Failed to map shared page\r\n");
+            // Undo the pages mapped so far
+            for (u64 j = 0; j < i; j++) {
+                *user_as_get_pte(pml4_phys, va + j * PAGE_SIZE, false) = 0;
+                rmap_remove(frames[j], pml4_phys, va + j * PAGE_SIZE);
+                pmm_frame_put(frames[j]);
+            }
+            user_as_flush_tlb(pml4_phys);
+            vma_remove(pml4_phys, va, va + size);
+            return 0;
+        }
+        *pte = frames[i] | flags;
+        rmap_add(frames[i], pml4_phys, va + i * PAGE_SIZE);
+    }
+    
+    m->pml4_phys = pml4_phys;
+    m->va = va;
+    m->id = id;
+    m->prot = prot;
+    obj->map_count++;
+    
+    serial_puts("[SHM] Shared memory object mapped\r\n");
+    return va;
+}
+
+// Unmap the shared mapping starting at va
+bool shm_unmap(u64 pml4_phys, u64 va) {
+    shm_mapping_t *m = NULL;
+    for (int i = 0; i < SHM_MAX_MAPPINGS; i++) {
+        if (shm_mappings[i].pml4_phys == pml4_phys && shm_mappings[i].va == va) {
+            m = &shm_mappings[i];
+            break;
+        }
+    }
+    if (!m) return false;
+    
+    shm_object_t *obj = shm_get(m->id);
+    if (!obj) return false;
+    
+    // Clear all PTEs first, flush once, then drop the frame references
+    for (u64 i = 0; i < obj->pages; i++) {
+        u64 *pte = user_as_get_pte(pml4_phys, va + i * PAGE_SIZE, false);
+        if (pte) *pte = 0;
+    }
+    user_as_flush_tlb(pml4_phys);
+    
+    u64 *frames = shm_frames(obj);
+    for (u64 i = 0; i < obj->pages; i++) {
+        rmap_remove(frames[i], pml4_phys, va + i * PAGE_SIZE);
+        pmm_frame_put(frames[i]);
+    }
+    
+    vma_remove(pml4_phys, va, va + obj->pages * PAGE_SIZE);
+    m->pml4_phys = 0;
+    obj->map_count--;
+    
+    if (obj->destroyed && obj->map_count == 0) {
+        shm_release(obj);
+    }
+    
+    serial_puts("[SHM] Shared memory object unmapped\r\n");
+    return true;
+}
+
+// Destroy an object. Existing mappings keep working; the frames are freed
+// when the last of them is unmapped.
+bool shm_destroy(u32 id) {
+    shm_object_t *obj = shm_get(id);
+    if (!obj || obj->destroyed) return false;
+    
+    obj->destroyed = true;
+    if (obj->map_count == 0) {
+        shm_release(obj);
+    }
+    return true;
+}
+
+// Drop every shared mapping of an address space (teardown)
+void shm_unmap_all(u64 pml4_phys) {
+    for (int i = 0; i < SHM_MAX_MAPPINGS; i++) {
+        if (shm_mappings[i].pml4_phys == pml4_phys) {
+            shm_unmap(pml4_phys, shm_mappings[i].va);
+        }
+    }
+}
\ No newline at end of file
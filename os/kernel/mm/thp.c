@@ -0,0 +1,226 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Transparent huge pages for user address spaces
+//
+// Two paths produce 2MB user mappings:
+//  - Fault time: a demand-zero fault in an anonymous VMA whose aligned 2MB
+//    block is fully inside the VMA and has no page table yet gets a zeroed
+//    2MB frame mapped by a single PDE.
+//  - Collapse: thp_tick() (driven by the scheduler tick) walks live address
+//    spaces a few regions at a time looking for 2MB-aligned blocks whose page
+//    table has all 512 entries present with identical permissions. Such a
+//    block is copied into one huge frame, the PT is replaced by a PS=1 PDE,
+//    and the old frames and the PT are freed.
+//
+// Policy (thp= on the kernel command line): "always" (default) allows 2MB
+// pages in every VMA not marked VMA_NOHUGEPAGE, "madvise" only in VMAs
+// marked VMA_HUGEPAGE, "never" disables both paths.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_ACCESSED    (1ULL << 5)
+#define PTE_DIRTY       (1ULL << 6)
+#define PTE_HUGEPAGE    (1ULL << 7)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+// Bits that must match across all 512 PTEs of a collapse candidate
+#define THP_MATCH_MASK  (PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_NOEXECUTE)
+
+#define THP_SCAN_INTERVAL   50      // Ticks between collapse scan steps
+#define THP_SCAN_REGIONS    8       // 2MB regions examined per step
+#define THP_MAX_AS          64
+
+#define THP_USER_END        0x0000800000000000ULL
+
+typedef enum {
+    THP_ALWAYS = 0,
+    THP_MADVISE,
+    THP_NEVER
+} thp_mode_t;
+
+static thp_mode_t thp_mode = THP_ALWAYS;
+
+// Collapse scanner state
+static u32 thp_rr;
+static u64 thp_cursor;
+static u64 thp_ticks;
+
+void thp_init(void) {
+    if (cmdline_has_option("thp=never")) {
+        thp_mode = THP_NEVER;
+        serial_puts("[THP] Transparent huge pages disabled\r\n");
+    } else if (cmdline_has_option("thp=madvise")) {
+        thp_mode = THP_MADVISE;
+        serial_puts("[THP] Transparent huge pages on request (VMA_HUGEPAGE)\r\n");
+    } else {
+        thp_mode = THP_ALWAYS;
+        serial_puts("[THP] Transparent huge pages enabled for all user VMAs\r\n");
+    }
+}
+
+bool thp_enabled_for(u32 vma_flags) {
+    switch (thp_mode) {
+        case THP_ALWAYS:
+            return !(vma_flags & VMA_NOHUGEPAGE);
+        case THP_MADVISE:
+            return (vma_flags & VMA_HUGEPAGE) && !(vma_flags & VMA_NOHUGEPAGE);
+        default:
+            return false;
+    }
+}
+
+static void zero_frame(u64 pa, u64 size) {
+    u64 *p = (u64*)phys_to_virt(pa);
+    for (u64 i = 0; i < size / 8; i++) {
+        p[i] = 0;
+    }
+}
+
+static u64 huge_leaf_flags(u32 vma_flags) {
+    u64 flags = PTE_PRESENT | PTE_USER | PTE_HUGEPAGE;
+    if (vma_flags & VMA_WRITE) flags |= PTE_WRITABLE;
+    if (!(vma_flags & VMA_EXEC)) flags |= PTE_NOEXECUTE;
+    return flags;
+}
+
+// Demand-zero fault with a 2MB page. Returns false if the block cannot be
+// huge (page table already there, no aligned frame), so the caller falls
+// back to a 4K page.
+bool thp_fault_huge(u64 pml4_phys, u64 va, const vma_t *vma) {
+    if (!vma_huge_allowed(pml4_phys, va)) return false;
+    
+    u64 *pde = user_as_get_pde(pml4_phys, va, true);
+    if (!pde || (*pde & PTE_PRESENT)) return false;
+    
+    u64 frame = pmm_alloc_pages_aligned(LARGE_PAGE_SIZE / PAGE_SIZE, LARGE_PAGE_SIZE / PAGE_SIZE);
+    if (!frame) return false;
+    
+    zero_frame(frame, LARGE_PAGE_SIZE);
+    *pde = frame | huge_leaf_flags(vma->flags);
+    rmap_add(frame, pml4_phys, ALIGN_DOWN(va, LARGE_PAGE_SIZE));
+    return true;
+}
+
+// Check that the PT behind pde maps all 512 pages with the same permissions
+static bool collapse_candidate(u64 *pt) {
+    u64 first = pt[0] & THP_MATCH_MASK;
+    if (!(first & PTE_PRESENT) || !(first & PTE_USER)) return false;
+    
+    for (int i = 0; i < 512; i++) {
+        if ((pt[i] & THP_MATCH_MASK) != first) return false;
+        if (pt[i] & (PTE_SHARED | PTE_COW)) return false;   // Other owners map this frame
+    }
+    return true;
+}
+
+// Replace the 512 4K mappings of the 2MB block containing va by one 2MB page
+bool thp_collapse(u64 pml4_phys, u64 va) {
+    u64 base = ALIGN_DOWN(va, LARGE_PAGE_SIZE);
+    if (!vma_huge_allowed(pml4_phys, base)) return false;
+    
+    u64 *pde = user_as_get_pde(pml4_phys, base, false);
+    if (!pde || !(*pde & PTE_PRESENT) || (*pde & PTE_HUGEPAGE)) return false;
+    
+    u64 pt_phys = *pde & PTE_ADDR_MASK;
+    u64 *pt = (u64*)phys_to_virt(pt_phys);
+    if (!collapse_candidate(pt)) return false;
+    
+    u64 frame = pmm_alloc_pages_aligned(LARGE_PAGE_SIZE / PAGE_SIZE, LARGE_PAGE_SIZE / PAGE_SIZE);
+    if (!frame) return false;
+    
+    // Copy the 512 small pages into place and gather A/D
+    u64 ad = 0;
+    u64 *dst = (u64*)phys_to_virt(frame);
+    for (int i = 0; i < 512; i++) {
+        u64 *src = (u64*)phys_to_virt(pt[i] & PTE_ADDR_MASK);
+        for (int w = 0; w < 512; w++) {
+            dst[i * 512 + w] = src[w];
+        }
+        ad |= pt[i] & (PTE_ACCESSED | PTE_DIRTY);
+    }
+    
+    // Install the huge leaf and drop every cached 4K translation of the block
+    *pde = frame | (pt[0] & THP_MATCH_MASK) | PTE_HUGEPAGE | ad;
+    user_as_flush_tlb(pml4_phys);
+    
+    for (int i = 0; i < 512; i++) {
+        rmap_remove(pt[i] & PTE_ADDR_MASK, pml4_phys, base + (u64)i * PAGE_SIZE);
+        pmm_free_page(pt[i] & PTE_ADDR_MASK);
+    }
+    pmm_free_page(pt_phys);
+    rmap_add(frame, pml4_phys, base);
+    return true;
+}
+
+// Break the 2MB leaf covering va back into 512 4K mappings of the same
+// frames, so part of it can be unmapped or freed on its own
+bool thp_split(u64 pml4_phys, u64 va) {
+    u64 base = ALIGN_DOWN(va, LARGE_PAGE_SIZE);
+    u64 *pde = user_as_get_pde(pml4_phys, base, false);
+    if (!pde || !(*pde & PTE_PRESENT) || !(*pde & PTE_HUGEPAGE)) return false;
+    
+    u64 pt_phys = pmm_alloc_page();
+    if (!pt_phys) return false;
+    
+    u64 frame = *pde & PTE_ADDR_MASK;
+    u64 flags = *pde & (THP_MATCH_MASK | PTE_ACCESSED | PTE_DIRTY);
+    u64 *pt = (u64*)phys_to_virt(pt_phys);
+    for (int i = 0; i < 512; i++) {
+        pt[i] = (frame + (u64)i * PAGE_SIZE) | flags;
+    }
+    
+    *pde = pt_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+    user_as_flush_tlb(pml4_phys);
+    
+    rmap_remove(frame, pml4_phys, base);
+    for (int i = 0; i < 512; i++) {
+        rmap_add(frame + (u64)i * PAGE_SIZE, pml4_phys, base + (u64)i * PAGE_SIZE);
+    }
+    return true;
+}
+
+// Walk callback: stop at the first 4K leaf and report its 2MB block
+static bool find_region_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    (void)pte;
+    if (size == LARGE_PAGE_SIZE) return true;   // Already huge
+    
+    *(u64*)ctx = ALIGN_DOWN(va, LARGE_PAGE_SIZE);
+    return false;
+}
+
+// Background collapse step (scheduler tick)
+void thp_tick(void) {
+    if (thp_mode == THP_NEVER) return;
+    if (++thp_ticks % THP_SCAN_INTERVAL) return;
+    
+    u64 live[THP_MAX_AS];
+    u32 count = user_as_list(live, THP_MAX_AS);
+    if (count == 0) return;
+    if (thp_rr >= count) {
+        thp_rr = 0;
+        thp_cursor = 0;
+    }
+    
+    u64 pml4_phys = live[thp_rr];
+    for (u32 n = 0; n < THP_SCAN_REGIONS; n++) {
+        u64 region = THP_USER_END;
+        user_as_walk(pml4_phys, thp_cursor, THP_USER_END, find_region_fn, &region);
+    
+        if (region >= THP_USER_END) {
+            // Finished this address space, move on next time
+            thp_rr++;
+            thp_cursor = 0;
+            return;
+        }
+    
+        if (thp_collapse(pml4_phys, region)) {
+            serial_puts("[THP] Collapsed 2MB region into a huge page\r\n");
+        }
+        thp_cursor = region + LARGE_PAGE_SIZE;
+    }
+}
\ No newline at end of file
@@ -10,9 +10,15 @@
 #define PTE_NOEXECUTE   (1ULL << 63)
 #define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
 
+// End of the canonical lower half (PML4 slots 0-255)
+#define USER_AS_END     0x0000800000000000ULL
+
 // Global kernel PML4 template for sharing kernel high-half
 static u64 kernel_pml4_template_phys = 0;
 
+// Boot PML4 (kernel only), used once the current user address space is gone
+static u64 kernel_pml4_phys = 0;
+
 // Helper functions
 static inline u64 read_cr3(void) {
     u64 val;
@@ -36,12 +42,100 @@ static u64 alloc_zeroed_page_phys(void) {
     return pa;
 }
 
+// Pool of ready-made user PML4 pages. Each pooled page already has its
+// user half (0-255) zeroed, so handing one out only needs the kernel half
+// copied in from the template.
+#define USER_AS_POOL_SIZE 16
+
+static u64 user_as_pool[USER_AS_POOL_SIZE];
+static u32 user_as_pool_count = 0;
+
+// Pre-allocate a PDPT for every kernel PML4 slot (256-511) in the live PML4.
+// Kernel mappings created later land in these PDPTs, so the top level of the
+// kernel half never changes and cloned user PML4s can never go stale.
+static void prepopulate_kernel_pdpts(u64 *pml4) {
+    u32 created = 0;
+    
+    for (int i = 256; i < 512; i++) {
+        if (pml4[i] & PTE_PRESENT) continue;
+        
+        u64 pdpt_phys = alloc_zeroed_page_phys();
+        if (!pdpt_phys) {
+            serial_puts("[USER_AS] ERROR: Out of memory pre-allocating kernel PDPTs\r\n");
+            return;
+        }
+        
+        // Kernel-only upper level: P|W, no U
+        pml4[i] = pdpt_phys | PTE_PRESENT | PTE_WRITABLE;
+        created++;
+    }
+    
+    if (created) {
+        // New top-level entries only - reload CR3 to drop paging-structure caches
+        write_cr3(read_cr3());
+    }
+    
+    serial_puts("[USER_AS] All 256 kernel PDPTs present - kernel half is now fixed\r\n");
+}
+
+// Refill the PML4 pool up to capacity. Only the user half needs zeroing;
+// the kernel half is overwritten from the template on every hand-out.
+void user_as_pool_refill(void) {
+    while (user_as_pool_count < USER_AS_POOL_SIZE) {
+        u64 pa = pmm_alloc_page();
+        if (!pa) break;
+        
+        u64 *pml4 = (u64*)phys_to_virt(pa);
+        for (int i = 0; i < 256; i++) {
+            pml4[i] = 0;
+        }
+        
+        user_as_pool[user_as_pool_count++] = pa;
+    }
+}
+
+// Hand back a PML4 whose user half is zero: to the pool while it has room
+static void user_as_pool_put(u64 pml4_phys) {
+    if (user_as_pool_count < USER_AS_POOL_SIZE) {
+        user_as_pool[user_as_pool_count++] = pml4_phys;
+    } else {
+        pmm_free_page(pml4_phys);
+    }
+}
+
+// Live user address spaces, for subsystems that scan all of them
+#define USER_AS_MAX 64
+
+static u64 user_as_live[USER_AS_MAX];
+
+static bool user_as_register(u64 pml4_phys) {
+    for (int i = 0; i < USER_AS_MAX; i++) {
+        if (!user_as_live[i]) {
+            user_as_live[i] = pml4_phys;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copy up to max live PML4s into out, returns how many were copied
+u32 user_as_list(u64 *out, u32 max) {
+    u32 n = 0;
+    for (int i = 0; i < USER_AS_MAX && n < max; i++) {
+        if (user_as_live[i]) out[n++] = user_as_live[i];
+    }
+    return n;
+}
+
 // Initialize kernel PML4 template - call once after kernel mappings are established
 void init_kernel_pml4_template(void) {
     serial_puts("[USER_AS] Creating kernel PML4 template for high-half sharing\r\n");
     
     u64 cr3 = read_cr3();
     u64 *current_pml4 = (u64*)phys_to_virt(cr3 & PTE_ADDR_MASK);
+    kernel_pml4_phys = cr3 & PTE_ADDR_MASK;
+    
+    prepopulate_kernel_pdpts(current_pml4);
     
     kernel_pml4_template_phys = alloc_zeroed_page_phys();
     if (!kernel_pml4_template_phys) {
@@ -56,6 +150,8 @@ void init_kernel_pml4_template(void) {
         template[i] = current_pml4[i];  // Share kernel mappings (U=0, GLOBAL OK)
     }
     
+    user_as_pool_refill();
+    
     serial_puts("[USER_AS] Kernel PML4 template initialized with high-half mappings\r\n");
 }
 
@@ -68,26 +164,202 @@ u64 user_as_create(void) {
     
     serial_puts("[USER_AS] Creating new user address space\r\n");
     
-    u64 user_pml4_phys = alloc_zeroed_page_phys();
-    if (!user_pml4_phys) {
-        serial_puts("[USER_AS] ERROR: Failed to allocate user PML4\r\n");
-        return 0;
+    u64 user_pml4_phys;
+    if (user_as_pool_count > 0) {
+        // Fast path: user half already zeroed
+        user_pml4_phys = user_as_pool[--user_as_pool_count];
+    } else {
+        user_pml4_phys = alloc_zeroed_page_phys();
+        if (!user_pml4_phys) {
+            serial_puts("[USER_AS] ERROR: Failed to allocate user PML4\r\n");
+            return 0;
+        }
     }
     
     u64 *user_pml4 = (u64*)phys_to_virt(user_pml4_phys);
     u64 *template = (u64*)phys_to_virt(kernel_pml4_template_phys);
     
-    // Copy kernel high-half mappings (entries 256-511)
+    // Copy kernel high-half mappings (entries 256-511) - a single 2KB copy,
+    // the PDPTs behind them are shared and never replaced
     for (int i = 256; i < 512; i++) {
         user_pml4[i] = template[i];
     }
     
     // Low-half (0-255) remains zero - user space
     
+    // Shadow PML4 for ring 3 when page table isolation is on
+    if (!pti_as_create(user_pml4_phys)) {
+        serial_puts("[USER_AS] ERROR: Failed to create PTI shadow PML4\r\n");
+        user_as_pool_put(user_pml4_phys);
+        return 0;
+    }
+    
+    if (!user_as_register(user_pml4_phys)) {
+        serial_puts("[USER_AS] ERROR: Too many live address spaces\r\n");
+        pti_as_destroy(user_pml4_phys);
+        user_as_pool_put(user_pml4_phys);
+        return 0;
+    }
+    
     serial_puts("[USER_AS] User PML4 created with kernel high-half cloned\r\n");
     return user_pml4_phys;
 }
 
+// Teardown
+//
+// Destroying an address space first detaches it: it leaves the live list
+// (background scanners stop visiting it), CR3 moves off it if it was
+// current, and shared mappings, VMAs and the PTI shadow are dropped. The
+// page tables and frames are then released in a single pass over the user
+// half, either right away or later by the reaper (user_as_reap) so the
+// exiting thread does not pay for it.
+//
+// A detached address space is not loaded anywhere, so the CR3 reload at
+// detach time is the only TLB flush teardown needs; frames and table pages
+// go back to the PMM in batches with no per-page invalidation. That holds
+// only because user address spaces live on the boot CPU alone: user code
+// never runs on the APs and they never load a user CR3, so no other TLB
+// can hold their translations. Anything that lets an AP load one must add
+// a shootdown here first, or page tables still cached on that CPU get
+// freed.
+
+#define USER_AS_REAP_MAX    16
+#define USER_AS_FREE_BATCH  64      // Pages handed back to the PMM at once
+
+static u64 user_as_reap_queue[USER_AS_REAP_MAX];
+static u32 user_as_reap_count = 0;
+
+typedef struct {
+    u64 frames[USER_AS_FREE_BATCH];     // User frames, one reference each
+    u32 frame_count;
+    u64 tables[USER_AS_FREE_BATCH];     // Page-table pages
+    u32 table_count;
+} user_as_teardown_t;
+
+static void teardown_flush(user_as_teardown_t *td) {
+    pmm_frame_put_batch(td->frames, td->frame_count);
+    td->frame_count = 0;
+    
+    for (u32 i = 0; i < td->table_count; i++) {
+        pmm_free_page(td->tables[i]);
+    }
+    td->table_count = 0;
+}
+
+static void teardown_frame(user_as_teardown_t *td, u64 frame) {
+    td->frames[td->frame_count++] = frame;
+    if (td->frame_count == USER_AS_FREE_BATCH) teardown_flush(td);
+}
+
+static void teardown_table(user_as_teardown_t *td, u64 table) {
+    td->tables[td->table_count++] = table;
+    if (td->table_count == USER_AS_FREE_BATCH) teardown_flush(td);
+}
+
+// Free every leaf and table below the user half of a detached PML4
+static void user_as_free_tables(u64 pml4_phys) {
+    user_as_teardown_t td;
+    td.frame_count = 0;
+    td.table_count = 0;
+    
+    u64 *pml4 = (u64*)phys_to_virt(pml4_phys);
+    for (u64 i4 = 0; i4 < 256; i4++) {
+        if (!(pml4[i4] & PTE_PRESENT)) continue;
+        
+        u64 pdpt_phys = pml4[i4] & PTE_ADDR_MASK;
+        u64 *pdpt = (u64*)phys_to_virt(pdpt_phys);
+        for (u64 i3 = 0; i3 < 512; i3++) {
+            if (!(pdpt[i3] & PTE_PRESENT) || (pdpt[i3] & PTE_HUGEPAGE)) continue;
+            
+            u64 pd_phys = pdpt[i3] & PTE_ADDR_MASK;
+            u64 *pd = (u64*)phys_to_virt(pd_phys);
+            for (u64 i2 = 0; i2 < 512; i2++) {
+                if (!(pd[i2] & PTE_PRESENT)) continue;
+                u64 va = (i4 << 39) | (i3 << 30) | (i2 << 21);
+                
+                if (pd[i2] & PTE_HUGEPAGE) {
+                    u64 frame = pd[i2] & PTE_ADDR_MASK;
+                    rmap_remove(frame, pml4_phys, va);
+                    pmm_free_pages(frame, LARGE_PAGE_SIZE / PAGE_SIZE);
+                    continue;
+                }
+                
+                u64 pt_phys = pd[i2] & PTE_ADDR_MASK;
+                u64 *pt = (u64*)phys_to_virt(pt_phys);
+                for (u64 i1 = 0; i1 < 512; i1++) {
+                    u64 entry = pt[i1];
+                    if (!entry) continue;
+                    
+                    if (entry & PTE_PRESENT) {
+                        u64 frame = entry & PTE_ADDR_MASK;
+                        rmap_remove(frame, pml4_phys, va | (i1 << 12));
+                        teardown_frame(&td, frame);
+                    } else {
+                        zswap_invalidate(entry);   // Swap entry (remote ones hold nothing)
+                    }
+                }
+                teardown_table(&td, pt_phys);
+            }
+            teardown_table(&td, pd_phys);
+        }
+        teardown_table(&td, pdpt_phys);
+        pml4[i4] = 0;
+    }
+    
+    teardown_flush(&td);
+}
+
+// Free the page tables and frames of a detached address space
+static void user_as_release(u64 pml4_phys) {
+    user_as_free_tables(pml4_phys);
+    rmap_as_destroy(pml4_phys);
+    
+    // The user half is zero again, so the PML4 can go straight back to the pool
+    user_as_pool_put(pml4_phys);
+}
+
+// Destroy a user address space. With deferred, only the detach happens
+// now and the memory is released by a later user_as_reap().
+bool user_as_destroy(u64 pml4_phys, bool deferred) {
+    bool found = false;
+    for (int i = 0; i < USER_AS_MAX; i++) {
+        if (user_as_live[i] == pml4_phys) {
+            user_as_live[i] = 0;
+            found = true;
+        }
+    }
+    if (!found) return false;
+    
+    if ((read_cr3() & PTE_ADDR_MASK) == pml4_phys) {
+        pti_switch_kernel(kernel_pml4_phys);
+    }
+    
+    shm_unmap_all(pml4_phys);
+    ksm_forget_as(pml4_phys);
+    pmm_color_partition(pml4_phys, 0, 0);
+    dirty_log_stop(pml4_phys);
+    postcopy_forget_as(pml4_phys);
+    vma_destroy_all(pml4_phys);
+    pti_as_destroy(pml4_phys);
+    
+    if (deferred && user_as_reap_count < USER_AS_REAP_MAX) {
+        user_as_reap_queue[user_as_reap_count++] = pml4_phys;
+        return true;
+    }
+    
+    user_as_release(pml4_phys);
+    return true;
+}
+
+// Deferred teardown worker: release one queued address space.
+// Returns false when there was nothing to do.
+bool user_as_reap(void) {
+    if (!user_as_reap_count) return false;
+    
+    user_as_release(user_as_reap_queue[--user_as_reap_count]);
+    return true;
+}
+
 // Get or create page table in specific PML4 with proper U=1 flags
 static u64* get_or_make_table_in_pml4(u64 table_phys, u64 index, u64 upper_flags) {
     u64 *table = (u64*)phys_to_virt(table_phys);
@@ -120,6 +392,7 @@ bool user_map_4k_in_pml4(u64 pml4_phys, u64 va, u64 pa, bool writable, bool exec
     // Walk/create page table hierarchy with U=1 at each level for user traversal
     u64 *pdpt = get_or_make_table_in_pml4(pml4_phys, i4, PTE_USER);
     if (!pdpt) return false;
+    pti_sync_user_entry(pml4_phys, i4);
     
     u64 pdpt_phys = ((u64*)phys_to_virt(pml4_phys))[i4] & PTE_ADDR_MASK;
     u64 *pd = get_or_make_table_in_pml4(pdpt_phys, i3, PTE_USER);
@@ -135,6 +408,7 @@ bool user_map_4k_in_pml4(u64 pml4_phys, u64 va, u64 pa, bool writable, bool exec
     if (!executable) flags |= PTE_NOEXECUTE;
     
     pt[i1] = (pa & PTE_ADDR_MASK) | flags;
+    rmap_add(pa & PTE_ADDR_MASK, pml4_phys, va);
     
     // Ensure page table writes are committed to memory
     __asm__ volatile("mfence" : : : "memory");
@@ -159,6 +433,235 @@ bool user_map_4k_in_pml4(u64 pml4_phys, u64 va, u64 pa, bool writable, bool exec
     return true;
 }
 
+// Quiet table step for the hot paths (fault handling, bulk population)
+static u64 *user_table_next(u64 *table, u64 index, bool create) {
+    if (!(table[index] & PTE_PRESENT)) {
+        if (!create) return NULL;
+        u64 new_phys = alloc_zeroed_page_phys();
+        if (!new_phys) return NULL;
+        table[index] = new_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+    }
+    if (table[index] & PTE_HUGEPAGE) return NULL;
+    return (u64*)phys_to_virt(table[index] & PTE_ADDR_MASK);
+}
+
+// Find the PD entry covering va (a 2M leaf or the pointer to its PT),
+// optionally creating the PDPT/PD above it
+u64 *user_as_get_pde(u64 pml4_phys, u64 va, bool create) {
+    if (va >= USER_AS_END) return NULL;
+    
+    u64 *pml4 = (u64*)phys_to_virt(pml4_phys);
+    u64 i4 = (va >> 39) & 0x1FF;
+    bool had_pdpt = (pml4[i4] & PTE_PRESENT) != 0;
+    
+    u64 *pdpt = user_table_next(pml4, i4, create);
+    if (!pdpt) return NULL;
+    if (!had_pdpt) pti_sync_user_entry(pml4_phys, i4);
+    
+    u64 *pd = user_table_next(pdpt, (va >> 30) & 0x1FF, create);
+    if (!pd) return NULL;
+    
+    return &pd[(va >> 21) & 0x1FF];
+}
+
+// Find the 4K PTE slot for va, optionally creating the tables above it.
+// Returns NULL if a level is missing (and !create) or va is under a 2M leaf.
+u64 *user_as_get_pte(u64 pml4_phys, u64 va, bool create) {
+    u64 *pde = user_as_get_pde(pml4_phys, va, create);
+    if (!pde) return NULL;
+    
+    // user_table_next expects the containing table and an index
+    u64 *pt = user_table_next(pde, 0, create);
+    if (!pt) return NULL;
+    
+    return &pt[(va >> 12) & 0x1FF];
+}
+
+// Translate a user VA through an isolated PML4 (4K or 2M leaf), 0 if unmapped
+u64 user_as_translate(u64 pml4_phys, u64 va) {
+    if (va >= USER_AS_END) return 0;
+    
+    u64 *pml4 = (u64*)phys_to_virt(pml4_phys);
+    u64 *pdpt = user_table_next(pml4, (va >> 39) & 0x1FF, false);
+    if (!pdpt) return 0;
+    u64 *pd = user_table_next(pdpt, (va >> 30) & 0x1FF, false);
+    if (!pd) return 0;
+    
+    u64 pde = pd[(va >> 21) & 0x1FF];
+    if (!(pde & PTE_PRESENT)) return 0;
+    if (pde & PTE_HUGEPAGE) {
+        return (pde & PTE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1)) | (va & (LARGE_PAGE_SIZE - 1));
+    }
+    
+    u64 pte = ((u64*)phys_to_virt(pde & PTE_ADDR_MASK))[(va >> 12) & 0x1FF];
+    if (!(pte & PTE_PRESENT)) return 0;
+    return (pte & PTE_ADDR_MASK) | (va & (PAGE_SIZE - 1));
+}
+
+// Visit every present user leaf (4K PTE or 2M PDE) in [start, end) of an
+// isolated PML4. Upper levels are read once per table, so a whole address
+// space costs one pass over its page tables. The callback returns false to
+// stop early; the return value is where the walk stopped (resume point).
+// With nonpresent, non-zero 4K entries that are not present (swap, remote)
+// are visited too.
+static u64 walk_range(u64 pml4_phys, u64 start, u64 end, user_pte_fn fn, void *ctx, bool nonpresent) {
+    u64 *pml4 = (u64*)phys_to_virt(pml4_phys);
+    if (end > USER_AS_END) end = USER_AS_END;
+    
+    u64 va = start & ~(PAGE_SIZE - 1);
+    while (va < end) {
+        u64 i4 = (va >> 39) & 0x1FF;
+        if (!(pml4[i4] & PTE_PRESENT)) {
+            va = (va + (1ULL << 39)) & ~((1ULL << 39) - 1);
+            continue;
+        }
+        
+        u64 *pdpt = (u64*)phys_to_virt(pml4[i4] & PTE_ADDR_MASK);
+        u64 i3 = (va >> 30) & 0x1FF;
+        if (!(pdpt[i3] & PTE_PRESENT) || (pdpt[i3] & PTE_HUGEPAGE)) {
+            va = (va + (1ULL << 30)) & ~((1ULL << 30) - 1);
+            continue;
+        }
+        
+        u64 *pd = (u64*)phys_to_virt(pdpt[i3] & PTE_ADDR_MASK);
+        u64 i2 = (va >> 21) & 0x1FF;
+        if (!(pd[i2] & PTE_PRESENT)) {
+            va = (va + LARGE_PAGE_SIZE) & ~(LARGE_PAGE_SIZE - 1);
+            continue;
+        }
+        if (pd[i2] & PTE_HUGEPAGE) {
+            u64 huge_va = va & ~(LARGE_PAGE_SIZE - 1);
+            va = huge_va + LARGE_PAGE_SIZE;
+            if (!fn(&pd[i2], huge_va, LARGE_PAGE_SIZE, ctx)) return va;
+            continue;
+        }
+        
+        u64 *pt = (u64*)phys_to_virt(pd[i2] & PTE_ADDR_MASK);
+        for (u64 i1 = (va >> 12) & 0x1FF; i1 < 512 && va < end; i1++) {
+            u64 leaf_va = va;
+            va += PAGE_SIZE;
+            bool visit = nonpresent ? pt[i1] != 0 : (pt[i1] & PTE_PRESENT) != 0;
+            if (visit && !fn(&pt[i1], leaf_va, PAGE_SIZE, ctx)) {
+                return va;
+            }
+        }
+    }
+    
+    return end;
+}
+
+u64 user_as_walk(u64 pml4_phys, u64 start, u64 end, user_pte_fn fn, void *ctx) {
+    return walk_range(pml4_phys, start, end, fn, ctx, false);
+}
+
+// Like user_as_walk, but also visits swap and remote entries
+u64 user_as_walk_all(u64 pml4_phys, u64 start, u64 end, user_pte_fn fn, void *ctx) {
+    return walk_range(pml4_phys, start, end, fn, ctx, true);
+}
+
+// Bulk population
+//
+// Installs zeroed private pages for a list of (va, len, prot) segments in
+// one pass. Frames come from the PMM POPULATE_BATCH at a time, and the
+// page-table walk is only redone when a segment crosses into the next page
+// table, so N pages cost about N/512 walks. 2MB-aligned stretches whose VMA
+// allows huge pages get a single 2MB frame instead. Entries that are
+// already in use (present, swapped, remote) are left alone.
+
+#define POPULATE_BATCH  64
+
+static u64 segment_pte_flags(u32 prot) {
+    u64 flags = PTE_PRESENT | PTE_USER;
+    if (prot & VMA_WRITE) flags |= PTE_WRITABLE;
+    if (!(prot & VMA_EXEC)) flags |= PTE_NOEXECUTE;
+    return flags;
+}
+
+bool user_as_populate(u64 pml4_phys, const user_segment_t *segs, u32 count) {
+    u64 frames[POPULATE_BATCH];
+    u32 avail = 0;
+    u32 used = 0;
+    bool ok = true;
+    
+    for (u32 s = 0; s < count && ok; s++) {
+        u64 va = ALIGN_DOWN(segs[s].va, PAGE_SIZE);
+        u64 end = PAGE_ALIGN(segs[s].va + segs[s].len);
+        if (end > USER_AS_END || end < va) {
+            ok = false;
+            break;
+        }
+        
+        u64 flags = segment_pte_flags(segs[s].prot);
+        u64 *pt = NULL;
+        while (va < end) {
+            bool table_start = (va & (LARGE_PAGE_SIZE - 1)) == 0;
+            
+            if (table_start && va + LARGE_PAGE_SIZE <= end) {
+                vma_t *vma = vma_find(pml4_phys, va);
+                if (vma && thp_fault_huge(pml4_phys, va, vma)) {
+                    va += LARGE_PAGE_SIZE;
+                    pt = NULL;
+                    continue;
+                }
+            }
+            
+            if (!pt || table_start) {
+                u64 *pte = user_as_get_pte(pml4_phys, va, true);
+                if (!pte) {
+                    // Under an existing 2MB leaf (or out of memory for tables)
+                    if (user_as_translate(pml4_phys, va)) {
+                        va = ALIGN_DOWN(va, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+                        pt = NULL;
+                        continue;
+                    }
+                    ok = false;
+                    break;
+                }
+                pt = pte - ((va >> 12) & 0x1FF);
+            }
+            
+            u64 *pte = &pt[(va >> 12) & 0x1FF];
+            if (*pte == 0) {
+                if (used == avail) {
+                    avail = pmm_alloc_batch_color(frames, POPULATE_BATCH, pmm_color_hint(pml4_phys, va));
+                    used = 0;
+                    if (!avail) {
+                        serial_puts("[USER_AS] ERROR: Out of memory populating segment\r\n");
+                        ok = false;
+                        break;
+                    }
+                }
+                
+                u64 frame = frames[used++];
+                u64 *page = (u64*)phys_to_virt(frame);
+                for (int i = 0; i < 512; i++) {
+                    page[i] = 0;
+                }
+                *pte = frame | flags;
+                rmap_add(frame, pml4_phys, va);
+            }
+            va += PAGE_SIZE;
+        }
+    }
+    
+    // Hand back what the last batch did not use
+    while (used < avail) {
+        pmm_free_page(frames[used++]);
+    }
+    return ok;
+}
+
+// Drop stale translations for an address space after its PTEs were edited
+// in bulk. Only the boot CPU ever loads a user CR3 (APs run kernel threads
+// on the kernel page tables), so only its live CR3 can have cached
+// entries; callers editing user PTEs must run there too. No shootdown is
+// sent, and none is needed until APs load user page tables.
+void user_as_flush_tlb(u64 pml4_phys) {
+    if ((read_cr3() & PTE_ADDR_MASK) == pml4_phys) {
+        pti_switch_mm(pml4_phys);
+    }
+}
+
 // Manual page walk to verify what the CPU sees
 static void debug_manual_page_walk(u64 pml4_phys, u64 va) {
     serial_puts("[USER_AS] MANUAL PAGE WALK for user code VA\r\n");
@@ -227,15 +730,24 @@ u64 create_user_process(void) {
     u64 user_pml4 = user_as_create();
     if (!user_pml4) return 0;
     
-    // Allocate physical frames for user pages
-    u64 code_pa = alloc_zeroed_page_phys();
-    u64 stack1_pa = alloc_zeroed_page_phys(); 
-    u64 stack0_pa = alloc_zeroed_page_phys();
+    // Describe the layout for the fault handler and memory policies
+    if (!vma_add(user_pml4, 0x0000000000010000ULL, 0x0000000000011000ULL, VMA_READ | VMA_EXEC) ||
+        !vma_add(user_pml4, 0x0000000000800000ULL, 0x0000000000802000ULL,
+                 VMA_READ | VMA_WRITE | VMA_ANON)) {
+        serial_puts("[USER_AS] ERROR: Failed to register VMAs\r\n");
+        return 0;
+    }
     
-    if (!code_pa || !stack1_pa || !stack0_pa) {
-        serial_puts("[USER_AS] ERROR: Failed to allocate user physical pages\r\n");
+    // Code page at 0x10000 (RX) and two stack pages (RW, NX) in one pass
+    const user_segment_t segments[] = {
+        { 0x0000000000010000ULL, PAGE_SIZE,     VMA_READ | VMA_EXEC },
+        { 0x0000000000800000ULL, 2 * PAGE_SIZE, VMA_READ | VMA_WRITE },
+    };
+    if (!user_as_populate(user_pml4, segments, sizeof(segments) / sizeof(segments[0]))) {
+        serial_puts("[USER_AS] ERROR: Failed to populate user pages\r\n");
         return 0;
     }
+    u64 code_pa = user_as_translate(user_pml4, 0x0000000000010000ULL);
     
     // Copy user payload to code page via HHDM (not user VA)
     extern u8 user_payload_start[];
@@ -265,22 +777,6 @@ u64 create_user_process(void) {
     __asm__ volatile("clflush (%0)" : : "r"(code_page) : "memory");
     __asm__ volatile("mfence" : : : "memory");
     
-    // Try a different virtual address to eliminate conflicts - use 0x10000 instead
-    if (!user_map_4k_in_pml4(user_pml4, 0x0000000000010000ULL, code_pa, false, true)) {
-        serial_puts("[USER_AS] ERROR: Failed to map code page\r\n");
-        return 0;
-    }
-    
-    if (!user_map_4k_in_pml4(user_pml4, 0x0000000000800000ULL, stack1_pa, true, false)) {
-        serial_puts("[USER_AS] ERROR: Failed to map stack page 1\r\n");
-        return 0;
-    }
-    
-    if (!user_map_4k_in_pml4(user_pml4, 0x0000000000801000ULL, stack0_pa, true, false)) {
-        serial_puts("[USER_AS] ERROR: Failed to map stack page 0\r\n");
-        return 0;
-    }
-    
     serial_puts("[USER_AS] Complete user address space created\r\n");
     return user_pml4;
 }
@@ -290,13 +786,11 @@ void switch_to_user_process(u64 user_pml4_phys) {
     serial_puts("[USER_AS] Switching CR3 to user address space\r\n");
     
     // Clean CR3 switch - this gives us fresh paging-structure state
-    write_cr3(user_pml4_phys);
+    // (also points the PTI entry stubs at this address space)
+    pti_switch_mm(user_pml4_phys);
     
-    // Additional synchronization - switch CR3 multiple times to ensure it takes
-    __asm__ volatile("mfence" : : : "memory");
-    __asm__ volatile("mov %0, %%cr3" : : "r"(user_pml4_phys) : "memory");  
-    __asm__ volatile("mfence" : : : "memory");
-    __asm__ volatile("mov %0, %%cr3" : : "r"(user_pml4_phys) : "memory");
+    // Additional synchronization (no raw CR3 reloads here - they would drop
+    // the PCID tag set up by pti_switch_mm)
     __asm__ volatile("mfence" : : : "memory");
     
     // Specific page invalidations
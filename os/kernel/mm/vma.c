@@ -0,0 +1,284 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Virtual memory areas
+//
+// Each user address space keeps a small sorted array of non-overlapping
+// [start, end) regions with their permissions and policy flags. The fault
+// handler uses it to decide whether a missing page may be demand-allocated
+// (and whether as a 2MB page); later subsystems hang per-region policy off
+// the same flags.
+
+#define VMA_MAX_AS      64
+
+typedef struct {
+    u64 pml4_phys;              // 0 = free slot
+    u32 count;
+    vma_t vmas[VMA_MAX_PER_AS]; // Sorted by start
+} vma_table_t;
+
+static vma_table_t vma_tables[VMA_MAX_AS];
+
+static vma_table_t *vma_table(u64 pml4_phys, bool create) {
+    if (!pml4_phys) return NULL;
+    
+    vma_table_t *free_slot = NULL;
+    for (int i = 0; i < VMA_MAX_AS; i++) {
+        if (vma_tables[i].pml4_phys == pml4_phys) return &vma_tables[i];
+        if (!vma_tables[i].pml4_phys && !free_slot) free_slot = &vma_tables[i];
+    }
+    if (!create || !free_slot) return NULL;
+    
+    free_slot->pml4_phys = pml4_phys;
+    free_slot->count = 0;
+    return free_slot;
+}
+
+// Register [start, end) with flags. Fails on overlap or a full table.
+bool vma_add(u64 pml4_phys, u64 start, u64 end, u32 flags) {
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+    end = PAGE_ALIGN(end);
+    if (start >= end) return false;
+    
+    vma_table_t *t = vma_table(pml4_phys, true);
+    if (!t) {
+        serial_puts("[VMA] ERROR: No free VMA table\r\n");
+        return false;
+    }
+    if (t->count == VMA_MAX_PER_AS) {
+        serial_puts("[VMA] ERROR: Too many VMAs in address space\r\n");
+        return false;
+    }
+    
+    u32 pos = 0;
+    while (pos < t->count && t->vmas[pos].start < start) pos++;
+    
+    if ((pos > 0 && t->vmas[pos - 1].end > start) ||
+        (pos < t->count && t->vmas[pos].start < end)) {
+        serial_puts("[VMA] ERROR: Overlapping VMA\r\n");
+        return false;
+    }
+    
+    for (u32 i = t->count; i > pos; i--) {
+        t->vmas[i] = t->vmas[i - 1];
+    }
+    t->vmas[pos].start = start;
+    t->vmas[pos].end = end;
+    t->vmas[pos].flags = flags;
+    t->count++;
+    return true;
+}
+
+// VMA containing va, or NULL
+vma_t *vma_find(u64 pml4_phys, u64 va) {
+    vma_table_t *t = vma_table(pml4_phys, false);
+    if (!t) return NULL;
+    
+    // Binary search over the sorted array
+    u32 lo = 0, hi = t->count;
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        vma_t *v = &t->vmas[mid];
+        if (va < v->start) {
+            hi = mid;
+        } else if (va >= v->end) {
+            lo = mid + 1;
+        } else {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// First VMA that ends above va, or NULL
+vma_t *vma_next(u64 pml4_phys, u64 va) {
+    vma_table_t *t = vma_table(pml4_phys, false);
+    if (!t) return NULL;
+    
+    for (u32 i = 0; i < t->count; i++) {
+        if (t->vmas[i].end > va) return &t->vmas[i];
+    }
+    return NULL;
+}
+
+// Remove the VMA that exactly covers [start, end)
+bool vma_remove(u64 pml4_phys, u64 start, u64 end) {
+    vma_table_t *t = vma_table(pml4_phys, false);
+    if (!t) return false;
+    
+    for (u32 i = 0; i < t->count; i++) {
+        if (t->vmas[i].start == start && t->vmas[i].end == end) {
+            for (u32 j = i; j + 1 < t->count; j++) {
+                t->vmas[j] = t->vmas[j + 1];
+            }
+            t->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Split vmas[i] in two at va (start < va < end)
+static bool vma_split(vma_table_t *t, u32 i, u64 va) {
+    if (t->count == VMA_MAX_PER_AS) return false;
+    
+    for (u32 j = t->count; j > i + 1; j--) {
+        t->vmas[j] = t->vmas[j - 1];
+    }
+    t->vmas[i + 1] = t->vmas[i];
+    t->vmas[i].end = va;
+    t->vmas[i + 1].start = va;
+    t->count++;
+    return true;
+}
+
+// Join neighbours that touch and have identical flags
+static void vma_merge(vma_table_t *t) {
+    u32 i = 0;
+    while (i + 1 < t->count) {
+        vma_t *a = &t->vmas[i];
+        vma_t *b = &t->vmas[i + 1];
+        if (a->end == b->start && a->flags == b->flags) {
+            a->end = b->end;
+            for (u32 j = i + 1; j + 1 < t->count; j++) {
+                t->vmas[j] = t->vmas[j + 1];
+            }
+            t->count--;
+        } else {
+            i++;
+        }
+    }
+}
+
+// Set and clear flags on [start, end), splitting VMAs at the boundaries.
+// Fails (without changes) if part of the range is not mapped.
+bool vma_update(u64 pml4_phys, u64 start, u64 end, u32 set, u32 clear) {
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+    end = PAGE_ALIGN(end);
+    if (start >= end) return false;
+    
+    vma_table_t *t = vma_table(pml4_phys, false);
+    if (!t) return false;
+    
+    // The whole range must be covered, with no holes
+    u64 va = start;
+    for (u32 i = 0; i < t->count && va < end; i++) {
+        if (t->vmas[i].end <= va) continue;
+        if (t->vmas[i].start > va) return false;
+        va = t->vmas[i].end;
+    }
+    if (va < end) return false;
+    
+    // At most two splits; check room up front so a failure changes nothing
+    u32 splits = 0;
+    for (u32 i = 0; i < t->count; i++) {
+        if (t->vmas[i].start < start && t->vmas[i].end > start) splits++;
+        if (t->vmas[i].start < end && t->vmas[i].end > end) splits++;
+    }
+    if (t->count + splits > VMA_MAX_PER_AS) {
+        serial_puts("[VMA] ERROR: Too many VMAs in address space\r\n");
+        return false;
+    }
+    
+    for (u32 i = 0; i < t->count; i++) {
+        vma_t *v = &t->vmas[i];
+        if (v->end <= start || v->start >= end) continue;
+    
+        if (v->start < start) {
+            if (!vma_split(t, i, start)) return false;
+            continue;   // Next iteration handles the upper half
+        }
+        if (v->end > end && !vma_split(t, i, end)) return false;
+    
+        t->vmas[i].flags = (t->vmas[i].flags & ~clear) | set;
+    }
+    
+    vma_merge(t);
+    return true;
+}
+
+// Lowest free gap of len bytes inside [lo, hi), aligned to align.
+// Returns 0 if there is none.
+u64 vma_find_gap(u64 pml4_phys, u64 len, u64 align, u64 lo, u64 hi) {
+    len = PAGE_ALIGN(len);
+    if (len == 0 || align < PAGE_SIZE) return 0;
+    
+    vma_table_t *t = vma_table(pml4_phys, false);
+    u64 candidate = ALIGN_UP(lo, align);
+    u32 count = t ? t->count : 0;
+    
+    for (u32 i = 0; i < count; i++) {
+        vma_t *v = &t->vmas[i];
+        if (v->end <= candidate) continue;
+        if (v->start >= candidate + len) break;
+        candidate = ALIGN_UP(v->end, align);
+    }
+    
+    if (candidate + len > hi || candidate + len < candidate) return 0;
+    return candidate;
+}
+
+// Remove [start, end) from whatever VMAs it overlaps, splitting the ones
+// that stick out on either side
+bool vma_carve(u64 pml4_phys, u64 start, u64 end) {
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+    end = PAGE_ALIGN(end);
+    if (start >= end) return false;
+    
+    vma_table_t *t = vma_table(pml4_phys, false);
+    if (!t) return true;
+    
+    // Only a VMA strictly containing the range needs an extra slot
+    for (u32 i = 0; i < t->count; i++) {
+        if (t->vmas[i].start < start && t->vmas[i].end > end &&
+            t->count == VMA_MAX_PER_AS) {
+            serial_puts("[VMA] ERROR: Too many VMAs in address space\r\n");
+            return false;
+        }
+    }
+    
+    u32 i = 0;
+    while (i < t->count) {
+        vma_t *v = &t->vmas[i];
+        if (v->end <= start || v->start >= end) {
+            i++;
+            continue;
+        }
+    
+        if (v->start < start && v->end > end) {
+            vma_split(t, i, end);
+            t->vmas[i].end = start;
+            return true;
+        }
+        if (v->start < start) {
+            v->end = start;
+            i++;
+        } else if (v->end > end) {
+            v->start = end;
+            i++;
+        } else {
+            for (u32 j = i; j + 1 < t->count; j++) {
+                t->vmas[j] = t->vmas[j + 1];
+            }
+            t->count--;
+        }
+    }
+    return true;
+}
+
+// Whether 2MB pages are allowed for [va, va + 2MB) in this address space
+bool vma_huge_allowed(u64 pml4_phys, u64 va) {
+    u64 base = ALIGN_DOWN(va, LARGE_PAGE_SIZE);
+    vma_t *v = vma_find(pml4_phys, base);
+    if (!v || v->end < base + LARGE_PAGE_SIZE) return false;
+    if (v->flags & (VMA_NOHUGEPAGE | VMA_SHARED)) return false;
+    return thp_enabled_for(v->flags);
+}
+
+// Forget every VMA of an address space (teardown)
+void vma_destroy_all(u64 pml4_phys) {
+    vma_table_t *t = vma_table(pml4_phys, false);
+    if (!t) return;
+    t->count = 0;
+    t->pml4_phys = 0;
+}
\ No newline at end of file
@@ -47,8 +47,9 @@ void vmm_init(void) {
     u64 cr3;
     __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
     
-    // Convert physical PML4 address to virtual address
-    current_pml4 = (u64 *)PHYS_TO_VIRT(cr3 & PTE_ADDR_MASK);
+    // Page tables are reached through the HHDM; the kernel image mapping
+    // at KERNEL_VMA_BASE does not cover them
+    current_pml4 = (u64 *)phys_to_virt(cr3 & PTE_ADDR_MASK);
     
     serial_puts("[VMM] Page table pointer initialized\r\n");
     
@@ -73,7 +74,7 @@ static u64 alloc_page_table(void) {
     }
     
     // Zero out the new page table
-    u64 *table = (u64 *)(phys + KERNEL_VMA_BASE);
+    u64 *table = (u64 *)phys_to_virt(phys);
     for (int i = 0; i < 512; i++) {
         table[i] = 0;
     }
@@ -102,7 +103,7 @@ bool vmm_map_page(u64 vaddr, u64 paddr, u64 flags) {
         if (pdpt_phys == 0) return false;
         pml4[pml4_idx] = pdpt_phys | PAGE_PRESENT | PAGE_WRITE;
     }
-    u64 *pdpt = (u64 *)(pte_to_phys(pml4[pml4_idx]) + KERNEL_VMA_BASE);
+    u64 *pdpt = (u64 *)phys_to_virt(pte_to_phys(pml4[pml4_idx]));
     
     // Get/create PD
     if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) {
@@ -110,7 +111,7 @@ bool vmm_map_page(u64 vaddr, u64 paddr, u64 flags) {
         if (pd_phys == 0) return false;
         pdpt[pdpt_idx] = pd_phys | PAGE_PRESENT | PAGE_WRITE;
     }
-    u64 *pd = (u64 *)(pte_to_phys(pdpt[pdpt_idx]) + KERNEL_VMA_BASE);
+    u64 *pd = (u64 *)phys_to_virt(pte_to_phys(pdpt[pdpt_idx]));
     
     // Get/create PT
     if (!(pd[pd_idx] & PAGE_PRESENT)) {
@@ -118,7 +119,12 @@ bool vmm_map_page(u64 vaddr, u64 paddr, u64 flags) {
         if (pt_phys == 0) return false;
         pd[pd_idx] = pt_phys | PAGE_PRESENT | PAGE_WRITE;
     }
-    u64 *pt = (u64 *)(pte_to_phys(pd[pd_idx]) + KERNEL_VMA_BASE);
+    u64 *pt = (u64 *)phys_to_virt(pte_to_phys(pd[pd_idx]));
+    
+    // Kernel-half mappings are global unless PTI is active
+    if (vaddr >= 0xffff800000000000UL && kernel_global_mappings()) {
+        flags |= PAGE_GLOBAL;
+    }
     
     // Set page table entry
     pt[pt_idx] = paddr | flags | PAGE_PRESENT;
@@ -142,13 +148,13 @@ void vmm_unmap_page(u64 vaddr) {
     
     // Walk page table hierarchy
     if (!(pml4[pml4_idx] & PAGE_PRESENT)) return;
-    u64 *pdpt = (u64 *)(pte_to_phys(pml4[pml4_idx]) + KERNEL_VMA_BASE);
+    u64 *pdpt = (u64 *)phys_to_virt(pte_to_phys(pml4[pml4_idx]));
     
     if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) return;
-    u64 *pd = (u64 *)(pte_to_phys(pdpt[pdpt_idx]) + KERNEL_VMA_BASE);
+    u64 *pd = (u64 *)phys_to_virt(pte_to_phys(pdpt[pdpt_idx]));
     
     if (!(pd[pd_idx] & PAGE_PRESENT)) return;
-    u64 *pt = (u64 *)(pte_to_phys(pd[pd_idx]) + KERNEL_VMA_BASE);
+    u64 *pt = (u64 *)phys_to_virt(pte_to_phys(pd[pd_idx]));
     
     // Clear page table entry
     pt[pt_idx] = 0;
@@ -170,13 +176,13 @@ u64 vmm_get_physical(u64 vaddr) {
     
     // Walk page table hierarchy
     if (!(pml4[pml4_idx] & PAGE_PRESENT)) return 0;
-    u64 *pdpt = (u64 *)(pte_to_phys(pml4[pml4_idx]) + KERNEL_VMA_BASE);
+    u64 *pdpt = (u64 *)phys_to_virt(pte_to_phys(pml4[pml4_idx]));
     
     if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) return 0;
-    u64 *pd = (u64 *)(pte_to_phys(pdpt[pdpt_idx]) + KERNEL_VMA_BASE);
+    u64 *pd = (u64 *)phys_to_virt(pte_to_phys(pdpt[pdpt_idx]));
     
     if (!(pd[pd_idx] & PAGE_PRESENT)) return 0;
-    u64 *pt = (u64 *)(pte_to_phys(pd[pd_idx]) + KERNEL_VMA_BASE);
+    u64 *pt = (u64 *)phys_to_virt(pte_to_phys(pd[pd_idx]));
     
     if (!(pt[pt_idx] & PAGE_PRESENT)) return 0;
     
@@ -192,8 +198,12 @@ void *kmalloc(u64 size) {
     size = ALIGN_UP(size, 8);
     
     // Simple allocation within kernel space - use a basic bump allocator
-    // This avoids the complexity of heap management for now
+    // This avoids the complexity of heap management for now. Callers run
+    // on every CPU and may be preempted, hence the lock.
     static u64 simple_heap_ptr = 0;
+    static spinlock_t heap_lock;
+    
+    spin_lock(&heap_lock);
     
     // Initialize heap pointer on first use
     if (simple_heap_ptr == 0) {
@@ -202,6 +212,7 @@ void *kmalloc(u64 size) {
     
     // Check if we have enough space (within existing mapped kernel memory)
     if (simple_heap_ptr + size >= kernel_heap_start + (1024 * 1024)) { // 1MB limit
+        spin_unlock(&heap_lock);
         serial_puts("[VMM] kmalloc: Simple heap exhausted!\r\n");
         return NULL;
     }
@@ -209,6 +220,7 @@ void *kmalloc(u64 size) {
     void *result = (void *)simple_heap_ptr;
     simple_heap_ptr += size;
     
+    spin_unlock(&heap_lock);
     return result;
 }
 
@@ -0,0 +1,224 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Working-set estimation via accessed-bit scanning
+//
+// Each scan pass over an address space tests and clears PTE_ACCESSED on
+// every present user leaf. A leaf found accessed gets idle age 0, one found
+// clear ages by one pass. The age lives in the PTE itself (software bits
+// 52-58, ignored by the MMU on present entries), so no side table is needed.
+//
+// wss_tick() is cheap: every WSS_SCAN_INTERVAL ticks it visits at most
+// WSS_SCAN_BUDGET leaves of one address space and resumes where it stopped
+// next time. At the end of a pass the TLB of that address space is flushed
+// once (cached translations would otherwise hide accesses from the next
+// pass), the age histogram is published and the working set is taken as
+// every page idle for fewer than WSS_ACTIVE_AGE passes.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_ACCESSED    (1ULL << 5)
+
+#define WSS_SCAN_INTERVAL   10      // Ticks between scan steps
+#define WSS_SCAN_BUDGET     512     // Leaves visited per scan step
+#define WSS_ACTIVE_AGE      2       // Idle for fewer passes = in the working set
+#define WSS_MAX_AS          64
+
+#define WSS_USER_END        0x0000800000000000ULL
+
+// Histogram buckets by idle age: 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64+
+typedef struct {
+    u64 pml4_phys;              // 0 = free slot
+    u64 cursor;                 // Resume VA of the pass in progress
+    u64 hist[WSS_BUCKETS];      // Pass in progress
+    u64 last_hist[WSS_BUCKETS]; // Last complete pass
+    u64 wss_pages;              // Estimate from the last complete pass
+    u64 passes;
+} wss_state_t;
+
+static wss_state_t wss_table[WSS_MAX_AS];
+static u32 wss_rr;              // Round-robin index into the live AS list
+static u64 wss_ticks;
+
+typedef struct {
+    wss_state_t *st;
+    u32 budget;
+} wss_scan_ctx_t;
+
+static u32 age_bucket(u64 age) {
+    u32 b = 0;
+    while (age > 1 && b < WSS_BUCKETS - 2) {
+        age >>= 1;
+        b++;
+    }
+    return age ? b + 1 : 0;
+}
+
+static wss_state_t *wss_lookup(u64 pml4_phys, bool create) {
+    if (!pml4_phys) return NULL;
+    
+    wss_state_t *free_slot = NULL;
+    for (int i = 0; i < WSS_MAX_AS; i++) {
+        if (wss_table[i].pml4_phys == pml4_phys) return &wss_table[i];
+        if (!wss_table[i].pml4_phys && !free_slot) free_slot = &wss_table[i];
+    }
+    if (!create || !free_slot) return NULL;
+    
+    for (int b = 0; b < WSS_BUCKETS; b++) {
+        free_slot->hist[b] = 0;
+        free_slot->last_hist[b] = 0;
+    }
+    free_slot->pml4_phys = pml4_phys;
+    free_slot->cursor = 0;
+    free_slot->wss_pages = 0;
+    free_slot->passes = 0;
+    return free_slot;
+}
+
+// Drop state of address spaces that no longer exist
+static void wss_prune(const u64 *live, u32 count) {
+    for (int i = 0; i < WSS_MAX_AS; i++) {
+        if (!wss_table[i].pml4_phys) continue;
+    
+        bool found = false;
+        for (u32 j = 0; j < count; j++) {
+            if (live[j] == wss_table[i].pml4_phys) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) wss_table[i].pml4_phys = 0;
+    }
+}
+
+static bool wss_scan_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    (void)va;
+    wss_scan_ctx_t *sc = (wss_scan_ctx_t*)ctx;
+    
+    u64 entry = *pte;
+    u64 age = (entry & PTE_AGE_MASK) >> PTE_AGE_SHIFT;
+    
+    if (entry & PTE_ACCESSED) {
+        age = 0;
+    } else if (age < PTE_AGE_MAX) {
+        age++;
+    }
+    
+    // Atomic update: the CPU may set A/D on this entry concurrently
+    u64 expected = entry;
+    u64 desired = (entry & ~(PTE_ACCESSED | PTE_AGE_MASK)) | (age << PTE_AGE_SHIFT);
+    if (!__atomic_compare_exchange_n(pte, &expected, desired, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // Raced with a hardware A/D update - the page is in use
+        age = 0;
+    }
+    
+    sc->st->hist[age_bucket(age)] += size / PAGE_SIZE;
+    return --sc->budget > 0;
+}
+
+// Publish a finished pass and start the next one
+static void wss_finish_pass(wss_state_t *st) {
+    u64 active = 0;
+    for (int b = 0; b < WSS_BUCKETS; b++) {
+        st->last_hist[b] = st->hist[b];
+        st->hist[b] = 0;
+    }
+    
+    // Buckets 0 and 1 hold ages 0 and 1 (WSS_ACTIVE_AGE = 2)
+    for (u32 b = 0; b < WSS_ACTIVE_AGE && b < WSS_BUCKETS; b++) {
+        active += st->last_hist[b];
+    }
+    
+    st->wss_pages = active;
+    st->cursor = 0;
+    st->passes++;
+    
+    user_as_flush_tlb(st->pml4_phys);
+}
+
+// Advance the scan of one address space by at most budget leaves.
+// Returns true if that completed a pass.
+static bool wss_scan_step(wss_state_t *st, u32 budget) {
+    wss_scan_ctx_t sc = { st, budget };
+    
+    st->cursor = user_as_walk(st->pml4_phys, st->cursor, WSS_USER_END, wss_scan_fn, &sc);
+    if (st->cursor >= WSS_USER_END) {
+        // Walk ran to the end of the user half
+        wss_finish_pass(st);
+        return true;
+    }
+    return false;
+}
+
+// Periodic hook (scheduler tick)
+void wss_tick(void) {
+    if (++wss_ticks % WSS_SCAN_INTERVAL) return;
+    
+    u64 live[WSS_MAX_AS];
+    u32 count = user_as_list(live, WSS_MAX_AS);
+    if (count == 0) return;
+    
+    if (wss_rr >= count) {
+        wss_rr = 0;
+        wss_prune(live, count);
+    }
+    
+    wss_state_t *st = wss_lookup(live[wss_rr], true);
+    if (!st) {
+        // Table full: drop dead address spaces and retry, else skip this
+        // one so the spaces that are tracked keep being scanned
+        wss_prune(live, count);
+        st = wss_lookup(live[wss_rr], true);
+    }
+    if (!st) {
+        wss_rr++;
+        return;
+    }
+    
+    if (wss_scan_step(st, WSS_SCAN_BUDGET)) {
+        wss_rr++;
+    }
+}
+
+// Run one complete pass right away (e.g. before choosing migration victims)
+void wss_scan_now(u64 pml4_phys) {
+    wss_state_t *st = wss_lookup(pml4_phys, true);
+    if (!st) return;
+    
+    // Restart so the pass covers the whole address space consistently
+    for (int b = 0; b < WSS_BUCKETS; b++) {
+        st->hist[b] = 0;
+    }
+    st->cursor = 0;
+    
+    while (!wss_scan_step(st, WSS_SCAN_BUDGET));
+}
+
+// Working-set size in bytes from the last complete pass (0 if none yet)
+u64 wss_estimate(u64 pml4_phys) {
+    wss_state_t *st = wss_lookup(pml4_phys, false);
+    if (!st) return 0;
+    return st->wss_pages * PAGE_SIZE;
+}
+
+// Idle-age histogram (pages per bucket) from the last complete pass
+bool wss_histogram(u64 pml4_phys, u64 out[WSS_BUCKETS]) {
+    wss_state_t *st = wss_lookup(pml4_phys, false);
+    if (!st || st->passes == 0) return false;
+    
+    for (int b = 0; b < WSS_BUCKETS; b++) {
+        out[b] = st->last_hist[b];
+    }
+    return true;
+}
+
+// Idle age of one page in scan passes, -1 if not mapped. Lower = hotter,
+// which is the order post-copy prefetch and migration should prefer.
+i32 wss_page_age(u64 pml4_phys, u64 va) {
+    u64 *pte = user_as_get_pte(pml4_phys, va, false);
+    if (!pte || !(*pte & PTE_PRESENT)) return -1;
+    if (*pte & PTE_ACCESSED) return 0;
+    return (i32)((*pte & PTE_AGE_MASK) >> PTE_AGE_SHIFT);
+}
\ No newline at end of file
@@ -0,0 +1,462 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+#include <myria/paging.h>
+
+// Compressed in-memory swap
+//
+// When the PMM runs dry it calls zswap_reclaim(), which picks cold private
+// anonymous user pages (idle age from the working-set scanner, then
+// accessed bit, then anything as a last resort), compresses them into a
+// RAM pool and frees their frames. The PTE becomes a non-present swap entry
+// (PTE_SWAP plus the entry handle in the address bits, permission bits
+// kept) and the fault handler decompresses the page on the next access.
+//
+// Pages filled with one repeated 64-bit value (mostly zero pages) are stored
+// as just that value. Everything else goes through a small LZ77 compressor;
+// pages that do not compress to half a page stay resident. The pool is
+// zbud-style: each pool page holds at most two objects, one packed from the
+// start and one from the end, which keeps freeing trivial and fragmentation
+// bounded.
+
+// Page table flags
+#define PTE_PRESENT     (1ULL << 0)
+#define PTE_WRITABLE    (1ULL << 1)
+#define PTE_USER        (1ULL << 2)
+#define PTE_ACCESSED    (1ULL << 5)
+#define PTE_DIRTY       (1ULL << 6)
+#define PTE_NOEXECUTE   (1ULL << 63)
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+#define ZSWAP_MAX_ENTRIES       8192
+#define ZSWAP_MAX_POOL_PAGES    2048
+#define ZSWAP_MAX_OBJECT        (PAGE_SIZE / 2)   // Larger = not worth storing
+#define ZSWAP_FREE_BATCH        32                // Frames freed per TLB flush
+#define ZSWAP_COLD_AGE          2                 // Preferred victims: idle >= 2 passes
+
+#define ZSWAP_USER_END          0x0000800000000000ULL
+
+typedef enum {
+    ZENTRY_FREE = 0,
+    ZENTRY_SAME_FILLED,
+    ZENTRY_COMPRESSED
+} zentry_type_t;
+
+typedef struct {
+    u8 type;
+    u8 last;                // Which buddy: 0 = first (from start), 1 = last (from end)
+    u16 len;
+    u32 pool_page;
+    u64 value;              // Fill value for ZENTRY_SAME_FILLED
+} zswap_entry_t;
+
+typedef struct {
+    u64 phys;               // 0 = unused slot
+    u16 first_len;
+    u16 last_len;
+} zbud_page_t;
+
+static zswap_entry_t zswap_entries[ZSWAP_MAX_ENTRIES];
+static zbud_page_t zbud_pages[ZSWAP_MAX_POOL_PAGES];
+static u32 zswap_free_hint;
+
+// Entries and pool. Reclaim only trylocks it: an allocation made while
+// storing a page may run out of frames and call back into reclaim, which
+// then backs off instead of deadlocking (as it does when another CPU is
+// already reclaiming).
+static spinlock_t zswap_lock;
+static u64 zswap_stored_pages;
+static u64 zswap_pool_pages;
+
+// Compressor scratch (reclaim is not reentrant)
+static u8 zswap_buf[PAGE_SIZE];
+
+// LZ77 compressor
+//
+// Groups of up to 8 items led by a control byte; control bit i set means
+// item i is a match (2 bytes: 12-bit distance-1, 4-bit length-3), clear
+// means one literal byte.
+
+#define LZ_HASH_BITS    12
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    18
+
+static u16 lz_hash[1 << LZ_HASH_BITS];   // Position + 1 of the last occurrence
+
+static inline u32 lz_hash3(const u8 *p) {
+    u32 v = ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static u32 lz_compress(const u8 *src, u8 *dst, u32 cap) {
+    for (u32 i = 0; i < (1u << LZ_HASH_BITS); i++) {
+        lz_hash[i] = 0;
+    }
+    
+    u32 ip = 0, op = 0;
+    while (ip < PAGE_SIZE) {
+        // Worst case for a group: control byte + 8 two-byte matches
+        if (op + 17 > cap) return 0;
+    
+        u32 ctrl_pos = op++;
+        u8 ctrl = 0;
+    
+        for (int bit = 0; bit < 8 && ip < PAGE_SIZE; bit++) {
+            u32 len = 0, dist = 0;
+    
+            if (ip + LZ_MIN_MATCH <= PAGE_SIZE) {
+                u32 h = lz_hash3(src + ip);
+                u32 cand = lz_hash[h];
+                lz_hash[h] = (u16)(ip + 1);
+    
+                if (cand) {
+                    cand--;
+                    dist = ip - cand;
+                    while (len < LZ_MAX_MATCH && ip + len < PAGE_SIZE &&
+                           src[cand + len] == src[ip + len]) {
+                        len++;
+                    }
+                }
+            }
+    
+            if (len >= LZ_MIN_MATCH) {
+                u16 token = (u16)(((dist - 1) << 4) | (len - LZ_MIN_MATCH));
+                dst[op++] = token & 0xFF;
+                dst[op++] = token >> 8;
+                ctrl |= 1 << bit;
+                ip += len;
+            } else {
+                dst[op++] = src[ip++];
+            }
+        }
+    
+        dst[ctrl_pos] = ctrl;
+    }
+    
+    return op;
+}
+
+static bool lz_decompress(const u8 *src, u32 len, u8 *dst) {
+    u32 ip = 0, op = 0;
+    
+    while (ip < len && op < PAGE_SIZE) {
+        u8 ctrl = src[ip++];
+    
+        for (int bit = 0; bit < 8 && ip < len && op < PAGE_SIZE; bit++) {
+            if (ctrl & (1 << bit)) {
+                if (ip + 2 > len) return false;
+                u16 token = src[ip] | ((u16)src[ip + 1] << 8);
+                ip += 2;
+    
+                u32 dist = (token >> 4) + 1;
+                u32 mlen = (token & 0xF) + LZ_MIN_MATCH;
+                if (dist > op) return false;
+    
+                // Byte-wise so overlapping matches replicate correctly
+                for (u32 k = 0; k < mlen && op < PAGE_SIZE; k++, op++) {
+                    dst[op] = dst[op - dist];
+                }
+            } else {
+                dst[op++] = src[ip++];
+            }
+        }
+    }
+    
+    return op == PAGE_SIZE;
+}
+
+// zbud pool
+
+static u8 *zbud_object(zswap_entry_t *e) {
+    zbud_page_t *zp = &zbud_pages[e->pool_page];
+    u8 *base = (u8*)phys_to_virt(zp->phys);
+    return e->last ? base + PAGE_SIZE - e->len : base;
+}
+
+// Find room for len bytes; may take a fresh pool page. spare_frame (if not
+// 0) is used as the new pool page when the PMM has nothing left; *used_spare
+// tells the caller it no longer owns it.
+static bool zbud_alloc(u16 len, zswap_entry_t *e, u64 spare_frame, bool *used_spare) {
+    u32 empty = ZSWAP_MAX_POOL_PAGES;
+    
+    for (u32 i = 0; i < ZSWAP_MAX_POOL_PAGES; i++) {
+        zbud_page_t *zp = &zbud_pages[i];
+        if (!zp->phys) {
+            if (empty == ZSWAP_MAX_POOL_PAGES) empty = i;
+            continue;
+        }
+        if ((u64)zp->first_len + zp->last_len + len > PAGE_SIZE) continue;
+    
+        if (!zp->first_len) {
+            zp->first_len = len;
+            e->last = 0;
+        } else if (!zp->last_len) {
+            zp->last_len = len;
+            e->last = 1;
+        } else {
+            continue;
+        }
+        e->pool_page = i;
+        return true;
+    }
+    
+    if (empty == ZSWAP_MAX_POOL_PAGES) return false;
+    
+    u64 pa = pmm_alloc_page();
+    if (!pa && spare_frame) {
+        pa = spare_frame;
+        *used_spare = true;
+    }
+    if (!pa) return false;
+    
+    zbud_pages[empty].phys = pa;
+    zbud_pages[empty].first_len = len;
+    zbud_pages[empty].last_len = 0;
+    zswap_pool_pages++;
+    
+    e->pool_page = empty;
+    e->last = 0;
+    return true;
+}
+
+static void zbud_free(zswap_entry_t *e) {
+    zbud_page_t *zp = &zbud_pages[e->pool_page];
+    if (e->last) {
+        zp->last_len = 0;
+    } else {
+        zp->first_len = 0;
+    }
+    
+    if (!zp->first_len && !zp->last_len) {
+        pmm_free_page(zp->phys);
+        zp->phys = 0;
+        zswap_pool_pages--;
+    }
+}
+
+static u32 zswap_entry_alloc(void) {
+    for (u32 n = 0; n < ZSWAP_MAX_ENTRIES; n++) {
+        u32 i = (zswap_free_hint + n) % ZSWAP_MAX_ENTRIES;
+        if (zswap_entries[i].type == ZENTRY_FREE) {
+            zswap_free_hint = i + 1;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Store the contents of frame. Returns a handle (0 = not stored).
+static u32 zswap_store(u64 frame, bool *frame_consumed) {
+    *frame_consumed = false;
+    
+    u32 handle = zswap_entry_alloc();
+    if (!handle) return 0;
+    zswap_entry_t *e = &zswap_entries[handle - 1];
+    
+    const u64 *words = (const u64*)phys_to_virt(frame);
+    bool same = true;
+    for (int i = 1; i < 512; i++) {
+        if (words[i] != words[0]) {
+            same = false;
+            break;
+        }
+    }
+    if (same) {
+        e->type = ZENTRY_SAME_FILLED;
+        e->value = words[0];
+        return handle;
+    }
+    
+    u32 len = lz_compress((const u8*)words, zswap_buf, ZSWAP_MAX_OBJECT);
+    if (!len) return 0;
+    
+    if (!zbud_alloc((u16)len, e, frame, frame_consumed)) return 0;
+    
+    e->type = ZENTRY_COMPRESSED;
+    e->len = (u16)len;
+    
+    u8 *dst = zbud_object(e);
+    for (u32 i = 0; i < len; i++) {
+        dst[i] = zswap_buf[i];
+    }
+    return handle;
+}
+
+static void zswap_entry_free(u32 handle) {
+    zswap_entry_t *e = &zswap_entries[handle - 1];
+    if (e->type == ZENTRY_COMPRESSED) {
+        zbud_free(e);
+    }
+    e->type = ZENTRY_FREE;
+    zswap_stored_pages--;
+}
+
+// Reclaim
+
+typedef struct {
+    u64 pml4_phys;
+    u32 stage;              // 0: idle-aged, 1: not recently accessed, 2: any
+    u64 target;
+    u64 freed;
+    u64 batch[ZSWAP_FREE_BATCH];
+    u32 batch_count;
+} zswap_reclaim_ctx_t;
+
+static void reclaim_flush_batch(zswap_reclaim_ctx_t *rc) {
+    if (!rc->batch_count) return;
+    
+    // Stale translations must be gone before the frames are reused
+    user_as_flush_tlb(rc->pml4_phys);
+    for (u32 i = 0; i < rc->batch_count; i++) {
+        pmm_free_page(rc->batch[i]);
+    }
+    rc->freed += rc->batch_count;
+    rc->batch_count = 0;
+}
+
+static bool reclaim_fn(u64 *pte, u64 va, u64 size, void *ctx) {
+    zswap_reclaim_ctx_t *rc = (zswap_reclaim_ctx_t*)ctx;
+    u64 entry = *pte;
+    
+    if (size != PAGE_SIZE) return true;
+    if (!(entry & PTE_USER) || (entry & (PTE_SHARED | PTE_COW))) return true;
+    
+    // Freed with MADV_FREE and not written since: drop it without saving,
+    // the next touch gets a zero page. A write cancels the hint.
+    if (entry & PTE_LAZYFREE) {
+        if (!(entry & PTE_DIRTY)) {
+            u64 frame = entry & PTE_ADDR_MASK;
+            *pte = 0;
+            rmap_remove(frame, rc->pml4_phys, va);
+            rc->batch[rc->batch_count++] = frame;
+            if (rc->batch_count == ZSWAP_FREE_BATCH) {
+                reclaim_flush_batch(rc);
+            }
+            return rc->freed + rc->batch_count < rc->target;
+        }
+        *pte = entry = entry & ~PTE_LAZYFREE;
+    }
+    
+    u64 age = (entry & PTE_AGE_MASK) >> PTE_AGE_SHIFT;
+    if (rc->stage == 0 && ((entry & PTE_ACCESSED) || age < ZSWAP_COLD_AGE)) return true;
+    if (rc->stage == 1 && (entry & PTE_ACCESSED)) return true;
+    
+    vma_t *vma = vma_find(rc->pml4_phys, va);
+    if (!vma || !(vma->flags & VMA_ANON)) return true;
+    
+    u64 frame = entry & PTE_ADDR_MASK;
+    if (pmm_frame_refcount(frame) != 1) return true;
+    
+    // User code is not running while we reclaim, so the frame may change
+    // under its (about to be replaced) PTE without anyone observing it
+    bool consumed = false;
+    u32 handle = zswap_store(frame, &consumed);
+    if (!handle) return true;
+    
+    // Swap entries have no D bit: record the page in an active dirty log
+    if (entry & PTE_DIRTY) dirty_log_mark(rc->pml4_phys, va, PAGE_SIZE);
+    *pte = ((u64)handle << 12) | PTE_SWAP |
+           (entry & (PTE_USER | PTE_WRITABLE | PTE_NOEXECUTE));
+    rmap_remove(frame, rc->pml4_phys, va);
+    zswap_stored_pages++;
+    
+    if (consumed) {
+        // The frame is now a pool page: drop any cached user translation
+        user_as_flush_tlb(rc->pml4_phys);
+        return true;
+    }
+    
+    rc->batch[rc->batch_count++] = frame;
+    if (rc->batch_count == ZSWAP_FREE_BATCH) {
+        reclaim_flush_batch(rc);
+    }
+    return rc->freed + rc->batch_count < rc->target;
+}
+
+// Compress cold anonymous pages until target frames were freed.
+// Returns the number of frames actually freed.
+u64 zswap_reclaim(u64 target) {
+    // Only the boot CPU loads user page tables, so only there does the TLB
+    // flush before the frames are freed reach every cached translation
+    if (smp_cpu_id() != 0) return 0;
+    if (!spin_trylock(&zswap_lock)) return 0;
+    
+    u64 live[64];
+    u32 count = user_as_list(live, 64);
+    u64 freed = 0;
+    
+    for (u32 stage = 0; stage < 3 && freed < target; stage++) {
+        for (u32 i = 0; i < count && freed < target; i++) {
+            zswap_reclaim_ctx_t rc;
+            rc.pml4_phys = live[i];
+            rc.stage = stage;
+            rc.target = target - freed;
+            rc.freed = 0;
+            rc.batch_count = 0;
+    
+            user_as_walk(live[i], 0, ZSWAP_USER_END, reclaim_fn, &rc);
+            reclaim_flush_batch(&rc);
+            freed += rc.freed;
+        }
+    }
+    
+    spin_unlock(&zswap_lock);
+    
+    if (freed) {
+        serial_puts("[ZSWAP] Reclaimed frames by compressing cold pages\r\n");
+    }
+    return freed;
+}
+
+// Fault on a swap entry: decompress into a fresh frame and map it back
+bool zswap_load(u64 pml4_phys, u64 va, u64 *pte) {
+    u64 entry = *pte;
+    u32 handle = (u32)((entry & PTE_ADDR_MASK) >> 12);
+    if (!(entry & PTE_SWAP) || handle == 0 || handle > ZSWAP_MAX_ENTRIES) return false;
+    
+    // Allocate first: it may reclaim, which takes zswap_lock itself. It
+    // never reclaims this page (it is not present).
+    u64 frame = pmm_alloc_page_color(pmm_color_hint(pml4_phys, va));
+    if (!frame) return false;
+    
+    spin_lock(&zswap_lock);
+    zswap_entry_t *e = &zswap_entries[handle - 1];
+    if (e->type == ZENTRY_FREE) {
+        spin_unlock(&zswap_lock);
+        pmm_free_page(frame);
+        return false;
+    }
+    if (e->type == ZENTRY_SAME_FILLED) {
+        u64 *words = (u64*)phys_to_virt(frame);
+        for (int i = 0; i < 512; i++) {
+            words[i] = e->value;
+        }
+    } else if (!lz_decompress(zbud_object(e), e->len, (u8*)phys_to_virt(frame))) {
+        spin_unlock(&zswap_lock);
+        serial_puts("[ZSWAP] ERROR: Corrupt compressed page\r\n");
+        pmm_free_page(frame);
+        return false;
+    }
+    
+    zswap_entry_free(handle);
+    spin_unlock(&zswap_lock);
+    *pte = frame | PTE_PRESENT | (entry & (PTE_USER | PTE_WRITABLE | PTE_NOEXECUTE));
+    rmap_add(frame, pml4_phys, va);
+    return true;
+}
+
+// Drop the stored copy behind a swap PTE (unmap/teardown)
+void zswap_invalidate(u64 pte) {
+    u32 handle = (u32)((pte & PTE_ADDR_MASK) >> 12);
+    if (pte & PTE_PRESENT || !(pte & PTE_SWAP) || !handle || handle > ZSWAP_MAX_ENTRIES) return;
+    
+    spin_lock(&zswap_lock);
+    if (zswap_entries[handle - 1].type != ZENTRY_FREE) {
+        zswap_entry_free(handle);
+    }
+    spin_unlock(&zswap_lock);
+}
+
+void zswap_get_stats(u64 *stored_pages, u64 *pool_pages) {
+    if (stored_pages) *stored_pages = zswap_stored_pages;
+    if (pool_pages) *pool_pages = zswap_pool_pages;
+}
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Futexes
+//
+// A futex is any aligned 32-bit word in user memory. Words in private
+// memory are keyed by (address space, virtual address): the kernel moves
+// private pages between frames behind the process's back (zswap, same-page
+// merging and copy on write, huge page collapse, frame migration), and a
+// key that followed the frame would strand the waiters. Words in shared
+// memory (VMA_SHARED) are keyed by physical address, so processes sharing
+// the object meet on the same key wherever it is mapped; those frames are
+// pinned by the object and never move. Keys hash into a fixed table of
+// buckets, each a wait queue; a bucket may hold waiters for several keys.
+//
+// FUTEX_WAIT looks the word up and compares it with the expected value
+// under the bucket lock before sleeping, and wakers change the word before
+// taking the lock, so a wakeup between the user's check and the sleep is
+// never lost. A word that is not resident is faulted in first.
+#define FUTEX_BUCKETS       256
+#define FUTEX_HASH_SHIFT    (64 - 8)
+
+static wait_queue_t futex_buckets[FUTEX_BUCKETS];
+
+void futex_init(void) {
+    for (int i = 0; i < FUTEX_BUCKETS; i++) {
+        wait_queue_init(&futex_buckets[i]);
+    }
+    serial_puts("[FUTEX] Futex hash table initialized\r\n");
+}
+
+typedef struct {
+    u64 addr;       // Virtual address, or physical for shared words
+    u64 as;         // PML4 for private words, 0 for shared
+} futex_key_t;
+
+static wait_queue_t *futex_bucket(const futex_key_t *k) {
+    u64 h = (k->addr >> 2) ^ (k->as >> PAGE_SHIFT);
+    return &futex_buckets[(h * 0x9E3779B97F4A7C15ULL) >> FUTEX_HASH_SHIFT];
+}
+
+static bool key_match(const waiter_t *w, const futex_key_t *k) {
+    return w->key == k->addr && w->key_as == k->as;
+}
+
+// Key of a futex word; false if misaligned or not mapped. Shared words
+// must be resident, which they are for as long as the object is mapped.
+static bool futex_key(u64 pml4_phys, u64 uaddr, futex_key_t *k) {
+    if (uaddr & 3) return false;
+    
+    vma_t *vma = vma_find(pml4_phys, uaddr);
+    if (vma && (vma->flags & VMA_SHARED)) {
+        k->addr = user_as_translate(pml4_phys, uaddr);
+        k->as = 0;
+        return k->addr != 0;
+    }
+    if (!vma && !user_as_translate(pml4_phys, uaddr)) return false;
+    
+    k->addr = uaddr;
+    k->as = pml4_phys;
+    return true;
+}
+
+// Lock two buckets in address order
+static void lock_buckets(wait_queue_t *a, wait_queue_t *b) {
+    if (a == b) {
+        spin_lock(&a->lock);
+    } else if (a < b) {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
+    } else {
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
+    }
+}
+
+static void unlock_buckets(wait_queue_t *a, wait_queue_t *b) {
+    spin_unlock(&a->lock);
+    if (a != b) spin_unlock(&b->lock);
+}
+
+// Sleep while *uaddr == val, until woken or timeout_ms passes (0: no
+// timeout). 0 when woken, -1 if the value differed, on timeout or fault.
+u64 futex_wait(u64 pml4_phys, u64 uaddr, u32 val, u64 timeout_ms) {
+    futex_key_t key;
+    if (!futex_key(pml4_phys, uaddr, &key)) return (u64)-1;
+    
+    wait_queue_t *bucket = futex_bucket(&key);
+    waiter_t w;
+    w.key = key.addr;
+    w.key_as = key.as;
+    
+    // The frame is looked up under the lock: a waker that moved the page
+    // (copy on write, swap-in) changed the PTE before it could take it
+    for (;;) {
+        spin_lock(&bucket->lock);
+        u64 pa = user_as_translate(pml4_phys, uaddr);
+        if (pa) {
+            if (*(volatile u32 *)phys_to_virt(pa) != val) {
+                spin_unlock(&bucket->lock);
+                return (u64)-1;
+            }
+            break;
+        }
+        spin_unlock(&bucket->lock);
+    
+        // Never touched or compressed: bring it in the way a read would
+        if (!vm_prefault(pml4_phys, uaddr, uaddr + sizeof(u32)) &&
+            !user_as_translate(pml4_phys, uaddr)) {
+            return (u64)-1;
+        }
+    }
+    return wait_queue_sleep(bucket, &w, timeout_ms) ? 0 : (u64)-1;
+}
+
+// Wake up to count waiters on uaddr; returns how many were woken
+u64 futex_wake(u64 pml4_phys, u64 uaddr, u32 count) {
+    futex_key_t key;
+    if (!futex_key(pml4_phys, uaddr, &key)) return (u64)-1;
+    
+    wait_queue_t *bucket = futex_bucket(&key);
+    u32 woken = 0;
+    spin_lock(&bucket->lock);
+    waiter_t *w = bucket->head;
+    while (w && woken < count) {
+        waiter_t *next = w->next;
+        if (key_match(w, &key)) {
+            wait_queue_wake_waiter(bucket, w);
+            woken++;
+        }
+        w = next;
+    }
+    spin_unlock(&bucket->lock);
+    return woken;
+}
+
+// Wake up to count waiters on uaddr and move up to requeue of the rest to
+// uaddr2 without waking them (a condition variable broadcast hands them to
+// the mutex instead of letting them all race for it). Returns the number
+// woken plus the number moved.
+u64 futex_requeue(u64 pml4_phys, u64 uaddr, u32 count, u64 uaddr2, u32 requeue) {
+    futex_key_t key, key2;
+    if (!futex_key(pml4_phys, uaddr, &key) || !futex_key(pml4_phys, uaddr2, &key2)) {
+        return (u64)-1;
+    }
+    
+    wait_queue_t *from = futex_bucket(&key);
+    wait_queue_t *to = futex_bucket(&key2);
+    u32 woken = 0;
+    u32 moved = 0;
+    lock_buckets(from, to);
+    waiter_t *w = from->head;
+    while (w && (woken < count || moved < requeue)) {
+        waiter_t *next = w->next;
+        if (key_match(w, &key)) {
+            if (woken < count) {
+                wait_queue_wake_waiter(from, w);
+                woken++;
+            } else if (moved < requeue) {
+                w->key = key2.addr;
+                w->key_as = key2.as;
+                if (from != to) wait_queue_move(from, to, w);
+                moved++;
+            }
+        }
+        w = next;
+    }
+    unlock_buckets(from, to);
+    return woken + moved;
+}
\ No newline at end of file
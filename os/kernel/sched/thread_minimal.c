@@ -12,13 +12,10 @@ typedef enum {
     THREAD_STATE_ZOMBIE
 } thread_state_t;
 
-// CPU context for context switching
+// CPU context for context switching: just the stack pointer, the
+// callee-saved registers are on the stack it points to
 typedef struct {
-    u64 rax, rbx, rcx, rdx;
-    u64 rsi, rdi, rbp, rsp;
-    u64 r8, r9, r10, r11;
-    u64 r12, r13, r14, r15;
-    u64 rip, rflags;
+    u64 rsp;
 } cpu_context_t;
 
 // Enhanced Thread Control Block
@@ -34,41 +31,322 @@ struct thread {
     cpu_context_t context;    // Saved CPU context
     u64 time_slice;           // Time slice counter
     u64 total_runtime;        // Total execution time
+    struct thread *rq_next;   // Run queue links (READY threads only)
+    struct thread *rq_prev;
+    u32 cpu;                  // CPU whose run queue the thread belongs to
+    fpu_t fpu;                // FPU/SIMD state, loaded on first use
 };
 typedef struct thread thread_t;
 
 // Forward declare assembly context switching functions  
-extern void switch_to_thread(cpu_context_t *old_ctx, cpu_context_t *new_ctx);
-extern void thread_bootstrap(void);
+extern void context_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx);
+extern void thread_entry(void);
 
 // Forward declare internal functions
-static void thread_wrapper(void);
-static thread_t *find_next_thread(void);
+void thread_wrapper(thread_t *t) NORETURN;
 static void cleanup_zombie_threads(void);
 
 // Enhanced scheduler state  
 #define MAX_THREADS 8
 #define THREAD_STACK_SIZE 8192
 #define DEFAULT_TIME_SLICE 10
+#define MM_SCAN_PERIOD_MS 1         // One scanner step per tick
 
 static thread_t thread_table[MAX_THREADS];
-static thread_t *current_thread = NULL;
+static spinlock_t thread_table_lock;    // Slot allocation and next_tid
 static u32 next_tid = 1;
 static u32 active_thread_count = 0;
-static u32 scheduler_ticks = 0;
 static bool scheduler_enabled = false;
+static ktimer_t mm_scan_timer;      // Drives the memory scanners on the boot CPU
+
+// Run queues: one per CPU, each with one FIFO per priority level plus a
+// bitmap of the non-empty levels, so picking the next thread is a bit scan
+// no matter how many threads are ready. The running thread is not on any
+// queue. A queue is only touched with its lock held.
+//
+// Preemption: the timer tick only sets need_resched; the switch happens in
+// sched_preempt on the way out of the interrupt (or syscall), unless the
+// CPU's preempt_count says it is inside a critical section. A switch is
+// made with the queue lock held, and the thread switched to releases it,
+// so a thread going back on the queue cannot be stolen before its context
+// is saved. When no thread is runnable the CPU switches back to its
+// scheduler loop (idle_context).
+//
+// An idle AP stops its tick and halts. Whoever queues work for it (or
+// for a busy CPU, when some CPU is idle and could steal) wakes it with a
+// reschedule IPI.
+//
+// A sleeping thread is BLOCKED and on no queue; a timer on the wheel of
+// the CPU it slept on puts it back (sched_wake).
+#define SCHED_PRIO_LEVELS (THREAD_PRIORITY_REAL + 1)
+
+typedef struct {
+    spinlock_t lock;
+    thread_t *head[SCHED_PRIO_LEVELS];
+    thread_t *tail[SCHED_PRIO_LEVELS];
+    u32 bitmap;
+    u32 nr_ready;
+    thread_t *current;
+    cpu_context_t idle_context; // Scheduler loop, while a thread runs
+    u32 preempt_count;          // Owner CPU only; no preemption while > 0
+    volatile bool need_resched; // Set by the tick, acted on at interrupt exit
+    volatile bool balance_due;  // Periodic balancing, also at interrupt exit
+    volatile bool idle;         // Halted with the tick stopped
+    u64 ticks;
+} run_queue_t;
+
+static run_queue_t run_queues[SMP_MAX_CPUS];
+
+static bool run_one_thread(run_queue_t *rq);
+
+// Load balancing: an idle CPU steals from the busiest queue nearby, and
+// every CPU periodically pulls from a queue that is clearly longer
+#define SCHED_BALANCE_TICKS 4       // Ticks between periodic balancing
+#define SCHED_BALANCE_RUNS  4       // Threads run between balancing on APs
+#define SCHED_IMBALANCE     2       // Queue length gap worth a migration
+
+static inline run_queue_t *this_rq(void) {
+    return &run_queues[smp_cpu_id()];
+}
+
+static inline u64 irq_save(void) {
+    u64 flags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(u64 flags) {
+    __asm__ volatile("pushq %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// The counter update must not be split by a tick: a thread preempted
+// halfway could resume on another CPU and write into this one's count
+void preempt_disable(void) {
+    u64 flags = irq_save();
+    this_rq()->preempt_count++;
+    irq_restore(flags);
+}
+
+// Pending preemption is left for the next interrupt exit
+void preempt_enable(void) {
+    u64 flags = irq_save();
+    this_rq()->preempt_count--;
+    irq_restore(flags);
+}
+
+// Lock the queue of the CPU we are running on. Preemption goes off first
+// so the thread cannot migrate between picking the queue and locking it.
+static run_queue_t *lock_this_rq(void) {
+    preempt_disable();
+    run_queue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    preempt_enable();
+    return rq;
+}
+
+// Lock the queue a thread belongs to. A ready thread may be stolen by
+// another CPU until its queue is locked, so check it is still there.
+static run_queue_t *lock_thread_rq(thread_t *t) {
+    for (;;) {
+        run_queue_t *rq = &run_queues[__atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE)];
+        spin_lock(&rq->lock);
+        if (&run_queues[t->cpu] == rq) return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+static void rq_enqueue(run_queue_t *rq, thread_t *t) {
+    u8 prio = t->priority;
+    t->rq_next = NULL;
+    t->rq_prev = rq->tail[prio];
+    if (rq->tail[prio]) {
+        rq->tail[prio]->rq_next = t;
+    } else {
+        rq->head[prio] = t;
+    }
+    rq->tail[prio] = t;
+    rq->bitmap |= 1u << prio;
+    rq->nr_ready++;
+    
+    // A higher-priority arrival preempts the running thread
+    if (rq->current && prio > rq->current->priority) rq->need_resched = true;
+}
+
+static void rq_dequeue(run_queue_t *rq, thread_t *t) {
+    u8 prio = t->priority;
+    if (t->rq_prev) {
+        t->rq_prev->rq_next = t->rq_next;
+    } else {
+        rq->head[prio] = t->rq_next;
+    }
+    if (t->rq_next) {
+        t->rq_next->rq_prev = t->rq_prev;
+    } else {
+        rq->tail[prio] = t->rq_prev;
+    }
+    t->rq_next = NULL;
+    t->rq_prev = NULL;
+    if (!rq->head[prio]) rq->bitmap &= ~(1u << prio);
+    rq->nr_ready--;
+}
+
+// Highest non-empty priority level, -1 if nothing is ready
+static inline int rq_top_priority(run_queue_t *rq) {
+    if (!rq->bitmap) return -1;
+    return 31 - __builtin_clz(rq->bitmap);
+}
+
+// Head of the highest non-empty level, left on its queue
+static thread_t *rq_peek(run_queue_t *rq) {
+    int prio = rq_top_priority(rq);
+    return prio < 0 ? NULL : rq->head[prio];
+}
+
+// Move one ready thread from a victim's queue to this CPU's if the victim
+// still has at least min_ready waiting. Both queues stay locked (lower CPU
+// first) for the whole move, so the thread is on exactly one of them and
+// t->cpu always names it. The victim is only trylocked: a thief backs off
+// rather than queue up behind its owner. The tail of the top level goes:
+// it was queued last, so it is the coldest in the victim's cache.
+static bool steal_from(u32 victim, u32 cpu, u32 min_ready) {
+    run_queue_t *from = &run_queues[victim];
+    run_queue_t *to = &run_queues[cpu];
+    if (__atomic_load_n(&from->nr_ready, __ATOMIC_RELAXED) < min_ready) return false;
+    
+    if (victim < cpu) {
+        if (!spin_trylock(&from->lock)) return false;
+        spin_lock(&to->lock);
+    } else {
+        spin_lock(&to->lock);
+        if (!spin_trylock(&from->lock)) {
+            spin_unlock(&to->lock);
+            return false;
+        }
+    }
+    
+    bool moved = false;
+    if (from->nr_ready >= min_ready) {
+        thread_t *t = from->tail[rq_top_priority(from)];
+        rq_dequeue(from, t);
+        __atomic_store_n(&t->cpu, cpu, __ATOMIC_RELEASE);
+        rq_enqueue(to, t);
+        moved = true;
+    }
+    spin_unlock(&from->lock);
+    spin_unlock(&to->lock);
+    return moved;
+}
+
+// Move one thread to this CPU's queue from the busiest queue with at least
+// min_ready waiting, looking at the nearest CPUs first: shared LLC, then
+// same package, then anywhere
+static bool pull_thread(u32 cpu, u32 min_ready) {
+    for (u32 dist = SMP_DIST_LLC; dist <= SMP_DIST_REMOTE; dist++) {
+        u32 victim = cpu;
+        u32 most = 0;
+        for (u32 other = 0; other < smp_cpu_count(); other++) {
+            if (!smp_cpu_online(other) || smp_cpu_distance(cpu, other) != dist) continue;
+    
+            u32 ready = __atomic_load_n(&run_queues[other].nr_ready, __ATOMIC_RELAXED);
+            if (ready >= min_ready && ready > most) {
+                victim = other;
+                most = ready;
+            }
+        }
+        if (victim == cpu) continue;
+    
+        if (steal_from(victim, cpu, min_ready)) return true;
+    }
+    return false;
+}
+
+// Periodic balancing: pull a thread if some queue is SCHED_IMBALANCE
+// longer than this CPU's load
+static void sched_balance(u32 cpu) {
+    run_queue_t *rq = &run_queues[cpu];
+    u32 load = rq->nr_ready + (rq->current ? 1 : 0);
+    pull_thread(cpu, load + SCHED_IMBALANCE);
+}
+
+// Work was queued on cpu: wake it if it is idle, otherwise wake the
+// nearest idle CPU so it can steal
+static void kick_idle(u32 cpu) {
+    // Pairs with cpu_idle: either it sees the new work or we see it idle.
+    // An idle CPU queueing for itself is on its way out of the halt.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (run_queues[cpu].idle) {
+        if (cpu != smp_cpu_id()) smp_send_resched(cpu);
+        return;
+    }
+    for (u32 dist = SMP_DIST_LLC; dist <= SMP_DIST_REMOTE; dist++) {
+        for (u32 other = 0; other < smp_cpu_count(); other++) {
+            if (run_queues[other].idle && smp_cpu_distance(cpu, other) == dist) {
+                smp_send_resched(other);
+                return;
+            }
+        }
+    }
+}
+
+// Nothing to run here or nearby: stop the tick and halt until an interrupt
+// wakes the CPU. The queue is checked with interrupts off, and STI;HLT
+// takes no interrupt in between, so a wakeup IPI cannot be missed.
+static void cpu_idle(run_queue_t *rq) {
+    __asm__ volatile("cli");
+    __atomic_store_n(&rq->idle, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rq->nr_ready, __ATOMIC_SEQ_CST) == 0) {
+        tick_stop();
+        __asm__ volatile("sti; hlt; cli" : : : "memory");
+        tick_start();
+    }
+    rq->idle = false;
+    __asm__ volatile("sti");
+}
+
+// Least loaded online CPU, for placing new threads
+static u32 pick_cpu(void) {
+    u32 best = 0;
+    u32 best_load = 0xFFFFFFFF;
+    for (u32 cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (!smp_cpu_online(cpu)) continue;
+    
+        run_queue_t *rq = &run_queues[cpu];
+        u32 load = rq->nr_ready + (rq->current ? 1 : 0);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
 
 // Initialize the enhanced threading system
 void sched_init(void) {
     serial_puts("[SCHED] Initializing enhanced scheduler\r\n");
     
     // Initialize scheduler state
-    current_thread = NULL;
+    thread_table_lock.locked = 0;
     next_tid = 1;
     active_thread_count = 0;
-    scheduler_ticks = 0;
     scheduler_enabled = false;
     
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        run_queue_t *rq = &run_queues[cpu];
+        rq->lock.locked = 0;
+        for (int i = 0; i < SCHED_PRIO_LEVELS; i++) {
+            rq->head[i] = NULL;
+            rq->tail[i] = NULL;
+        }
+        rq->bitmap = 0;
+        rq->nr_ready = 0;
+        rq->current = NULL;
+        rq->preempt_count = 0;
+        rq->need_resched = false;
+        rq->balance_due = false;
+        rq->idle = false;
+        rq->ticks = 0;
+    }
+    
     // Clear thread table
     for (int i = 0; i < MAX_THREADS; i++) {
         thread_table[i].tid = 0;
@@ -80,6 +358,11 @@ void sched_init(void) {
         thread_table[i].stack_top = NULL;
         thread_table[i].time_slice = 0;
         thread_table[i].total_runtime = 0;
+        thread_table[i].rq_next = NULL;
+        thread_table[i].rq_prev = NULL;
+        thread_table[i].cpu = 0;
+        thread_table[i].fpu.area = NULL;
+        thread_table[i].fpu.alloc = NULL;
         
         // Clear name
         for (int j = 0; j < 32; j++) {
@@ -93,55 +376,199 @@ void sched_init(void) {
 
 // Get current thread (stub)
 thread_t *sched_current_thread(void) {
-    return current_thread;
+    return this_rq()->current;
+}
+
+// FPU state of the running thread, NULL outside threads
+fpu_t *sched_current_fpu(void) {
+    thread_t *t = this_rq()->current;
+    return t ? &t->fpu : NULL;
+}
+
+// Switch this CPU to the best ready thread. Called with rq->lock held,
+// returns with it released once the calling context is picked again. A
+// current thread that is still RUNNING goes back on the queue; one that
+// blocked or exited does not. With nothing to run the CPU drops back to
+// its scheduler loop.
+static void schedule_locked(run_queue_t *rq) {
+    thread_t *prev = rq->current;
+    thread_t *next = rq_peek(rq);
+    bool runnable = prev && prev->state == THREAD_STATE_RUNNING;
+    rq->need_resched = false;
+    
+    // A runnable current thread only gives way to threads of the same or
+    // higher priority
+    if (runnable && (!next || next->priority < prev->priority)) {
+        prev->time_slice = DEFAULT_TIME_SLICE;
+        spin_unlock(&rq->lock);
+        return;
+    }
+    if (!prev && !next) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+    
+    if (next) {
+        rq_dequeue(rq, next);
+        next->state = THREAD_STATE_RUNNING;
+        next->time_slice = DEFAULT_TIME_SLICE;
+    }
+    if (runnable) {
+        prev->state = THREAD_STATE_READY;
+        rq_enqueue(rq, prev);
+    }
+    rq->current = next;
+    
+    // The switch keeps only callee-saved registers: interrupts go off
+    // around it and each side restores its own flags once it runs again
+    u64 flags = irq_save();
+    fpu_switch(prev ? &prev->fpu : NULL, next ? &next->fpu : NULL);
+    context_switch(prev ? &prev->context : &rq->idle_context,
+                   next ? &next->context : &rq->idle_context);
+    
+    // Running again, possibly on another CPU: finish the switch that
+    // brought us here
+    spin_unlock(&this_rq()->lock);
+    irq_restore(flags);
 }
 
 // Enhanced yield function with context switching
 void sched_yield(void) {
-    if (!scheduler_enabled || !current_thread) {
-        return; // No-op if scheduler not ready
-    }
+    // Memory-management housekeeping is not SMP- or preemption-safe: boot
+    // CPU only, with preemption off
+    preempt_disable();
+    if (smp_cpu_id() == 0) {
+        // Install any pages pushed by a post-copy migration source
+        postcopy_poll();
     
-    // Find next thread to run
-    thread_t *next = find_next_thread();
-    if (!next || next == current_thread) {
-        return; // No other thread to switch to
+        // Free the memory of exited processes
+        user_as_reap();
+    
+        // Free the stacks of finished threads
+        cleanup_zombie_threads();
     }
+    preempt_enable();
     
-    // Perform context switch (this would use assembly context switching)
-    // For now, implement cooperative switching
-    thread_t *old_thread = current_thread;
-    current_thread = next;
-    next->state = THREAD_STATE_RUNNING;
-    old_thread->state = THREAD_STATE_READY;
+    if (!scheduler_enabled || !this_rq()->current) {
+        return; // No-op if scheduler not ready
+    }
     
-    serial_puts("[SCHED] Context switch to: ");
-    serial_puts(next->name);
-    serial_puts("\r\n");
+    schedule_locked(lock_this_rq());
 }
 
-// Enhanced tick function with preemptive scheduling
+// Scheduler tick, from the timer interrupt: accounting and flags only,
+// the switch itself is left to sched_preempt on the way out
 void sched_tick(void) {
     if (!scheduler_enabled) return;
     
-    scheduler_ticks++;
+    run_queue_t *rq = this_rq();
+    rq->ticks++;
     
     // Update current thread's runtime
+    thread_t *current_thread = rq->current;
     if (current_thread) {
         current_thread->total_runtime++;
-        current_thread->time_slice--;
+        if (current_thread->time_slice > 0) current_thread->time_slice--;
         
-        // Check if time slice expired
-        if (current_thread->time_slice <= 0) {
-            current_thread->time_slice = DEFAULT_TIME_SLICE;
-            sched_yield(); // Force context switch
+        // Time slice expired: switch at the next preemption point
+        if (current_thread->time_slice == 0) {
+            rq->need_resched = true;
         }
     }
     
-    // Periodic cleanup of zombie threads
-    if (scheduler_ticks % 100 == 0) {
-        cleanup_zombie_threads();
+    if (rq->ticks % SCHED_BALANCE_TICKS == 0) {
+        rq->balance_due = true;
+    }
+}
+
+// Preemption point on interrupt and syscall exit, with interrupts off and
+// on the interrupted thread's stack. Runs expired timers, then switches
+// away if the tick (or a wakeup) asked for it, unless the interrupted code
+// is inside a critical section.
+void sched_preempt(void) {
+    run_queue_t *rq = this_rq();
+    if (rq->preempt_count) return;
+    
+    // Timer callbacks may take locks, which is only safe out here
+    ktimer_run_expired();
+    if (!rq->current) return;
+    
+    if (rq->balance_due) {
+        rq->balance_due = false;
+        sched_balance(smp_cpu_id());
+    }
+    if (!rq->need_resched) return;
+    
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+}
+
+// Make a blocked thread runnable again, on the queue of the CPU it last
+// ran on. Nothing happens if it is not blocked.
+void sched_wake(thread_t *t) {
+    run_queue_t *rq = lock_thread_rq(t);
+    bool woken = t->state == THREAD_STATE_BLOCKED;
+    if (woken) {
+        t->state = THREAD_STATE_READY;
+        rq_enqueue(rq, t);
     }
+    u32 cpu = t->cpu;
+    spin_unlock(&rq->lock);
+    
+    if (woken) kick_idle(cpu);
+}
+
+// Block the calling thread until sched_wake. lock, held by the caller, is
+// released only after the thread is marked BLOCKED with its queue locked:
+// a waker that takes lock after us finds it blocked, and sched_wake waits
+// for the switch away to complete.
+void sched_block(spinlock_t *lock) {
+    thread_t *t = sched_current_thread();
+    run_queue_t *rq = lock_this_rq();
+    t->state = THREAD_STATE_BLOCKED;
+    spin_unlock(lock);
+    schedule_locked(rq);
+}
+
+static void sleep_timeout(void *arg) {
+    sched_wake((thread_t *)arg);
+}
+
+// Block the calling thread for at least ms milliseconds. Outside threads
+// (kmain, and user mode entered from it) there is nothing to switch to:
+// wait on the clock, halting between interrupts when they are enabled.
+void sched_sleep_ms(u64 ms) {
+    thread_t *t = sched_current_thread();
+    if (!scheduler_enabled || !t) {
+        u64 end = get_system_time_ms() + ms;
+        while (get_system_time_ms() < end) {
+            u64 flags;
+            __asm__ volatile("pushfq; popq %0" : "=r"(flags));
+            if (flags & (1u << 9)) {
+                __asm__ volatile("hlt");
+            } else {
+                __asm__ volatile("pause");
+            }
+        }
+        return;
+    }
+    
+    // The timer goes on this CPU's wheel, which runs nothing while the
+    // queue is locked: it cannot fire before the switch away is complete
+    ktimer_t timer;
+    ktimer_init(&timer, sleep_timeout, t);
+    run_queue_t *rq = lock_this_rq();
+    t->state = THREAD_STATE_BLOCKED;
+    ktimer_add(&timer, ms);
+    schedule_locked(rq);
+}
+
+// Give back a slot claimed by thread_create
+static void release_slot(int slot) {
+    spin_lock(&thread_table_lock);
+    thread_table[slot].tid = 0;
+    thread_table[slot].state = THREAD_STATE_ZOMBIE;
+    spin_unlock(&thread_table_lock);
 }
 
 // Create an enhanced kernel thread with proper context setup
@@ -152,14 +579,20 @@ u32 thread_create(void (*entry_point)(void *), void *arg, const char *name) {
     if (name) serial_puts(name);
     serial_puts("\r\n");
     
-    // Find free slot
+    // Find a free slot and claim it with its TID: threads on any CPU may
+    // create threads. BLOCKED keeps the zombie reaper off it until it is
+    // queued.
     int slot = -1;
+    spin_lock(&thread_table_lock);
     for (int i = 0; i < MAX_THREADS; i++) {
         if (thread_table[i].tid == 0) {
             slot = i;
+            thread_table[i].tid = next_tid++;
+            thread_table[i].state = THREAD_STATE_BLOCKED;
             break;
         }
     }
+    spin_unlock(&thread_table_lock);
     
     if (slot == -1) {
         serial_puts("[SCHED] No free thread slots available\r\n");
@@ -170,6 +603,15 @@ u32 thread_create(void (*entry_point)(void *), void *arg, const char *name) {
     void *stack_base = kmalloc(THREAD_STACK_SIZE);
     if (!stack_base) {
         serial_puts("[SCHED] Failed to allocate thread stack\r\n");
+        release_slot(slot);
+        return 0;
+    }
+    
+    // FPU save area, sized for this CPU's XSAVE features
+    if (!fpu_alloc(&thread_table[slot].fpu)) {
+        serial_puts("[SCHED] Failed to allocate FPU state\r\n");
+        kfree(stack_base);
+        release_slot(slot);
         return 0;
     }
     
@@ -177,9 +619,8 @@ u32 thread_create(void (*entry_point)(void *), void *arg, const char *name) {
     void *stack_top = (u8*)stack_base + THREAD_STACK_SIZE;
     
     // Initialize thread structure
-    thread_table[slot].tid = next_tid++;
     thread_table[slot].state = THREAD_STATE_READY;
-    thread_table[slot].priority = 1;
+    thread_table[slot].priority = THREAD_PRIORITY_NORMAL;
     thread_table[slot].entry_point = entry_point;
     thread_table[slot].arg = arg;
     thread_table[slot].stack_base = stack_base;
@@ -195,31 +636,30 @@ u32 thread_create(void (*entry_point)(void *), void *arg, const char *name) {
         }
     }
     
-    // Initialize context for first run
-    // Set stack pointer to top of stack (16-byte aligned)
+    // Initialize context for first run: the stack of a suspended
+    // context_switch (six callee-saved registers, RBX = the thread) that
+    // returns into thread_entry with the stack 16-byte aligned
     u64 aligned_stack = ((u64)stack_top - 16) & ~0xF;
-    thread_table[slot].context.rsp = aligned_stack;
-    thread_table[slot].context.rbp = aligned_stack;
-    thread_table[slot].context.rip = (u64)thread_wrapper;
-    thread_table[slot].context.rflags = 0x202; // Enable interrupts
-    
-    // Clear other registers
-    thread_table[slot].context.rax = 0;
-    thread_table[slot].context.rbx = 0;
-    thread_table[slot].context.rcx = 0;
-    thread_table[slot].context.rdx = 0;
-    thread_table[slot].context.rsi = 0;
-    thread_table[slot].context.rdi = 0;
-    thread_table[slot].context.r8 = 0;
-    thread_table[slot].context.r9 = 0;
-    thread_table[slot].context.r10 = 0;
-    thread_table[slot].context.r11 = 0;
-    thread_table[slot].context.r12 = 0;
-    thread_table[slot].context.r13 = 0;
-    thread_table[slot].context.r14 = 0;
-    thread_table[slot].context.r15 = 0;
-    
-    active_thread_count++;
+    u64 *frame = (u64 *)(aligned_stack - 7 * sizeof(u64));
+    frame[0] = 0;                           // R15
+    frame[1] = 0;                           // R14
+    frame[2] = 0;                           // R13
+    frame[3] = 0;                           // R12
+    frame[4] = (u64)&thread_table[slot];    // RBX
+    frame[5] = 0;                           // RBP
+    frame[6] = (u64)thread_entry;           // Return address
+    thread_table[slot].context.rsp = (u64)frame;
+    
+    __atomic_fetch_add(&active_thread_count, 1, __ATOMIC_RELAXED);
+    
+    // Spread threads over the CPUs
+    u32 cpu = pick_cpu();
+    run_queue_t *rq = &run_queues[cpu];
+    thread_table[slot].cpu = cpu;
+    spin_lock(&rq->lock);
+    rq_enqueue(rq, &thread_table[slot]);
+    spin_unlock(&rq->lock);
+    kick_idle(cpu);
     
     serial_puts("[SCHED] Thread created with TID: ");
     serial_puts("\r\n");
@@ -227,113 +667,172 @@ u32 thread_create(void (*entry_point)(void *), void *arg, const char *name) {
     return thread_table[slot].tid;
 }
 
-// Start the enhanced scheduler 
+// Background memory scans: low-overhead accessed-bit sampling, huge page
+// collapse and same-page merging, one budgeted step each per tick. A timer
+// runs them because it fires whether or not a thread is current on the
+// boot CPU (the user process runs outside the scheduler). It is re-armed
+// after each step, so ticks missed while callbacks could not run are
+// dropped rather than replayed in a burst. The scanners rewrite user PTEs
+// and flush only the local TLB: they have to stay on the boot CPU, the only
+// one that loads user page tables, and there syscalls and faults run with
+// interrupts off, so a callback never lands in the middle of one.
+static void mm_scan_fn(void *arg) {
+    (void)arg;
+    wss_tick();
+    thp_tick();
+    ksm_tick();
+    ktimer_add(&mm_scan_timer, MM_SCAN_PERIOD_MS);
+}
+
+// Start the enhanced scheduler: ticks on the boot CPU now preempt threads
+// whose time slice ran out
 void sched_start(void) {
     serial_puts("[SCHED] Starting enhanced scheduler\r\n");
     
     scheduler_enabled = true;
-    
-    // Find the first ready thread and start executing
-    thread_t *first_thread = find_next_thread();
-    if (first_thread) {
-        current_thread = first_thread;
-        first_thread->state = THREAD_STATE_RUNNING;
-        
-        serial_puts("[SCHED] Starting first thread: ");
-        serial_puts(first_thread->name);
-        serial_puts("\r\n");
-    } else {
-        serial_puts("[SCHED] No threads ready to run\r\n");
-    }
+    ktimer_init(&mm_scan_timer, mm_scan_fn, NULL);
+    ktimer_add(&mm_scan_timer, MM_SCAN_PERIOD_MS);
+    __asm__ volatile("sti");
 }
 
-// Run threads cooperatively (backward compatibility)
+// Run threads until all of them have finished
 void sched_run_threads(void) {
-    serial_puts("[SCHED] Running threads in compatibility mode\r\n");
+    serial_puts("[SCHED] Running threads\r\n");
     
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (thread_table[i].tid != 0 && thread_table[i].state == THREAD_STATE_READY) {
-            serial_puts("[SCHED] Executing thread: ");
-            serial_puts(thread_table[i].name);
-            serial_puts("\r\n");
-            
-            // Simple direct execution (no context switching)
-            current_thread = &thread_table[i];
-            thread_table[i].state = THREAD_STATE_RUNNING;
-            thread_table[i].entry_point(thread_table[i].arg);
-            thread_table[i].state = THREAD_STATE_ZOMBIE;
-            current_thread = NULL;
+    // This CPU's queue, highest priority first, FIFO within a level
+    run_queue_t *rq = this_rq();
+    while (run_one_thread(rq)) {
+    }
+    
+    // Threads placed on other CPUs run there; help out by stealing while
+    // waiting for them to finish. Sleepers woken here come back to this
+    // queue.
+    u32 self = smp_cpu_id();
+    while (__atomic_load_n(&active_thread_count, __ATOMIC_ACQUIRE) > 0) {
+        if (run_one_thread(rq)) continue;
+        if (!pull_thread(self, 1)) {
+            __asm__ volatile("pause");
         }
     }
     
+    preempt_disable();
+    cleanup_zombie_threads();
+    preempt_enable();
+    
     serial_puts("[SCHED] All threads completed\r\n");
 }
 
-// Thread wrapper function - called when thread starts
-static void thread_wrapper(void) {
-    if (current_thread && current_thread->entry_point) {
-        // Call the actual thread function
-        current_thread->entry_point(current_thread->arg);
-        
-        // Thread finished - mark as zombie
-        current_thread->state = THREAD_STATE_ZOMBIE;
-        active_thread_count--;
-        
-        serial_puts("[SCHED] Thread finished: ");
-        serial_puts(current_thread->name);
-        serial_puts("\r\n");
-        
-        // Yield to next thread
-        sched_yield();
+// Switch from the scheduler loop into the threads on a run queue; returns
+// once none of them is runnable any more
+static bool run_one_thread(run_queue_t *rq) {
+    spin_lock(&rq->lock);
+    thread_t *t = rq_peek(rq);
+    if (!t) {
+        spin_unlock(&rq->lock);
+        return false;
     }
     
-    // Should not reach here, but if we do, hang
-    while (1) {
-        __asm__ volatile("hlt");
-    }
+    serial_puts("[SCHED] Executing thread: ");
+    serial_puts(t->name);
+    serial_puts("\r\n");
+    
+    schedule_locked(rq);
+    return true;
 }
 
-// Find next ready thread (round-robin scheduling)
-static thread_t *find_next_thread(void) {
-    if (active_thread_count == 0) return NULL;
+// Application processors end up here once they are initialized: run the
+// threads placed on this CPU's queue, halting while there is nothing to do
+void NORETURN sched_ap_main(u32 cpu) {
+    run_queue_t *rq = &run_queues[cpu];
+    u32 runs = 0;
     
-    // Start searching from current thread + 1
-    int start_idx = 0;
-    if (current_thread) {
-        for (int i = 0; i < MAX_THREADS; i++) {
-            if (&thread_table[i] == current_thread) {
-                start_idx = (i + 1) % MAX_THREADS;
-                break;
+    // Ticks from here on: the threads run below are preemptible
+    __asm__ volatile("sti");
+    for (;;) {
+        if (run_one_thread(rq)) {
+            if (++runs % SCHED_BALANCE_RUNS == 0) {
+                sched_balance(cpu);
             }
+            continue;
+        }
+    
+        // Idle: steal from the busiest queue nearby, or sleep
+        if (!pull_thread(cpu, 1)) {
+            cpu_idle(rq);
         }
     }
+}
+
+// First code run by a new thread, on its own stack (called from
+// thread_entry): finish the switch, run the thread function, then leave
+// the CPU for good
+void NORETURN thread_wrapper(thread_t *current_thread) {
+    spin_unlock(&this_rq()->lock);
+    __asm__ volatile("sti");
+    
+    // Call the actual thread function
+    current_thread->entry_point(current_thread->arg);
+    
+    serial_puts("[SCHED] Thread finished: ");
+    serial_puts(current_thread->name);
+    serial_puts("\r\n");
+    
+    // Thread finished - mark as zombie. This happens under the queue lock,
+    // and the stack stays in use until the switch below is complete: a
+    // zombie's stack may only be freed by someone who took that lock after.
+    run_queue_t *rq = lock_this_rq();
+    current_thread->state = THREAD_STATE_ZOMBIE;
+    __atomic_fetch_sub(&active_thread_count, 1, __ATOMIC_RELEASE);
+    schedule_locked(rq);
+    
+    // Should not reach here, but if we do, hang
+    while (1) {
+        __asm__ volatile("hlt");
+    }
+}
+
+// Change a thread's priority; a ready thread moves to the new level's queue
+bool sched_set_priority(u32 tid, u8 priority) {
+    if (tid == 0 || priority >= SCHED_PRIO_LEVELS) return false;
     
-    // Look for next ready thread
     for (int i = 0; i < MAX_THREADS; i++) {
-        int idx = (start_idx + i) % MAX_THREADS;
-        if (thread_table[idx].tid != 0 && thread_table[idx].state == THREAD_STATE_READY) {
-            return &thread_table[idx];
+        thread_t *t = &thread_table[i];
+        if (t->tid != tid) continue;
+    
+        run_queue_t *rq = lock_thread_rq(t);
+        if (t->state == THREAD_STATE_READY && t != rq->current) {
+            rq_dequeue(rq, t);
+            t->priority = priority;
+            rq_enqueue(rq, t);
+        } else {
+            t->priority = priority;
         }
+        spin_unlock(&rq->lock);
+        return true;
     }
-    
-    return NULL;
+    return false;
 }
 
-// Clean up finished threads
+// Clean up finished threads (not SMP-safe: kfree)
 static void cleanup_zombie_threads(void) {
     for (int i = 0; i < MAX_THREADS; i++) {
         if (thread_table[i].state == THREAD_STATE_ZOMBIE && thread_table[i].tid != 0) {
+            // Wait for the thread's last switch away from its stack
+            run_queue_t *rq = &run_queues[thread_table[i].cpu];
+            spin_lock(&rq->lock);
+            spin_unlock(&rq->lock);
+            
             // Free the stack
             if (thread_table[i].stack_base) {
                 kfree(thread_table[i].stack_base);
             }
+            fpu_free(&thread_table[i].fpu);
             
-            // Clear thread entry
-            thread_table[i].tid = 0;
-            thread_table[i].state = THREAD_STATE_ZOMBIE;
+            // Clear thread entry; the slot is free once tid is 0
             thread_table[i].entry_point = NULL;
             thread_table[i].stack_base = NULL;
             thread_table[i].stack_top = NULL;
+            release_slot(i);
         }
     }
 }
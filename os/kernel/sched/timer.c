@@ -3,20 +3,320 @@
 
 static volatile u64 system_tick_count = 0;
 
+// The tick runs on the one-shot clock event device: each tick programs the
+// next one, so a CPU with nothing to do can simply stop it (tickless idle)
+// instead of taking TICK_MS interrupts for nothing. Deadlines advance by
+// the period rather than from "now", so handler latency does not drift.
+#define TICK_MS 1
+
+static u64 next_tick[SMP_MAX_CPUS];         // TSC deadline, 0 while stopped
+
+// Timer wheel
+//
+// Each CPU has its own hierarchical wheel. Level 0 has one slot per
+// millisecond for the next 256 ms; each level above has 64 slots, each
+// covering a whole revolution of the level below. Arming or cancelling a
+// timer is a list insert or unlink. Whenever the wheel's clock crosses a
+// level-0 revolution, the next slot of level 1 is cascaded: its timers are
+// filed again, now into level 0 (and likewise up the levels). Bitmaps of
+// the occupied slots let the clock jump over empty stretches, and an idle
+// CPU arms its clock event only for the first slot that needs attention,
+// so sleeping timers cost nothing until they are due.
+#define WHEEL_L0_BITS   8
+#define WHEEL_LN_BITS   6
+#define WHEEL_L0_SIZE   (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SIZE   (1 << WHEEL_LN_BITS)
+#define WHEEL_LEVELS    4           // 2^26 ms (~18 hours) ahead
+#define WHEEL_SPAN      (1ULL << (WHEEL_L0_BITS + (WHEEL_LEVELS - 1) * WHEEL_LN_BITS))
+
+typedef struct {
+    spinlock_t lock;
+    u64 clk;                                    // Next millisecond to process
+    u32 pending;
+    ktimer_t *volatile running;                 // Callback in progress
+    u64 l0_map[WHEEL_L0_SIZE / 64];             // Occupied slots
+    u64 ln_map[WHEEL_LEVELS - 1];
+    ktimer_t *l0[WHEEL_L0_SIZE];
+    ktimer_t *ln[WHEEL_LEVELS - 1][WHEEL_LN_SIZE];
+} timer_base_t;
+
+static timer_base_t timer_bases[SMP_MAX_CPUS];
+
+static inline u64 now_ms(void) {
+    return ktime_get_ns() / 1000000;
+}
+
+// Arm the calling CPU's tick, one period from now
+void tick_start(void) {
+    u32 cpu = smp_cpu_id();
+    next_tick[cpu] = rdtsc() + tsc_khz() * TICK_MS;
+    clockevent_program(next_tick[cpu]);
+}
+
+// Stop the calling CPU's tick. The clock event stays armed for the first
+// pending timer, if any; otherwise the next interrupt is whatever else
+// wakes the CPU.
+void tick_stop(void) {
+    next_tick[smp_cpu_id()] = 0;
+    u64 next = ktimer_next_expiry();
+    if (next == KTIMER_NONE) {
+        clockevent_stop();
+    } else {
+        clockevent_program(ktime_to_tsc(next * 1000000));
+    }
+}
+
+// Called from the timer interrupt on every CPU with interrupts off
 void timer_tick_handler(void) {
-    system_tick_count++;
+    u32 cpu = smp_cpu_id();
+    if (!next_tick[cpu]) return;  // Stale deadline after tick_stop
+    
+    // Program only the next deadline; skip ticks missed in between
+    u64 period = tsc_khz() * TICK_MS;
+    u64 now = rdtsc();
+    next_tick[cpu] += period;
+    if (next_tick[cpu] <= now) next_tick[cpu] = now + period;
+    clockevent_program(next_tick[cpu]);
     
-    // Temporarily disable scheduler tick to isolate memory management issues
-    // sched_tick();
+    // Every CPU ticks; the clock only follows the boot CPU
+    if (cpu == 0) system_tick_count++;
     
-    // TODO: Add timeout handling and other timer services
+    // Time slice accounting; the switch itself and expired timers wait for
+    // the interrupt exit
+    sched_tick();
 }
 
 u64 get_system_ticks(void) {
     return system_tick_count;
 }
 
-// Convert ticks to milliseconds (1 tick = 1ms)
+// Milliseconds since boot, from the TSC clocksource
 u64 get_system_time_ms(void) {
-    return system_tick_count;
+    return ktime_get_ns() / 1000000;
+}
+
+// File a timer by how far ahead of the wheel's clock it expires. Timers
+// already due go in the slot processed next; those beyond the wheel's span
+// wait in the last level and are filed again when it cascades.
+static void wheel_insert(timer_base_t *base, ktimer_t *t) {
+    u64 expires = t->expires;
+    if (expires < base->clk) expires = base->clk;
+    if (expires - base->clk >= WHEEL_SPAN) expires = base->clk + WHEEL_SPAN - 1;
+    u64 delta = expires - base->clk;
+    
+    ktimer_t **slot;
+    if (delta < WHEEL_L0_SIZE) {
+        u32 idx = expires & (WHEEL_L0_SIZE - 1);
+        slot = &base->l0[idx];
+        base->l0_map[idx / 64] |= 1ULL << (idx % 64);
+    } else {
+        u32 level = 0;
+        u32 shift = WHEEL_L0_BITS;
+        while (delta >= 1ULL << (shift + WHEEL_LN_BITS)) {
+            level++;
+            shift += WHEEL_LN_BITS;
+        }
+        u32 idx = (expires >> shift) & (WHEEL_LN_SIZE - 1);
+        slot = &base->ln[level][idx];
+        base->ln_map[level] |= 1ULL << idx;
+    }
+    
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot) (*slot)->prev = t;
+    *slot = t;
+    t->slot = slot;
+}
+
+static void wheel_unlink(timer_base_t *base, ktimer_t *t) {
+    ktimer_t **slot = t->slot;
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        *slot = t->next;
+    }
+    if (t->next) t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+    t->slot = NULL;
+    if (*slot) return;
+    
+    // Slot now empty: clear its bit
+    if (slot >= base->l0 && slot < base->l0 + WHEEL_L0_SIZE) {
+        u32 idx = slot - base->l0;
+        base->l0_map[idx / 64] &= ~(1ULL << (idx % 64));
+    } else {
+        u32 n = slot - &base->ln[0][0];
+        base->ln_map[n / WHEEL_LN_SIZE] &= ~(1ULL << (n % WHEEL_LN_SIZE));
+    }
+}
+
+// First occupied level-0 slot at or after from, -1 if none
+static int wheel_l0_next(timer_base_t *base, u32 from) {
+    for (u32 w = from / 64; w < WHEEL_L0_SIZE / 64; w++) {
+        u64 bits = base->l0_map[w];
+        if (w == from / 64) bits &= ~0ULL << (from % 64);
+        if (bits) return w * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+// Level 0 wrapped: refile the level-1 slot now coming up, and the slots of
+// the higher levels whenever the one below wrapped too
+static void wheel_cascade(timer_base_t *base) {
+    u32 shift = WHEEL_L0_BITS;
+    for (u32 level = 0; level < WHEEL_LEVELS - 1; level++) {
+        u32 idx = (base->clk >> shift) & (WHEEL_LN_SIZE - 1);
+        ktimer_t *t = base->ln[level][idx];
+        base->ln[level][idx] = NULL;
+        base->ln_map[level] &= ~(1ULL << idx);
+        while (t) {
+            ktimer_t *next = t->next;
+            wheel_insert(base, t);
+            t = next;
+        }
+        if (idx) break;
+        shift += WHEEL_LN_BITS;
+    }
+}
+
+void ktimer_init(ktimer_t *t, void (*fn)(void *arg), void *arg) {
+    t->next = NULL;
+    t->prev = NULL;
+    t->slot = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->cpu = 0;
+    t->pending = false;
+}
+
+// Arm a timer on the calling CPU, delay_ms from now. A pending timer is
+// cancelled first.
+void ktimer_add(ktimer_t *t, u64 delay_ms) {
+    ktimer_cancel(t);
+    
+    u32 cpu = smp_cpu_id();
+    timer_base_t *base = &timer_bases[cpu];
+    u64 now = now_ms();
+    spin_lock(&base->lock);
+    
+    // An empty wheel's clock may be left behind; it has nothing to catch up
+    if (!base->pending && base->clk < now) base->clk = now;
+    
+    t->expires = now + delay_ms;
+    t->cpu = cpu;
+    t->pending = true;
+    wheel_insert(base, t);
+    base->pending++;
+    spin_unlock(&base->lock);
+}
+
+// Disarm a timer. False if it was not pending: never armed, cancelled, or
+// expired. An expired timer's callback has finished by the time this
+// returns (unless it is the caller), so the timer may then be freed.
+bool ktimer_cancel(ktimer_t *t) {
+    timer_base_t *base = &timer_bases[t->cpu];
+    if (!t->pending && base->running != t) return false;
+    
+    spin_lock(&base->lock);
+    bool was_pending = t->pending;
+    if (was_pending) {
+        wheel_unlink(base, t);
+        t->pending = false;
+        base->pending--;
+    }
+    spin_unlock(&base->lock);
+    
+    if (t->cpu != smp_cpu_id()) {
+        while (base->running == t) {
+            __asm__ volatile("pause");
+        }
+    }
+    return was_pending;
+}
+
+// Run the calling CPU's expired timers, advancing its wheel to now. From
+// sched_preempt, outside any critical section: each callback runs with the
+// wheel unlocked.
+void ktimer_run_expired(void) {
+    timer_base_t *base = &timer_bases[smp_cpu_id()];
+    u64 now = now_ms();
+    if (base->clk > now) return;
+    
+    spin_lock(&base->lock);
+    while (base->clk <= now) {
+        if (!base->pending) {
+            base->clk = now + 1;
+            break;
+        }
+    
+        u32 idx = base->clk & (WHEEL_L0_SIZE - 1);
+        if (idx == 0) wheel_cascade(base);
+    
+        // Jump to the next occupied slot, stopping at the next cascade
+        int next = wheel_l0_next(base, idx);
+        if (next != (int)idx) {
+            u64 to = next < 0 ? (base->clk | (WHEEL_L0_SIZE - 1)) + 1 : base->clk - idx + next;
+            base->clk = to < now + 1 ? to : now + 1;
+            continue;
+        }
+    
+        ktimer_t *t;
+        while ((t = base->l0[idx])) {
+            void (*fn)(void *) = t->fn;
+            void *arg = t->arg;
+    
+            // Running before no longer pending: ktimer_cancel looks at both
+            // without the lock and must never see neither
+            base->running = t;
+            wheel_unlink(base, t);
+            t->pending = false;
+            base->pending--;
+    
+            spin_unlock(&base->lock);
+            fn(arg);
+            spin_lock(&base->lock);
+            base->running = NULL;
+        }
+        base->clk++;
+    }
+    spin_unlock(&base->lock);
+}
+
+// Earliest millisecond at which the calling CPU's wheel needs attention,
+// KTIMER_NONE if it is empty. Level 0 gives exact expiry times; for the
+// levels above, the time their next occupied slot cascades.
+u64 ktimer_next_expiry(void) {
+    timer_base_t *base = &timer_bases[smp_cpu_id()];
+    u64 best = KTIMER_NONE;
+    
+    spin_lock(&base->lock);
+    if (base->pending) {
+        u32 idx = base->clk & (WHEEL_L0_SIZE - 1);
+        int next = wheel_l0_next(base, idx);
+        if (next >= 0) {
+            best = base->clk - idx + next;
+        } else {
+            // Slots behind the clock belong to the next revolution
+            next = wheel_l0_next(base, 0);
+            if (next >= 0) best = base->clk - idx + WHEEL_L0_SIZE + next;
+    
+            u32 shift = WHEEL_L0_BITS;
+            for (u32 level = 0; level < WHEEL_LEVELS - 1; level++, shift += WHEEL_LN_BITS) {
+                if (!base->ln_map[level]) continue;
+    
+                u64 cur = base->clk >> shift;
+                for (u64 k = 1; k <= WHEEL_LN_SIZE; k++) {
+                    if (base->ln_map[level] & (1ULL << ((cur + k) & (WHEEL_LN_SIZE - 1)))) {
+                        u64 when = (cur + k) << shift;
+                        if (when < best) best = when;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    spin_unlock(&base->lock);
+    return best;
 }
\ No newline at end of file
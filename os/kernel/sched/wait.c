@@ -0,0 +1,135 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Wait queues
+//
+// A sleeper puts a waiter (on its own stack) on the queue with the queue
+// locked, so the condition it waits for can be checked under the same
+// lock without missing a wakeup, then blocks in the scheduler. A waker
+// takes the waiter off the queue and clears its wq pointer before waking
+// the thread; a timeout does the same, leaving woken false.
+//
+// Contexts that are not threads (kmain, user mode entered from it) cannot
+// block: they wait for wq to clear, halting between interrupts or, with
+// interrupts off, running their own expired timers.
+
+void wait_queue_init(wait_queue_t *wq) {
+    wq->lock.locked = 0;
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+static void waiter_link(wait_queue_t *wq, waiter_t *w) {
+    w->next = NULL;
+    w->prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->next = w;
+    } else {
+        wq->head = w;
+    }
+    wq->tail = w;
+    w->wq = wq;
+}
+
+static void waiter_unlink(wait_queue_t *wq, waiter_t *w) {
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        wq->head = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    } else {
+        wq->tail = w->prev;
+    }
+    w->next = NULL;
+    w->prev = NULL;
+}
+
+// Take a waiter off its queue (locked by the caller) and wake it. Clearing
+// wq is the last touch: a polling waiter may return right after.
+static void waiter_wake(wait_queue_t *wq, waiter_t *w, bool woken) {
+    thread_t *t = w->thread;
+    waiter_unlink(wq, w);
+    w->woken = woken;
+    __atomic_store_n(&w->wq, NULL, __ATOMIC_RELEASE);
+    if (t) sched_wake(t);
+}
+
+// Lock the queue a waiter is on; it may be moved by a requeue until then.
+// NULL if it has been woken already.
+static wait_queue_t *lock_waiter_queue(waiter_t *w) {
+    for (;;) {
+        wait_queue_t *wq = __atomic_load_n(&w->wq, __ATOMIC_ACQUIRE);
+        if (!wq) return NULL;
+        spin_lock(&wq->lock);
+        if (w->wq == wq) return wq;
+        spin_unlock(&wq->lock);
+    }
+}
+
+static void wait_timeout(void *arg) {
+    waiter_t *w = (waiter_t *)arg;
+    wait_queue_t *wq = lock_waiter_queue(w);
+    if (!wq) return;
+    
+    waiter_wake(wq, w, false);
+    spin_unlock(&wq->lock);
+}
+
+// Sleep on wq until woken, or for at most timeout_ms (0: no timeout).
+// Called with wq->lock held, returns with it released; false on timeout.
+bool wait_queue_sleep(wait_queue_t *wq, waiter_t *w, u64 timeout_ms) {
+    thread_t *t = sched_current_thread();
+    w->thread = t;
+    w->woken = false;
+    waiter_link(wq, w);
+    
+    ktimer_t timer;
+    ktimer_init(&timer, wait_timeout, w);
+    if (timeout_ms) ktimer_add(&timer, timeout_ms);
+    
+    if (t) {
+        sched_block(&wq->lock);
+    } else {
+        spin_unlock(&wq->lock);
+        while (__atomic_load_n(&w->wq, __ATOMIC_ACQUIRE)) {
+            u64 flags;
+            __asm__ volatile("pushfq; popq %0" : "=r"(flags));
+            if (flags & (1u << 9)) {
+                __asm__ volatile("hlt");
+            } else {
+                __asm__ volatile("pause");
+                ktimer_run_expired();
+            }
+        }
+    }
+    
+    // The timeout callback may still be running elsewhere: wait it out
+    // before the waiter goes out of scope
+    ktimer_cancel(&timer);
+    return w->woken;
+}
+
+// Wake one waiter; wq->lock held by the caller
+void wait_queue_wake_waiter(wait_queue_t *wq, waiter_t *w) {
+    waiter_wake(wq, w, true);
+}
+
+// Move a waiter between queues without waking it; both locked by the caller
+void wait_queue_move(wait_queue_t *from, wait_queue_t *to, waiter_t *w) {
+    waiter_unlink(from, w);
+    waiter_link(to, w);
+}
+
+// Wake up to count waiters, oldest first; returns how many were woken
+u32 wait_queue_wake(wait_queue_t *wq, u32 count) {
+    u32 woken = 0;
+    spin_lock(&wq->lock);
+    while (woken < count && wq->head) {
+        waiter_wake(wq, wq->head, true);
+        woken++;
+    }
+    spin_unlock(&wq->lock);
+    return woken;
+}
\ No newline at end of file
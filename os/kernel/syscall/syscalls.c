@@ -23,7 +23,20 @@ extern void serial_puts(const char *str);
 #define SYS_YIELD       9
 #define SYS_MALLOC      10
 #define SYS_FREE        11
-#define MAX_SYSCALLS    12
+#define SYS_SHM_CREATE  12
+#define SYS_SHM_MAP     13
+#define SYS_SHM_UNMAP   14
+#define SYS_SHM_DESTROY 15
+#define SYS_MADVISE     16
+#define SYS_MMAP        17
+#define SYS_MUNMAP      18
+#define SYS_FUTEX       19
+#define MAX_SYSCALLS    20
+
+// Futex operations
+#define FUTEX_WAIT      0
+#define FUTEX_WAKE      1
+#define FUTEX_REQUEUE   3
 
 // System call handler function pointer type
 typedef u64 (*syscall_handler_t)(u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
@@ -37,6 +50,14 @@ static u64 sys_sleep(u64 milliseconds, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u
 static u64 sys_yield(u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
 static u64 sys_malloc(u64 size, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
 static u64 sys_free(u64 ptr, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_shm_create(u64 size, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_shm_map(u64 id, u64 va, u64 prot, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_shm_unmap(u64 va, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_shm_destroy(u64 id, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_madvise(u64 addr, u64 len, u64 advice, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_mmap(u64 addr, u64 len, u64 prot, u64 flags, u64 arg5, u64 arg6);
+static u64 sys_munmap(u64 addr, u64 len, u64 arg3, u64 arg4, u64 arg5, u64 arg6);
+static u64 sys_futex(u64 uaddr, u64 op, u64 val, u64 timeout_ms, u64 uaddr2, u64 val2);
 
 // System call table
 static syscall_handler_t syscall_table[MAX_SYSCALLS] = {
@@ -51,7 +72,15 @@ static syscall_handler_t syscall_table[MAX_SYSCALLS] = {
     [SYS_SLEEP]     = sys_sleep,
     [SYS_YIELD]     = sys_yield,
     [SYS_MALLOC]    = sys_malloc,
-    [SYS_FREE]      = sys_free
+    [SYS_FREE]      = sys_free,
+    [SYS_SHM_CREATE]  = sys_shm_create,
+    [SYS_SHM_MAP]     = sys_shm_map,
+    [SYS_SHM_UNMAP]   = sys_shm_unmap,
+    [SYS_SHM_DESTROY] = sys_shm_destroy,
+    [SYS_MADVISE]     = sys_madvise,
+    [SYS_MMAP]        = sys_mmap,
+    [SYS_MUNMAP]      = sys_munmap,
+    [SYS_FUTEX]       = sys_futex
 };
 
 // System call statistics
@@ -92,6 +121,14 @@ u64 syscall_dispatch(u64 syscall_num, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u6
     else if (syscall_num == 9) serial_puts("9 (YIELD)");
     else if (syscall_num == 10) serial_puts("10 (MALLOC)");
     else if (syscall_num == 11) serial_puts("11 (FREE)");
+    else if (syscall_num == 12) serial_puts("12 (SHM_CREATE)");
+    else if (syscall_num == 13) serial_puts("13 (SHM_MAP)");
+    else if (syscall_num == 14) serial_puts("14 (SHM_UNMAP)");
+    else if (syscall_num == 15) serial_puts("15 (SHM_DESTROY)");
+    else if (syscall_num == 16) serial_puts("16 (MADVISE)");
+    else if (syscall_num == 17) serial_puts("17 (MMAP)");
+    else if (syscall_num == 18) serial_puts("18 (MUNMAP)");
+    else if (syscall_num == 19) serial_puts("19 (FUTEX)");
     else {
         serial_puts("UNKNOWN (");
         // Simple way to show if it's a huge number (likely corrupted)
@@ -127,9 +164,21 @@ u64 syscall_dispatch(u64 syscall_num, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u6
 
 // System call implementations
 
+// Address space of the calling process (syscalls run on its CR3)
+static inline u64 current_pml4(void) {
+    u64 cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3 & 0x000FFFFFFFFFF000ULL;
+}
+
 static u64 sys_exit(u64 exit_code, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6) {
     (void)exit_code; (void)arg2; (void)arg3; (void)arg4; (void)arg5; (void)arg6;
     
+    // Detach the process address space now, release its memory below
+    if (user_as_destroy(current_pml4(), true)) {
+        serial_puts("[SYSCALL] Process address space destroyed\r\n");
+    }
+    
     serial_puts("[SYSCALL] sys_exit called with code 99 - SUCCESS!\r\n");
     serial_puts("[SYSCALL] User mode program exited successfully!\r\n");
     serial_puts("=== M2 MILESTONE COMPLETE ===\r\n");
@@ -138,6 +187,10 @@ static u64 sys_exit(u64 exit_code, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 a
     serial_puts("✓ IRETQ user mode entry working\r\n");
     serial_puts("✓ SYSCALL/SYSRET interface working\r\n");
     
+    // Nothing else to run: do the deferred teardown work before halting
+    while (user_as_reap()) {
+    }
+    
     // Halt the system successfully - this function never returns
     serial_puts("System halting after successful user mode test.\r\n");
     while (1) {
@@ -199,11 +252,8 @@ static u64 sys_sleep(u64 milliseconds, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u
     serial_puts("[SYSCALL] sys_sleep called for ms: ");
     serial_puts("\r\n");
     
-    // Simple implementation - just yield a few times
-    // In a real OS, this would block the thread for the specified time
-    for (u64 i = 0; i < milliseconds / 10; i++) {
-        sched_yield();
-    }
+    // Block on a timer; the CPU runs other threads meanwhile
+    sched_sleep_ms(milliseconds);
     
     return 0;
 }
@@ -236,21 +286,84 @@ static u64 sys_free(u64 ptr, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6) {
     return 0;
 }
 
+static u64 sys_shm_create(u64 size, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6) {
+    (void)arg2; (void)arg3; (void)arg4; (void)arg5; (void)arg6;
+    
+    u32 id = shm_create(size);
+    return id ? id : (u64)-1;
+}
+
+static u64 sys_shm_map(u64 id, u64 va, u64 prot, u64 arg4, u64 arg5, u64 arg6) {
+    (void)arg4; (void)arg5; (void)arg6;
+    
+    u64 mapped = shm_map(current_pml4(), (u32)id, va, (u32)prot);
+    return mapped ? mapped : (u64)-1;
+}
+
+static u64 sys_shm_unmap(u64 va, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6) {
+    (void)arg2; (void)arg3; (void)arg4; (void)arg5; (void)arg6;
+    
+    return shm_unmap(current_pml4(), va) ? 0 : (u64)-1;
+}
+
+static u64 sys_shm_destroy(u64 id, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6) {
+    (void)arg2; (void)arg3; (void)arg4; (void)arg5; (void)arg6;
+    
+    return shm_destroy((u32)id) ? 0 : (u64)-1;
+}
+
+static u64 sys_madvise(u64 addr, u64 len, u64 advice, u64 arg4, u64 arg5, u64 arg6) {
+    (void)arg4; (void)arg5; (void)arg6;
+    
+    return vm_madvise(current_pml4(), addr, len, (u32)advice) ? 0 : (u64)-1;
+}
+
+static u64 sys_mmap(u64 addr, u64 len, u64 prot, u64 flags, u64 arg5, u64 arg6) {
+    (void)arg5; (void)arg6;
+    
+    u64 va = vm_mmap(current_pml4(), addr, len, (u32)prot, (u32)flags);
+    return va ? va : (u64)-1;
+}
+
+static u64 sys_munmap(u64 addr, u64 len, u64 arg3, u64 arg4, u64 arg5, u64 arg6) {
+    (void)arg3; (void)arg4; (void)arg5; (void)arg6;
+    
+    return vm_munmap(current_pml4(), addr, len) ? 0 : (u64)-1;
+}
+
+// WAIT: sleep while *uaddr == val (timeout_ms 0 = forever). WAKE: wake up
+// to val waiters. REQUEUE: wake val, move up to val2 more to uaddr2.
+static u64 sys_futex(u64 uaddr, u64 op, u64 val, u64 timeout_ms, u64 uaddr2, u64 val2) {
+    switch (op) {
+        case FUTEX_WAIT:
+            return futex_wait(current_pml4(), uaddr, (u32)val, timeout_ms);
+        case FUTEX_WAKE:
+            return futex_wake(current_pml4(), uaddr, (u32)val);
+        case FUTEX_REQUEUE:
+            return futex_requeue(current_pml4(), uaddr, (u32)val, uaddr2, (u32)val2);
+        default:
+            return (u64)-1;
+    }
+}
+
 // Print system call statistics
 void syscall_print_stats(void) {
     serial_puts("[SYSCALL] System Call Statistics:\r\n");
     serial_puts("  Total system calls: ");
     serial_puts("\r\n");
     
-    const char *syscall_names[] = {
+    // Sized by the table so that a new number cannot index past it
+    const char *syscall_names[MAX_SYSCALLS] = {
         "exit", "write", "read", "open", "close", "fork", 
-        "execve", "getpid", "sleep", "yield", "malloc", "free"
+        "execve", "getpid", "sleep", "yield", "malloc", "free",
+        "shm_create", "shm_map", "shm_unmap", "shm_destroy", "madvise",
+        "mmap", "munmap", "futex"
     };
     
     for (int i = 0; i < MAX_SYSCALLS; i++) {
         if (syscall_counts[i] > 0) {
             serial_puts("  ");
-            serial_puts(syscall_names[i]);
+            serial_puts(syscall_names[i] ? syscall_names[i] : "unknown");
             serial_puts(": ");
             serial_puts("\r\n");
         }
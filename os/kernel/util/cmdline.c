@@ -0,0 +1,41 @@
+#include <myria/types.h>
+#include <myria/kapi.h>
+
+// Kernel command line, passed by Limine via CMDLINE= in limine.cfg
+extern struct limine_kernel_file_request limine_kernel_file_request;
+
+// Get the raw command line (empty string if the bootloader gave none)
+const char *cmdline_get(void) {
+    struct limine_kernel_file_response *resp = limine_kernel_file_request.response;
+    
+    if (!resp || !resp->kernel_file || !resp->kernel_file->cmdline) {
+        return "";
+    }
+    return resp->kernel_file->cmdline;
+}
+
+// Check for an exact whitespace-separated token, e.g. "pti=on"
+bool cmdline_has_option(const char *option) {
+    const char *p = cmdline_get();
+    
+    while (*p) {
+        // Skip separators
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        
+        // Compare this token against the option
+        const char *o = option;
+        while (*o && *p == *o) {
+            p++;
+            o++;
+        }
+        if (!*o && (*p == 0 || *p == ' ' || *p == '\t')) {
+            return true;
+        }
+        
+        // Skip the rest of a non-matching token
+        while (*p && *p != ' ' && *p != '\t') p++;
+    }
+    
+    return false;
+}
\ No newline at end of file
@@ -13,39 +13,71 @@
 // Line status bits
 #define SERIAL_LINE_ENABLE_DLAB 0x80
 
+// COM1 is written from every CPU; whole strings go out under the lock so
+// log lines do not interleave
+static spinlock_t serial_lock;
+
 void serial_init(void) {
+    serial_port_init(SERIAL_COM1_BASE);
+}
+
+// Program a 16550 UART: 38400 8N1, FIFOs on, polled
+void serial_port_init(u16 base) {
     // Disable all interrupts
-    outb(SERIAL_COM1_BASE + 1, 0x00);
+    outb(base + 1, 0x00);
     
     // Enable DLAB (set baud rate divisor)
-    outb(SERIAL_LINE_COMMAND_PORT(SERIAL_COM1_BASE), SERIAL_LINE_ENABLE_DLAB);
+    outb(SERIAL_LINE_COMMAND_PORT(base), SERIAL_LINE_ENABLE_DLAB);
     
     // Set divisor to 3 (lo byte) 38400 baud
-    outb(SERIAL_DATA_PORT(SERIAL_COM1_BASE), 0x03);
-    outb(SERIAL_COM1_BASE + 1, 0x00);  // (hi byte)
+    outb(SERIAL_DATA_PORT(base), 0x03);
+    outb(base + 1, 0x00);  // (hi byte)
     
     // 8 bits, no parity, one stop bit
-    outb(SERIAL_LINE_COMMAND_PORT(SERIAL_COM1_BASE), 0x03);
+    outb(SERIAL_LINE_COMMAND_PORT(base), 0x03);
     
     // Enable FIFO, clear them, with 14-byte threshold
-    outb(SERIAL_FIFO_COMMAND_PORT(SERIAL_COM1_BASE), 0xC7);
+    outb(SERIAL_FIFO_COMMAND_PORT(base), 0xC7);
     
     // IRQs enabled, RTS/DSR set
-    outb(SERIAL_MODEM_COMMAND_PORT(SERIAL_COM1_BASE), 0x0B);
+    outb(SERIAL_MODEM_COMMAND_PORT(base), 0x0B);
 }
 
 static int serial_is_transmit_fifo_empty(u16 com) {
     return inb(SERIAL_LINE_STATUS_PORT(com)) & 0x20;
 }
 
-void serial_putc(char c) {
+static void serial_putc_locked(char c) {
     while (serial_is_transmit_fifo_empty(SERIAL_COM1_BASE) == 0);
     outb(SERIAL_COM1_BASE, c);
 }
 
+void serial_putc(char c) {
+    spin_lock(&serial_lock);
+    serial_putc_locked(c);
+    spin_unlock(&serial_lock);
+}
+
 void serial_puts(const char *str) {
+    spin_lock(&serial_lock);
     while (*str) {
-        serial_putc(*str);
+        serial_putc_locked(*str);
         str++;
     }
+    spin_unlock(&serial_lock);
+}
+
+// Raw byte I/O on any UART (e.g. COM2 as a data link)
+void serial_port_write(u16 base, u8 byte) {
+    while (serial_is_transmit_fifo_empty(base) == 0);
+    outb(SERIAL_DATA_PORT(base), byte);
+}
+
+bool serial_port_ready(u16 base) {
+    return (inb(SERIAL_LINE_STATUS_PORT(base)) & 0x01) != 0;
+}
+
+u8 serial_port_read(u16 base) {
+    while (!serial_port_ready(base));
+    return inb(SERIAL_DATA_PORT(base));
 }
\ No newline at end of file